@@ -0,0 +1,1108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "common.h"
+
+// commands that changed the data set are appended to a buffer while they
+// run, the buffer is written once per event loop iteration before the
+// replies of that iteration go out. The fsync policy decides when the
+// writes reach the disk:
+//   FSYNC_ALWAYS   after every write, no client sees the reply to a write
+//                  a crash could lose
+//   FSYNC_EVERYSEC once a second from a background thread, a crash loses
+//                  about a second of writes at most
+//   FSYNC_NO       whenever the kernel gets to it
+//
+// The log is a list of segments, files named after it with a number, kept
+// in order in its manifest. Segments are preallocated to AOF_SEGMENT_SIZE
+// so that appending doesn't allocate blocks or change the file size, and
+// a new one is started once the current one is full. The manifest may
+// also name a snapshot the segments follow.
+//
+// Before a snapshot is taken appending moves to a new segment, and once it
+// is saved the segments before that one are dropped. The log can also be
+// rewritten: a forked child writes the data set as of the fork while the
+// parent appends to a new segment, and the child's file then replaces the
+// segments before that one. With AOF_USE_PREAMBLE the child writes a
+// binary file that starts with a snapshot, which loads much faster than
+// replaying commands, otherwise the commands that rebuild each key
+//
+// Binary format, integers are unsigned LEB128 varints:
+//   "VEROAOF" version(1 byte) ncommands, then namelen name for each
+//   command id, in version 2 the length of the preamble (8 bytes), then
+//   the crc32c of the header
+//   preamble: a snapshot of that length, in version 2
+//   blocks: length(4 bytes) crc32c(4 bytes), then length bytes of records
+//   records: id argc, then len arg and a null byte for each argument
+// The crc32c of a block covers its length and its records, a zero length
+// and checksum is the unwritten part of a segment. Every write is a whole
+// number of blocks, so a block cut short by a crash can only be the last
+// one. Arguments keep their null byte so replay hands them to the commands
+// straight from the mapping. Files without the magic are read as the text
+// format, a command per line as command_join writes it, up to a null byte
+
+#define REWRITE_ITEMS 64    // elements per command of a rewritten collection
+#define REWRITE_BUF (1 << 20)   // bytes the child encodes between writes
+
+#define AOF_MAGIC "VEROAOF"
+#define AOF_VERSION 1
+#define AOF_VERSION_PREAMBLE 2  // the header is followed by a snapshot
+#define AOF_HEADER 8            // magic and version
+#define AOF_BLOCK_HEADER 8      // length and crc32c
+#define AOF_BLOCK_SIZE (1 << 20)    // a block is closed once this big
+
+long long AOF_SEGMENT_SIZE = 64 * 1024 * 1024;
+int AOF_USE_PREAMBLE = 1;
+
+// encoded commands waiting to be written. In the binary format they are
+// grouped in blocks, whose header is filled in by seal
+typedef struct Buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+    long long block;    // offset of the open block, -1 if there is none
+    int format;
+} Buffer;
+
+static int fd = -1;                 // the segment appended to
+static char filename[256];          // the segments and manifest are named after
+static char **segments = NULL;      // oldest first, fd is the last one
+static int nsegments = 0;
+static int next_segment = 1;        // number of the next new segment
+static char snapshot[256];          // what the segments follow, "" if nothing
+static long long offset = 0;        // where the next write goes in fd
+static long long segment_start = 0; // where the commands of fd start
+static bool partial = false;        // the last write stopped inside a block
+static int policy = FSYNC_NO;
+static int new_format = AOF_BINARY; // of new segments
+static Buffer out = {.block = -1};  // appended commands not written yet
+static AofStats stats = {.last_ok = true, .last_rewrite_ok = true};
+
+static pid_t child = -1;
+static char rewrite_tmp[300];
+static int rewrite_from = -1;   // first segment the running rewrite lacks
+static int snapshot_from = -1;  // first segment the running snapshot lacks
+
+static pthread_t fsync_thread;
+static pthread_mutex_t fsync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fsync_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping = false;
+static bool unsynced = false;   // written since the last fsync
+
+static const char *policy_names[] = {
+    [FSYNC_NO] = "no", [FSYNC_EVERYSEC] = "everysec",
+    [FSYNC_ALWAYS] = "always",
+};
+
+static const char *format_names[] = {
+    [AOF_TEXT] = "text", [AOF_BINARY] = "binary",
+};
+
+static void *fsync_loop(void *arg) {
+    pthread_mutex_lock(&fsync_lock);
+    while (!stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&fsync_cond, &fsync_lock, &ts);
+        if (__atomic_exchange_n(&unsynced, false, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&fsync_lock);
+            fdatasync(fd);
+            pthread_mutex_lock(&fsync_lock);
+        }
+    }
+    pthread_mutex_unlock(&fsync_lock);
+    return NULL;
+}
+
+static void put_le32(unsigned char *p, uint32_t x) {
+    for (int i = 0; i < 4; i++) p[i] = x >> (8 * i);
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// the varint at *p, false if it runs past end
+static bool get_varint(unsigned char **p, unsigned char *end, uint64_t *x) {
+    *x = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char b = *(*p)++;
+        *x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static void reserve(Buffer *b, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = b->len + n > 2 * b->cap ? b->len + n : 2 * b->cap;
+        b->data = drealloc(b->data, b->cap);
+    }
+}
+
+static void put_varint(Buffer *b, uint64_t x) {
+    reserve(b, 10);
+    while (x >= 0x80) {
+        b->data[b->len++] = (x & 0x7f) | 0x80;
+        x >>= 7;
+    }
+    b->data[b->len++] = x;
+}
+
+static void put_bytes(Buffer *b, const char *p, size_t n) {
+    reserve(b, n);
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+// fills in the header of the open block
+static void seal(Buffer *b) {
+    if (b->block < 0) return;
+    unsigned char *h = (unsigned char *)b->data + b->block;
+    size_t n = b->len - b->block - AOF_BLOCK_HEADER;
+    put_le32(h, n);
+    put_le32(h + 4, crc32c(crc32c(0, h, 4), h + AOF_BLOCK_HEADER, n));
+    b->block = -1;
+}
+
+// appends the command of type with argc arguments to b
+static void encode(Buffer *b, int type, int argc, char **argv) {
+    if (b->format == AOF_TEXT) {
+        const char *name = command_def(type)->name;
+        size_t size = strlen(name) + 2;
+        for (int i = 0; i < argc; i++) size += strlen(argv[i]) + 3;
+        reserve(b, size);
+        char *p = stpcpy(b->data + b->len, name);
+        for (int i = 0; i < argc; i++) {
+            *p++ = ' ';
+            p += arg_quote(p, argv[i]);
+        }
+        *p++ = '\n';
+        b->len = p - b->data;
+        return;
+    }
+    if (b->block < 0) {
+        reserve(b, AOF_BLOCK_HEADER);
+        b->block = b->len;
+        b->len += AOF_BLOCK_HEADER;
+    }
+    put_varint(b, type);
+    put_varint(b, argc);
+    for (int i = 0; i < argc; i++) {
+        size_t n = strlen(argv[i]);
+        put_varint(b, n);
+        put_bytes(b, argv[i], n + 1);
+    }
+    if (b->len - b->block >= AOF_BLOCK_SIZE) seal(b);
+}
+
+static bool write_all(int to, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(to, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+static long long file_size(int of) {
+    struct stat st;
+    return fstat(of, &st) == 0 ? st.st_size : 0;
+}
+
+// the header of a binary file into b. Records name commands by id, the
+// header lists the name of each id so that the ids of a file keep their
+// meaning when commands are added. A preamble of -1 is a file without one
+static void put_header(Buffer *b, long long preamble) {
+    put_bytes(b, AOF_MAGIC, AOF_HEADER - 1);
+    put_varint(b, preamble < 0 ? AOF_VERSION : AOF_VERSION_PREAMBLE);
+    put_varint(b, NOOP + 1);
+    for (int type = 0; type <= NOOP; type++) {
+        const char *name = command_def(type)->name;
+        if (name == NULL) name = "";
+        put_varint(b, strlen(name));
+        put_bytes(b, name, strlen(name));
+    }
+    reserve(b, 12);
+    if (preamble >= 0) {
+        put_le32((unsigned char *)b->data + b->len, preamble);
+        put_le32((unsigned char *)b->data + b->len + 4, preamble >> 32);
+        b->len += 8;
+    }
+    put_le32((unsigned char *)b->data + b->len, crc32c(0, b->data, b->len));
+    b->len += 4;
+}
+
+static bool write_header(int to) {
+    Buffer b = {.block = -1};
+    put_header(&b, -1);
+    bool ok = write_all(to, b.data, b.len);
+    free(b.data);
+    return ok;
+}
+
+static void free_names(char **names, int n) {
+    for (int i = 0; i < n; i++) str_free(names[i]);
+    free(names);
+}
+
+// reads the manifest of the log named name into names and snap. Returns 0,
+// -1 if there is none or -2 if it can't be read
+static int read_manifest(const char *name, char ***names, int *n,
+                         char *snap, size_t snap_size) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s.manifest", name);
+    FILE *f = fopen(path, "r");
+    *names = NULL;
+    *n = 0;
+    snap[0] = '\0';
+    if (f == NULL) return errno == ENOENT ? -1 : -2;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int res = 0;
+    while ((len = getline(&line, &size, f)) > 0) {
+        if (line[len - 1] != '\n') res = -2;    // the rename makes it whole
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "segment ", 8) == 0) {
+            *names = drealloc(*names, (*n + 1) * sizeof(char *));
+            (*names)[(*n)++] = str_dup(line + 8);
+        } else if (strncmp(line, "snapshot ", 9) == 0) {
+            snprintf(snap, snap_size, "%s", line + 9);
+        } else if (line[0] != '#') {
+            res = -2;
+        }
+    }
+    free(line);
+    fclose(f);
+    if (res < 0) {
+        free_names(*names, *n);
+        *names = NULL;
+        *n = 0;
+    }
+    return res;
+}
+
+// writes the manifest to a temporary file renamed over the old one, so a
+// crash leaves either of them
+static bool write_manifest(void) {
+    char path[300], tmp[310];
+    snprintf(path, sizeof(path), "%s.manifest", filename);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) return false;
+    fputs("# verokv append only file\n", f);
+    if (snapshot[0] != '\0') fprintf(f, "snapshot %s\n", snapshot);
+    for (int i = 0; i < nsegments; i++) {
+        fprintf(f, "segment %s\n", segments[i]);
+    }
+    bool ok = fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        perror("Failed to write the AOF manifest");
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+// the writes of a transaction are logged between MULTI and EXEC. They are
+// held back until the EXEC, a log that ends inside a transaction applies
+// none of it
+typedef struct Replay {
+    HashTable *ht;
+    Command **queued;   // copies, the log's own commands don't outlive it
+    int len;
+    int cap;
+    bool open;          // a MULTI was read and its EXEC not yet
+} Replay;
+
+static void replay_drop(Replay *r) {
+    for (int i = 0; i < r->len; i++) command_free(r->queued[i]);
+    r->len = 0;
+    r->open = false;
+}
+
+// runs cmd, or queues it inside a transaction, and returns how many
+// commands ran
+static long long replay(Replay *r, Command *cmd) {
+    if (cmd->type == MULTI) {
+        replay_drop(r);
+        r->open = true;
+        return 0;
+    }
+    if (cmd->type == EXEC) {
+        long long n = r->len;
+        for (int i = 0; i < r->len; i++) {
+            str_free(interpret(r->ht, r->queued[i]));
+        }
+        replay_drop(r);
+        return n;
+    }
+    if (!r->open) {
+        str_free(interpret(r->ht, cmd));
+        return 1;
+    }
+    if (r->len == r->cap) {
+        r->cap = r->cap > 0 ? r->cap * 2 : 8;
+        r->queued = drealloc(r->queued, r->cap * sizeof(Command *));
+    }
+    r->queued[r->len++] = command_dup(cmd);
+    return 0;
+}
+
+// a transaction left open is dropped along with the rest of the log
+static void replay_end(Replay *r, bool *torn) {
+    if (r->open) *torn = true;
+    replay_drop(r);
+    free(r->queued);
+}
+
+// replays a text log. A last line without its newline was cut short by a
+// crash and doesn't run, torn is set and good to where it starts, or to
+// the MULTI of the transaction it is part of
+static long long load_text(HashTable *ht, char *map, size_t size,
+                           long long *good, bool *torn) {
+    char *p = map, *end = map + size;
+    long long count = 0;
+    Replay r = {.ht = ht};
+    while (p < end && *p != '\0') {
+        char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            *torn = true;
+            break;
+        }
+        if (nl > p) {
+            Command *cmd = parse_line(NULL, p, nl - p);
+            count += replay(&r, cmd);
+            command_free(cmd);
+        }
+        p = nl + 1;
+        if (!r.open) *good = p - map;
+    }
+    replay_end(&r, torn);
+    return count;
+}
+
+// the ids of the commands named in the header of a binary log mapped at
+// map, NULL with *p left at map if the header is cut short or at NULL if
+// it is corrupt. preamble is set to the length of the snapshot that
+// follows the header, 0 if there is none
+static int *read_header(unsigned char **p, unsigned char *map, size_t size,
+                        uint64_t *ncommands, uint64_t *preamble) {
+    unsigned char *q = map + AOF_HEADER, *end = map + size;
+    unsigned char version = map[AOF_HEADER - 1];
+    if (version != AOF_VERSION && version != AOF_VERSION_PREAMBLE) {
+        goto corrupt;
+    }
+    if (!get_varint(&q, end, ncommands)) return NULL;
+    if (*ncommands > size) goto corrupt;
+    int *types = dmalloc((*ncommands + 1) * sizeof(int));
+    for (uint64_t i = 0; i < *ncommands; i++) {
+        uint64_t n;
+        if (!get_varint(&q, end, &n) || n > (uint64_t)(end - q)) {
+            free(types);
+            return NULL;
+        }
+        types[i] = command_lookup((char *)q, n);
+        q += n;
+    }
+    *preamble = 0;
+    if (version == AOF_VERSION_PREAMBLE) {
+        if (end - q < 8) {
+            free(types);
+            return NULL;
+        }
+        *preamble = get_le32(q) | (uint64_t)get_le32(q + 4) << 32;
+        q += 8;
+    }
+    if (end - q < 4) {
+        free(types);
+        return NULL;
+    }
+    if (get_le32(q) != crc32c(0, map, q - map)) {
+        free(types);
+        goto corrupt;
+    }
+    *p = q + 4;
+    return types;
+corrupt:
+    *p = NULL;
+    return NULL;
+}
+
+// replays the binary log mapped at map: loads its preamble, then hands
+// the arguments of each command to it straight from the mapping. A block
+// that runs past the end of the file or fails its checksum there was cut
+// short by a crash, torn is set and good to where it starts. Returns -2
+// for anything else wrong
+static long long load_binary(HashTable *ht, unsigned char *map, size_t size,
+                             long long *good, bool *torn) {
+    unsigned char *p = map, *end = map + size;
+    uint64_t ncommands, preamble;
+    int *types = read_header(&p, map, size, &ncommands, &preamble);
+    if (types == NULL) {
+        *torn = p != NULL;
+        return p == NULL ? -2 : 0;
+    }
+    // a file with a preamble is complete before it is put in the log
+    if (preamble > (uint64_t)(end - p) ||
+        (preamble > 0 && load_snapshot_at(ht, p, preamble) != 0)) {
+        free(types);
+        return -2;
+    }
+    p += preamble;
+    *good = p - map;
+
+    Arena *a = arena_init(ARENA_SIZE);
+    Command cmd = {.argv = NULL, .argl = NULL, .arena = a, .resp = 2};
+    Replay r = {.ht = ht};
+    uint64_t max = 0;
+    long long count = 0;
+    while (count >= 0 && p < end) {
+        if (end - p < AOF_BLOCK_HEADER) {
+            *torn = true;
+            break;
+        }
+        size_t n = get_le32(p);
+        uint32_t crc = get_le32(p + 4);
+        unsigned char *q = p + AOF_BLOCK_HEADER, *block_end = q + n;
+        if (n == 0 && crc == 0) break;      // preallocated, never written
+        if (n > (size_t)(end - q) ||
+            crc != crc32c(crc32c(0, p, 4), q, n)) {
+            // a block cut short may be followed by the unwritten part
+            bool last = n > (size_t)(end - q) || block_end == end ||
+                        (end - block_end >= AOF_BLOCK_HEADER &&
+                         get_le32(block_end) == 0 &&
+                         get_le32(block_end + 4) == 0);
+            if (last) *torn = true;
+            else count = -2;
+            break;
+        }
+        while (q < block_end && count >= 0) {
+            uint64_t id, argc, len;
+            if (!get_varint(&q, block_end, &id) || id >= ncommands ||
+                !get_varint(&q, block_end, &argc) ||
+                argc > (uint64_t)(block_end - q)) {
+                count = -2;
+                break;
+            }
+            if (argc > max) {
+                max = argc;
+                cmd.argv = drealloc(cmd.argv, max * sizeof(char *));
+                cmd.argl = drealloc(cmd.argl, max * sizeof(int));
+            }
+            for (uint64_t i = 0; i < argc; i++) {
+                if (!get_varint(&q, block_end, &len) ||
+                    len >= (uint64_t)(block_end - q) || q[len] != '\0') {
+                    count = -2;
+                    break;
+                }
+                cmd.argv[i] = (char *)q;
+                cmd.argl[i] = len;
+                q += len + 1;
+            }
+            if (count < 0) break;
+            cmd.type = types[id];
+            cmd.name = command_def(cmd.type)->name;
+            if (cmd.name == NULL) cmd.name = "";
+            cmd.argc = argc;
+            count += replay(&r, &cmd);
+            arena_reset(a);
+        }
+        p = block_end;
+        // a MULTI always starts a block, see aof_append
+        if (count >= 0 && !r.open) *good = p - map;
+    }
+    replay_end(&r, torn);
+    free(cmd.argv);
+    free(cmd.argl);
+    free(types);
+    arena_free(a);
+    return count;
+}
+
+// replays a segment, -1 if it doesn't exist. A torn write is an error
+// unless the segment is the last one, where it is cut off the file along
+// with the unwritten part
+static long long load_segment(HashTable *ht, const char *name, bool last) {
+    int lfd = open(name, O_RDWR);
+    if (lfd < 0) return -1;
+    long long size = file_size(lfd), good = 0, count = 0;
+    bool torn = false;
+    if (size > 0) {
+        // private and writable, commands may scribble over their arguments
+        // and text lines are split in place
+        unsigned char *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE, lfd, 0);
+        if (map == MAP_FAILED) {
+            close(lfd);
+            return -2;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        bool binary = size >= AOF_HEADER &&
+                      memcmp(map, AOF_MAGIC, AOF_HEADER - 1) == 0;
+        count = binary ? load_binary(ht, map, size, &good, &torn)
+                       : load_text(ht, (char *)map, size, &good, &torn);
+        munmap(map, size);
+    }
+    if (count >= 0 && torn && !last) count = -2;
+    if (count >= 0 && torn) {
+        fprintf(stderr, "AOF ends in an incomplete write, dropping its last "
+                "%lld bytes\n", size - good);
+    }
+    if (count >= 0 && last && good < size && ftruncate(lfd, good) != 0) {
+        perror("Failed to truncate the AOF");
+    }
+    close(lfd);
+    return count;
+}
+
+// whether the log named filename has a manifest, and so knows which
+// snapshot it follows. One that can't be looked at counts as there
+bool aof_has_manifest(const char *filename) {
+    char path[300];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s.manifest", filename);
+    return stat(path, &st) == 0 || errno != ENOENT;
+}
+
+// replays the log named filename into ht: the snapshot its manifest names,
+// then its segments. A file of that name without a manifest is a log of a
+// single segment. Returns how many commands ran, -1 if there is no log or
+// -2 if it is corrupt
+long long aof_load(HashTable *ht, const char *filename) {
+    char **names, snap[256];
+    int n;
+    int res = read_manifest(filename, &names, &n, snap, sizeof(snap));
+    if (res == -2) return -2;
+    if (res == -1) {
+        struct stat st;
+        if (stat(filename, &st) != 0 || st.st_size == 0) return -1;
+        return load_segment(ht, filename, true);
+    }
+    long long count = 0;
+    if (snap[0] != '\0' && load_snapshot(ht, snap) != 0) count = -2;
+    for (int i = 0; i < n && count >= 0; i++) {
+        long long c = load_segment(ht, names[i], i == n - 1);
+        count = c < 0 ? -2 : count + c;
+    }
+    free_names(names, n);
+    return count;
+}
+
+// the number in the name of a segment, 0 for one that isn't numbered
+static int segment_number(const char *name) {
+    size_t n = strlen(filename);
+    int number = 0;
+    if (strncmp(name, filename, n) == 0) sscanf(name + n, ".%d", &number);
+    return number;
+}
+
+// bytes of commands in the segments, the current one included
+static long long segments_size(void) {
+    long long size = offset;
+    for (int i = 0; i < nsegments - 1; i++) {
+        struct stat st;
+        if (stat(segments[i], &st) == 0) size += st.st_size;
+    }
+    return size;
+}
+
+// starts a new preallocated segment and adds it to the manifest, returns
+// its descriptor or -1. offset and segment_start are set for it
+static int new_segment(void) {
+    char name[300];
+    snprintf(name, sizeof(name), "%s.%06d", filename, next_segment);
+    int nfd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (nfd < 0) {
+        perror("Failed to create an AOF segment");
+        return -1;
+    }
+    // without it appending still works, only the size changes every time
+    posix_fallocate(nfd, 0, AOF_SEGMENT_SIZE);
+    bool ok = new_format == AOF_TEXT || write_header(nfd);
+    if (ok) {
+        segments = drealloc(segments, (nsegments + 1) * sizeof(char *));
+        segments[nsegments++] = str_dup(name);
+        ok = write_manifest();
+        if (!ok) str_free(segments[--nsegments]);
+    }
+    if (!ok) {
+        close(nfd);
+        unlink(name);
+        return -1;
+    }
+    next_segment++;
+    offset = segment_start = lseek(nfd, 0, SEEK_CUR);
+    out.format = new_format;
+    return nfd;
+}
+
+// moves appending to a new segment, unless a block was left half written.
+// The finished segment is cut to what it holds and synced. The descriptor
+// keeps its number, so the fsync thread never sees a closed one
+static bool rotate(void) {
+    if (partial) return false;
+    if (offset == segment_start) return true;   // nothing to move away from
+    long long end = offset;
+    int nfd = new_segment();
+    if (nfd < 0) return false;
+    if (ftruncate(fd, end) != 0) perror("Failed to truncate an AOF segment");
+    if (policy != FSYNC_NO) fdatasync(fd);
+    dup2(nfd, fd);
+    close(nfd);
+    return true;
+}
+
+// whether snap is a link aof_snapshot_done made, rather than a snapshot
+// the server also keeps under its usual name
+static bool owned_snapshot(const char *snap) {
+    size_t n = strlen(filename), len = strlen(snap);
+    return strncmp(snap, filename, n) == 0 && len > n + 5 &&
+           strcmp(snap + len - 5, ".snap") == 0;
+}
+
+// replaces the segments before from with base, when there is one, and
+// makes the log follow snap, "" for nothing. The segments left out are
+// deleted once the manifest no longer lists them
+static bool drop_segments(int from, const char *base, const char *snap) {
+    char **old = segments, old_snap[256];
+    int nold = nsegments;
+    snprintf(old_snap, sizeof(old_snap), "%s", snapshot);
+    segments = dmalloc((nold - from + 1) * sizeof(char *));
+    nsegments = 0;
+    if (base != NULL) segments[nsegments++] = str_dup(base);
+    for (int i = from; i < nold; i++) segments[nsegments++] = old[i];
+    snprintf(snapshot, sizeof(snapshot), "%s", snap);
+    if (!write_manifest()) {
+        if (base != NULL) str_free(segments[0]);
+        free(segments);
+        segments = old;
+        nsegments = nold;
+        snprintf(snapshot, sizeof(snapshot), "%s", old_snap);
+        return false;
+    }
+    for (int i = 0; i < from; i++) {
+        unlink(old[i]);
+        str_free(old[i]);
+    }
+    free(old);
+    if (owned_snapshot(old_snap) && strcmp(old_snap, snapshot) != 0) {
+        unlink(old_snap);
+    }
+    stats.size = stats.base_size = segments_size();
+    return true;
+}
+
+// opens the log named name for appending with the given fsync policy.
+// Appending goes to a new segment in format, the ones already there are
+// kept as they are. snap is the snapshot the data set was loaded from, or
+// NULL. A log without a manifest yet starts from it, so that the manifest
+// written for the new segment doesn't lose what the snapshot holds
+bool aof_open(const char *name, int fsync_policy, int format,
+              const char *snap) {
+    snprintf(filename, sizeof(filename), "%s", name);
+    int res = read_manifest(name, &segments, &nsegments, snapshot,
+                            sizeof(snapshot));
+    if (res == -2) return false;
+    if (res == -1) {
+        snprintf(snapshot, sizeof(snapshot), "%s", snap != NULL ? snap : "");
+    }
+    struct stat st;
+    if (res == -1 && stat(name, &st) == 0 && st.st_size > 0) {
+        segments = dmalloc(sizeof(char *));
+        segments[nsegments++] = str_dup(name);
+    }
+    next_segment = 1;
+    for (int i = 0; i < nsegments; i++) {
+        int number = segment_number(segments[i]);
+        if (number >= next_segment) next_segment = number + 1;
+    }
+    new_format = format;
+    partial = false;
+    fd = new_segment();
+    if (fd < 0) {
+        free_names(segments, nsegments);
+        segments = NULL;
+        nsegments = 0;
+        return false;
+    }
+    stats.size = stats.base_size = segments_size();
+    stats.last_ok = true;
+    policy = fsync_policy;
+    stopping = false;
+    if (policy == FSYNC_EVERYSEC &&
+        pthread_create(&fsync_thread, NULL, fsync_loop, NULL) != 0) {
+        policy = FSYNC_ALWAYS;  // safer than not syncing at all
+    }
+    return true;
+}
+
+// queues a command that changed the data set, it is written by the next
+// aof_flush. A MULTI starts a block of its own, so that a transaction cut
+// short can be cut off the log without the commands before it
+void aof_append(Command *cmd) {
+    if (cmd->type == MULTI) seal(&out);
+    encode(&out, cmd->type, cmd->argc, cmd->argv);
+}
+
+// writes whatever was appended since the last call with a single write,
+// then syncs it if the policy asks for it. A write that doesn't fit what
+// is left of the segment goes to a new one. What couldn't be written is
+// kept for the next call
+void aof_flush(void) {
+    if (fd < 0 || out.len == 0) return;
+    seal(&out);
+    if (offset + (long long)out.len > AOF_SEGMENT_SIZE) rotate();
+    size_t done = 0;
+    while (done < out.len) {
+        ssize_t n = pwrite(fd, out.data + done, out.len - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    offset += done;
+    stats.size += done;
+    stats.last_ok = done == out.len;
+    if (!stats.last_ok) perror("Error writing to AOF file");
+    if (done > 0) partial = done < out.len;
+    out.len -= done;
+    memmove(out.data, out.data + done, out.len);
+    if (done == 0) return;
+    if (policy == FSYNC_ALWAYS) {
+        fdatasync(fd);
+    } else if (policy == FSYNC_EVERYSEC) {
+        __atomic_store_n(&unsynced, true, __ATOMIC_RELEASE);
+    }
+}
+
+static void put_setbit(Buffer *b, char *key, long long bit, int value) {
+    char pos[24], val[2] = {'0' + value, '\0'};
+    sprintf(pos, "%lld", bit);
+    char *argv[] = {key, pos, val};
+    encode(b, SETBIT, 3, argv);
+}
+
+// a string that holds no newline or null byte and that arg_quote can
+// write, so a single SET rebuilds it
+static bool fits_line(const char *s, int n) {
+    if ((int)strlen(s) != n || memchr(s, '\n', n) != NULL) return false;
+    if (strchr(s, '"') == NULL || strchr(s, '\'') == NULL) return true;
+    if (*s == '"' || *s == '\'') return false;
+    for (int i = 0; i < n; i++) {
+        if (isspace((unsigned char)s[i])) return false;
+    }
+    return true;
+}
+
+// strings a SET can't rebuild, like bitmaps and hyperloglogs, take SETRANGE
+// for runs of ordinary bytes, which pads the gaps with null bytes, and
+// SETBIT for trailing null bytes. In the text format newlines take SETBIT
+// too, and a run stops before a second kind of quote so it can be quoted
+static void rewrite_bytes(Buffer *b, char *key, const char *s, int n) {
+    bool text = b->format == AOF_TEXT;
+    char *chunk = dmalloc(n + 1), off[16];
+    int i = 0;
+    while (i < n) {
+        if (s[i] == '\0') {
+            i++;
+        } else if (text && s[i] == '\n') {
+            for (int bit = 0; bit < 8; bit++) {
+                if (s[i] & (0x80 >> bit)) put_setbit(b, key, i * 8LL + bit, 1);
+            }
+            i++;
+        } else {
+            int j = i;
+            bool sq = false, dq = false;
+            while (j < n && s[j] != '\0' && !(text && s[j] == '\n')) {
+                if (text && s[j] == '\'' && dq) break;
+                if (text && s[j] == '"' && sq) break;
+                sq |= s[j] == '\'';
+                dq |= s[j] == '"';
+                j++;
+            }
+            memcpy(chunk, s + i, j - i);
+            chunk[j - i] = '\0';
+            sprintf(off, "%d", i);
+            char *argv[] = {key, off, chunk};
+            encode(b, SETRANGE, 3, argv);
+            i = j;
+        }
+    }
+    if (s[n - 1] == '\0') put_setbit(b, key, n * 8LL - 1, 0);
+    free(chunk);
+}
+
+static void rewrite_str(Buffer *b, char *key, char *s) {
+    int n = str_len(s);
+    bool fits = b->format == AOF_TEXT ? fits_line(s, n) : (int)strlen(s) == n;
+    if (!fits) {
+        rewrite_bytes(b, key, s, n);
+        return;
+    }
+    char *argv[] = {key, s};
+    encode(b, SET, 2, argv);
+}
+
+// adds the n arguments of an element to the command built in argv, which
+// is written once it holds REWRITE_ITEMS elements, or right away when n
+// is 0 and there is any
+static void put_item(Buffer *b, int type, char **argv, int *argc,
+                     char **item, int n) {
+    for (int i = 0; i < n; i++) argv[(*argc)++] = item[i];
+    if (*argc > 1 && (n == 0 || *argc == 1 + REWRITE_ITEMS * n)) {
+        encode(b, type, *argc, argv);
+        *argc = 1;
+    }
+}
+
+static void rewrite_item(Buffer *b, HashTableItem *item) {
+    char *argv[1 + 2 * REWRITE_ITEMS];
+    int argc = 1, type;
+    argv[0] = item->key;
+    switch (item->type) {
+        case HASH_T: {
+            HashTable *hash = item->value;
+            type = HSET;
+            for (int i = 0; i < hash->size; i++) {
+                HashTableItem *field = hash->items[i];
+                if (field == NULL || field == &HT_DELETED) continue;
+                char *pair[] = {field->key, field->value};
+                put_item(b, type, argv, &argc, pair, 2);
+            }
+            break;
+        }
+        case LIST_T: {
+            List *ls = item->value;
+            ListNode *node = ls->head;
+            type = RPUSH;
+            for (int i = 0; i < ls->len; i++, node = node->next) {
+                put_item(b, type, argv, &argc, &node->value, 1);
+            }
+            break;
+        }
+        case SET_T: {
+            Set *set = item->value;
+            type = SADD;
+            for (int i = 0; i < set->size; i++) {
+                char *member = set->members[i];
+                if (member == NULL || member == &SET_DELETED) continue;
+                put_item(b, type, argv, &argc, &member, 1);
+            }
+            break;
+        }
+        default:
+            rewrite_str(b, item->key, item->value);
+            return;
+    }
+    put_item(b, type, argv, &argc, NULL, 0);
+}
+
+static bool write_buffer(int to, Buffer *b) {
+    seal(b);
+    bool ok = write_all(to, b->data, b->len);
+    b->len = 0;
+    return ok;
+}
+
+// a binary file holding ht as a snapshot right after its header. The
+// header is written last, once the length of the snapshot is known
+static bool write_preamble(HashTable *ht, int to) {
+    Buffer b = {.block = -1};
+    put_header(&b, 0);
+    long long len = save_snapshot_at(ht, to, b.len);
+    bool ok = len >= 0;
+    if (ok) {
+        b.len = 0;
+        put_header(&b, len);
+        ok = pwrite(to, b.data, b.len, 0) == (ssize_t)b.len;
+    }
+    free(b.data);
+    return ok;
+}
+
+// ht in the format of new files, run in the child: a binary file with a
+// preamble if AOF_USE_PREAMBLE, otherwise the commands that rebuild it
+static int write_rewrite(HashTable *ht, const char *name) {
+    int to = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (to < 0) return -1;
+    if (AOF_USE_PREAMBLE && new_format == AOF_BINARY) {
+        bool ok = write_preamble(ht, to) && fsync(to) == 0;
+        return close(to) == 0 && ok ? 0 : -1;
+    }
+    Buffer b = {.block = -1, .format = new_format};
+    bool ok = b.format == AOF_TEXT || write_header(to);
+    for (int i = 0; ok && i < ht->size; i++) {
+        HashTableItem *item = ht->items[i];
+        if (item == NULL || item == &HT_DELETED) continue;
+        rewrite_item(&b, item);
+        if (b.len >= REWRITE_BUF) ok = write_buffer(to, &b);
+    }
+    ok = ok && write_buffer(to, &b) && fsync(to) == 0;
+    free(b.data);
+    return close(to) == 0 && ok ? 0 : -1;
+}
+
+// moves appending to a new segment once everything appended so far is
+// written, and returns its index. -1 if that can't be done, a write failed
+static int cut(void) {
+    aof_flush();
+    return out.len == 0 && rotate() ? nsegments - 1 : -1;
+}
+
+// starts rewriting the log in a child, false if the log isn't open, a
+// rewrite is already running, a snapshot is being saved or the fork failed
+bool aof_rewrite_start(HashTable *ht) {
+    if (fd < 0 || child > 0 || snapshot_stats().in_progress) return false;
+    int from = cut();
+    if (from < 0) return false;
+    snprintf(rewrite_tmp, sizeof(rewrite_tmp), "%s.rewrite.tmp", filename);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork for the AOF rewrite");
+        return false;
+    }
+    if (pid == 0) _exit(write_rewrite(ht, rewrite_tmp) == 0 ? 0 : 1);
+    child = pid;
+    rewrite_from = from;
+    stats.rewrite_in_progress = true;
+    return true;
+}
+
+// puts the child's file in place of the segments that were there when it
+// started
+static void rewrite_done(int status) {
+    child = -1;
+    stats.rewrite_in_progress = false;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    char name[300];
+    snprintf(name, sizeof(name), "%s.%06d", filename, next_segment);
+    if (ok) ok = rename(rewrite_tmp, name) == 0;
+    if (ok) {
+        next_segment++;
+        ok = drop_segments(rewrite_from, name, "");
+        if (!ok) unlink(name);
+    }
+    if (ok) {
+        stats.rewrites++;
+    } else {
+        fprintf(stderr, "AOF rewrite failed\n");
+        unlink(rewrite_tmp);
+    }
+    stats.last_rewrite_ok = ok;
+    rewrite_from = -1;
+}
+
+static void rewrite_abort(void) {
+    if (child <= 0) return;
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    child = -1;
+    unlink(rewrite_tmp);
+    rewrite_from = -1;
+    stats.rewrite_in_progress = false;
+}
+
+// waits for a running rewrite to finish
+void aof_rewrite_wait(void) {
+    int status;
+    if (child > 0 && waitpid(child, &status, 0) == child) rewrite_done(status);
+}
+
+// called right before a snapshot is taken: appending moves to a new
+// segment, so that the segments before it hold nothing the snapshot won't.
+// A running rewrite is abandoned, the snapshot makes it pointless
+void aof_snapshot_start(void) {
+    snapshot_from = -1;
+    if (fd < 0) return;
+    rewrite_abort();
+    snapshot_from = cut();
+}
+
+// called once the snapshot started last is saved in tmp, or failed: the
+// log then starts from a link to it named after the first segment it
+// doesn't hold, and drops the segments it does in the same manifest
+// rename. The link is the AOF's own, the caller is free to move tmp
+void aof_snapshot_done(const char *tmp, bool ok) {
+    if (fd >= 0 && ok && snapshot_from >= 0) {
+        char name[310];
+        snprintf(name, sizeof(name), "%s.snap", segments[snapshot_from]);
+        // the same name means nothing was logged since that snapshot, the
+        // manifest already describes the data set
+        if (strcmp(name, snapshot) == 0) {
+            snapshot_from = -1;
+            return;
+        }
+        unlink(name);
+        if (link(tmp, name) != 0) {
+            perror("Failed to link the snapshot for the AOF");
+        } else if (!drop_segments(snapshot_from, NULL, name)) {
+            unlink(name);
+        }
+    }
+    snapshot_from = -1;
+}
+
+// called from the event loop: reaps a finished rewrite and starts one once
+// the log has grown AOF_REWRITE_PERCENTAGE past its size after the last one
+void aof_cron(HashTable *ht) {
+    int status;
+    if (child > 0) {
+        if (waitpid(child, &status, WNOHANG) == child) rewrite_done(status);
+        return;
+    }
+    if (fd < 0 || stats.size < AOF_REWRITE_MIN_SIZE) return;
+    long long base = stats.base_size > 0 ? stats.base_size : 1;
+    if ((stats.size - base) * 100 / base >= AOF_REWRITE_PERCENTAGE) {
+        aof_rewrite_start(ht);
+    }
+}
+
+// writes and syncs what is left, then closes the log. The current segment
+// gives back the space it didn't use. A running rewrite is abandoned
+void aof_close(void) {
+    if (fd < 0) return;
+    rewrite_abort();
+    aof_flush();
+    if (policy == FSYNC_EVERYSEC) {
+        pthread_mutex_lock(&fsync_lock);
+        stopping = true;
+        pthread_cond_signal(&fsync_cond);
+        pthread_mutex_unlock(&fsync_lock);
+        pthread_join(fsync_thread, NULL);
+    }
+    if (ftruncate(fd, offset) != 0) perror("Failed to truncate the AOF");
+    if (policy != FSYNC_NO) fdatasync(fd);
+    close(fd);
+    fd = -1;
+    free_names(segments, nsegments);
+    segments = NULL;
+    nsegments = 0;
+    free(out.data);
+    out.data = NULL;
+    out.len = out.cap = 0;
+    out.block = -1;
+}
+
+AofStats aof_stats(void) {
+    AofStats res = stats;
+    res.enabled = fd >= 0;
+    res.pending = out.len;
+    res.fsync = policy_names[policy];
+    res.format = format_names[out.format];
+    res.segments = nsegments;
+    return res;
+}
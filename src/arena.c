@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// bump allocator for memory that only lives as long as a single request.
+// Allocations are carved out of one block and all released at once by
+// arena_reset, requests that don't fit spill over to separately allocated
+// blocks which are freed on the next reset
+
+#define ARENA_ALIGN 16
+
+typedef struct ArenaSpill {
+    struct ArenaSpill *next;
+    char data[];
+} ArenaSpill;
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+Arena *arena_init(size_t size) {
+    Arena *a = dmalloc(sizeof(Arena));
+    a->buf = dmalloc(size);
+    a->size = size;
+    a->used = 0;
+    a->last = 0;
+    a->spill = NULL;
+    return a;
+}
+
+void arena_free(Arena *a) {
+    if (a == NULL) return;
+    arena_reset(a);
+    free(a->buf);
+    free(a);
+}
+
+void *arena_alloc(Arena *a, size_t n) {
+    ALLOC_COUNT(arena);
+    n = align_up(n);
+    if (n <= a->size - a->used) {
+        a->last = a->used;
+        a->used += n;
+        return a->buf + a->last;
+    }
+    ArenaSpill *s = dmalloc(sizeof(ArenaSpill) + n);
+    s->next = a->spill;
+    a->spill = s;
+    ALLOC_COUNT(arena_spills);
+    return s->data;
+}
+
+// grows p from old to n bytes, in place when p is the latest allocation
+void *arena_realloc(Arena *a, void *p, size_t old, size_t n) {
+    if (p == a->buf + a->last && n <= a->size - a->last) {
+        a->used = a->last + align_up(n);
+        return p;
+    }
+    void *res = arena_alloc(a, n);
+    memcpy(res, p, old < n ? old : n);
+    return res;
+}
+
+// releases everything allocated since the last reset
+void arena_reset(Arena *a) {
+    while (a->spill != NULL) {
+        ArenaSpill *next = a->spill->next;
+        free(a->spill);
+        a->spill = next;
+    }
+    a->used = 0;
+    a->last = 0;
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "common.h"
+
+// the batch file gets every command that changed the data set as a line of
+// text, the way command_join writes it. The lines go through a ring of
+// bytes any number of threads append to without taking a lock, and a
+// thread of its own writes them out:
+//
+// - a producer reserves room for its record by moving head forward with a
+//   compare and swap, writes the line after the record header and then
+//   publishes the record by storing its size in the header
+// - the writer takes every record published from tail on and writes them
+//   with a single writev, then clears them and moves tail past them
+//
+// A producer only waits when the ring has no room for its record. Records
+// never wrap around the end of the ring, the room left there is given to
+// a padding record instead. A line too long to share the ring is kept on
+// the heap and the ring only holds a pointer to it
+
+#define BATCH_HEADER 8          // size and length of a record
+#define BATCH_WAIT_MS 100       // longest a published record waits
+#define BATCH_IOV 1024          // records written by one writev
+#define JUMBO UINT32_MAX        // length of a record pointing to its line
+
+// the start of a record, size is zero until the record is published. A
+// record with no length is padding
+typedef struct Record {
+    uint32_t size;      // of the whole record, a multiple of BATCH_HEADER
+    uint32_t len;       // of its line, or JUMBO
+} Record;
+
+static int fd = -1;
+static char *ring = NULL;
+static uint64_t cap = 0;        // a power of two
+static uint64_t head = 0;       // reserved up to here
+static uint64_t tail = 0;       // written up to here
+static BatchStats stats = {.last_ok = true};
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;     // wakes the writer
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;     // tail moved
+static bool stopping = false;
+
+static Record *record_at(uint64_t pos) {
+    return (Record *)(ring + (pos & (cap - 1)));
+}
+
+// clears n bytes of the ring from pos on, so that records reserved there
+// later read as unpublished until they are
+static void clear(uint64_t pos, uint64_t n) {
+    uint64_t at = pos & (cap - 1);
+    uint64_t first = n < cap - at ? n : cap - at;
+    memset(ring + at, 0, first);
+    memset(ring, 0, n - first);
+}
+
+// writes the records published from tail on, returns how many bytes of the
+// ring they took
+static uint64_t drain(void) {
+    struct iovec iov[BATCH_IOV];
+    char *jumbo[BATCH_IOV];
+    int n = 0, njumbo = 0;
+    uint64_t from = tail, pos = tail;
+    while (n < BATCH_IOV && pos - from < cap) {
+        Record *r = record_at(pos);
+        uint32_t size = __atomic_load_n(&r->size, __ATOMIC_ACQUIRE);
+        if (size == 0) break;
+        if (r->len == JUMBO) {
+            memcpy(&jumbo[njumbo], r + 1, sizeof(char *));
+            iov[n].iov_base = jumbo[njumbo];
+            iov[n++].iov_len = strlen(jumbo[njumbo++]);
+        } else if (r->len > 0) {
+            iov[n].iov_base = r + 1;
+            iov[n++].iov_len = r->len;
+        }
+        pos += size;
+    }
+    if (pos == from) return 0;
+
+    struct iovec *v = iov;
+    while (n > 0) {
+        ssize_t k = writev(fd, v, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) {
+            // the lines are dropped rather than holding up the producers
+            if (stats.last_ok) perror("Failed to write the batch file");
+            __atomic_store_n(&stats.last_ok, false, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_add_fetch(&stats.written, k, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats.last_ok, true, __ATOMIC_RELAXED);
+        for (; n > 0 && (size_t)k >= v->iov_len; v++, n--) k -= v->iov_len;
+        if (n > 0) {
+            v->iov_base = (char *)v->iov_base + k;
+            v->iov_len -= k;
+        }
+    }
+    for (int i = 0; i < njumbo; i++) free(jumbo[i]);
+    clear(from, pos - from);
+    __atomic_store_n(&tail, pos, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&room);
+    pthread_mutex_unlock(&lock);
+    return pos - from;
+}
+
+// drains the ring whenever it is half full or a record waited long enough
+static void *writer_loop(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        pthread_mutex_unlock(&lock);
+        uint64_t n = drain();
+        pthread_mutex_lock(&lock);
+        if (n > 0 || stopping) continue;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += BATCH_WAIT_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&work, &lock, &ts);
+    }
+    pthread_mutex_unlock(&lock);
+    while (drain() > 0) {}
+    return NULL;
+}
+
+static void wake_writer(void) {
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+}
+
+// waits for the writer to move tail past seen
+static void wait_room(uint64_t seen) {
+    __atomic_add_fetch(&stats.stalls, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&work);
+    while (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) == seen) {
+        pthread_cond_wait(&room, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// reserves size bytes of the ring and returns where they start. Room left
+// at the end of the ring that is too small goes to a padding record
+static uint64_t reserve(uint32_t size) {
+    uint64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    while (true) {
+        uint64_t end = cap - (pos & (cap - 1));
+        uint64_t need = size <= end ? size : end + size;
+        uint64_t seen = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        if (pos + need - seen > cap) {
+            wait_room(seen);
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (!__atomic_compare_exchange_n(&head, &pos, pos + need, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (pos - seen < cap / 2 && pos + need - seen >= cap / 2) {
+            wake_writer();
+        }
+        if (need == size) return pos;
+        Record *pad = record_at(pos);
+        pad->len = 0;
+        __atomic_store_n(&pad->size, (uint32_t)end, __ATOMIC_RELEASE);
+        return pos + end;
+    }
+}
+
+// writes cmd as a line to dst, which has room for line_size(cmd) bytes
+static size_t put_line(char *dst, Command *cmd) {
+    char *p = stpcpy(dst, cmd->name);
+    for (int i = 0; i < cmd->argc; i++) {
+        *p++ = ' ';
+        p += arg_quote(p, cmd->argv[i]);
+    }
+    *p++ = '\n';
+    return p - dst;
+}
+
+static size_t line_size(Command *cmd) {
+    size_t size = strlen(cmd->name) + 2;
+    for (int i = 0; i < cmd->argc; i++) size += cmd->argl[i] + 3;
+    return size;
+}
+
+// opens filename for appending and starts the writer, with a ring of at
+// least size bytes. False if the file can't be opened
+bool batch_open(const char *filename, size_t size) {
+    if (fd >= 0) return true;
+    fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("Failed to open batch file");
+        return false;
+    }
+    for (cap = 4096; cap < size; cap *= 2) {}
+    ring = calloc(cap, 1);
+    head = tail = 0;
+    stopping = false;
+    stats = (BatchStats){.last_ok = true};
+    pthread_create(&writer, NULL, writer_loop, NULL);
+    return true;
+}
+
+// hands cmd to the writer, waiting only if the ring is full. Safe to call
+// from any number of threads
+void batch_append(Command *cmd) {
+    if (fd < 0) return;
+    size_t len = line_size(cmd);
+    size_t size = (BATCH_HEADER + len + 7) & ~(size_t)7;
+    if (size > cap / 4) {
+        char *line = dmalloc(len + 1);
+        line[put_line(line, cmd)] = '\0';
+        uint64_t pos = reserve(BATCH_HEADER + sizeof(char *));
+        Record *r = record_at(pos);
+        r->len = JUMBO;
+        memcpy(r + 1, &line, sizeof(char *));
+        __atomic_store_n(&r->size, BATCH_HEADER + sizeof(char *),
+                         __ATOMIC_RELEASE);
+        return;
+    }
+    uint64_t pos = reserve(size);
+    Record *r = record_at(pos);
+    r->len = put_line((char *)(r + 1), cmd);
+    __atomic_store_n(&r->size, (uint32_t)size, __ATOMIC_RELEASE);
+}
+
+// writes everything appended so far and stops the writer. No append may
+// run concurrently
+void batch_close(void) {
+    if (fd < 0) return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+    close(fd);
+    fd = -1;
+    free(ring);
+    ring = NULL;
+}
+
+// safe to call while the writer runs
+BatchStats batch_stats(void) {
+    BatchStats res = {.enabled = fd >= 0};
+    if (res.enabled) {
+        res.pending = __atomic_load_n(&head, __ATOMIC_RELAXED) -
+                      __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    }
+    res.written = __atomic_load_n(&stats.written, __ATOMIC_RELAXED);
+    res.stalls = __atomic_load_n(&stats.stalls, __ATOMIC_RELAXED);
+    res.last_ok = __atomic_load_n(&stats.last_ok, __ATOMIC_RELAXED);
+    return res;
+}
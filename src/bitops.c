@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// 0 keeps the kernels on the portable path even where avx2 is available
+int BIT_SIMD = 1;
+
+static uint64_t load64(const unsigned char *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static void store64(unsigned char *p, uint64_t w) {
+    memcpy(p, &w, sizeof(w));
+}
+
+static long count_scalar(const unsigned char *p, long n) {
+    long res = 0, i = 0;
+    for (; i + 8 <= n; i += 8) res += __builtin_popcountll(load64(p + i));
+    for (; i < n; i++) res += __builtin_popcount(p[i]);
+    return res;
+}
+
+// first byte that is not equal to skip, n if there is none
+static long scan_scalar(const unsigned char *p, long n, unsigned char skip) {
+    uint64_t word = skip ? ~0ULL : 0;
+    long i = 0;
+    while (i + 8 <= n && load64(p + i) == word) i += 8;
+    while (i < n && p[i] == skip) i++;
+    return i;
+}
+
+#ifdef HAVE_X86
+// nibble lookup popcount, per byte counts are summed with sad against zero
+__attribute__((target("avx2")))
+static long count_avx2(const unsigned char *p, long n) {
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+        __m256i hi = _mm256_shuffle_epi8(
+            lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+        __m256i cnt = _mm256_add_epi8(lo, hi);
+        acc = _mm256_add_epi64(acc,
+                               _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+    long res = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+               _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+    return res + count_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static long scan_avx2(const unsigned char *p, long n, unsigned char skip) {
+    const __m256i word = _mm256_set1_epi8((char)skip);
+    long i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, word));
+        if (mask != 0xffffffffu) return i + __builtin_ctz(~mask);
+    }
+    return i + scan_scalar(p + i, n - i, skip);
+}
+
+#endif
+
+long bit_count(const unsigned char *p, long n) {
+#ifdef HAVE_X86
+    if (BIT_SIMD && has_avx2()) return count_avx2(p, n);
+#endif
+    return count_scalar(p, n);
+}
+
+// position of the first bit equal to bit, bits are numbered from the most
+// significant bit of the first byte, -1 if there is none
+long bit_pos(const unsigned char *p, long n, int bit) {
+    unsigned char skip = bit ? 0x00 : 0xff;
+    long i;
+#ifdef HAVE_X86
+    if (BIT_SIMD && has_avx2()) i = scan_avx2(p, n, skip);
+    else
+#endif
+    i = scan_scalar(p, n, skip);
+    if (i == n) return -1;
+
+    unsigned char byte = bit ? p[i] : (unsigned char)~p[i];
+    return i * 8 + __builtin_clz(byte) - (sizeof(unsigned) - 1) * 8;
+}
+
+// dst = op over srcs, shorter sources are treated as zero padded
+void bit_op(int op, unsigned char *dst, long n,
+            unsigned char **srcs, long *lens, int nsrcs) {
+    long i = 0;
+    if (op == BIT_NOT) {
+        for (; i + 8 <= n; i += 8) store64(dst + i, ~load64(srcs[0] + i));
+        for (; i < n; i++) dst[i] = ~srcs[0][i];
+        return;
+    }
+
+    memset(dst, 0, n);
+    if (lens[0] > 0) memcpy(dst, srcs[0], lens[0]);
+    for (int k = 1; k < nsrcs; k++) {
+        const unsigned char *src = srcs[k];
+        long len = lens[k];
+        for (i = 0; i + 8 <= len; i += 8) {
+            uint64_t a = load64(dst + i), b = load64(src + i);
+            store64(dst + i, op == BIT_AND ? a & b : op == BIT_OR ? a | b : a ^ b);
+        }
+        for (; i < len; i++) {
+            dst[i] = op == BIT_AND ? dst[i] & src[i]
+                   : op == BIT_OR ? dst[i] | src[i] : dst[i] ^ src[i];
+        }
+        if (op == BIT_AND && len < n) memset(dst + len, 0, n - len);
+    }
+}
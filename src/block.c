@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// key -> list of blocked client fds, oldest first
+static HashTable *waiters = NULL;
+// watched keys pushed to since the last call to block_ready
+static Set *ready = NULL;
+
+// number of leading arguments of a blocking command that are keys
+static int block_nkeys(Command *cmd) {
+    switch (cmd->type) {
+        case BLPOP: case BRPOP: return cmd->argc - 1;
+        case BLMOVE: return 1;
+        default: return 0;
+    }
+}
+
+// the client keeps its own copy of cmd, whose line may be reused meanwhile
+bool block_client(Client *c, Command *cmd) {
+    int n = block_nkeys(cmd);
+    if (n <= 0) return false;
+    if (waiters == NULL) {
+        waiters = htable_init(HT_BASE_SIZE);
+        ready = set_init(HT_BASE_SIZE);
+    }
+
+    int secs = strtoi(cmd->argv[cmd->argc - 1]);
+    c->blocked = command_dup(cmd);
+    c->btype = cmd->type;
+    c->deadline = secs > 0 ? mstime() + secs * 1000LL : 0;
+
+    char *fd = intostr(c->fd);
+    for (int i = 0; i < n; i++) {
+        htable_push(waiters, cmd->argv[i], fd, RIGHT);
+    }
+    free(fd);
+    return true;
+}
+
+void unblock_client(Client *c) {
+    if (c->blocked == NULL) return;
+    Command *cmd = c->blocked;
+    char *fd = intostr(c->fd);
+    int n = block_nkeys(cmd);
+    for (int i = 0; i < n; i++) {
+        htable_lrem(waiters, cmd->argv[i], 1, fd);
+    }
+    free(fd);
+    command_free(cmd);
+    c->blocked = NULL;
+    c->deadline = 0;
+}
+
+// called on every push, marks the key as ready if a client waits on it
+void block_signal(HashTable *ht, char *key) {
+    if (waiters == NULL || waiters->used == 0 || ht == waiters) return;
+    if (htable_exists(waiters, key)) set_add(ready, key);
+}
+
+// fd of the client that has been blocked the longest on key, -1 if none
+int block_first(char *key) {
+    if (waiters == NULL) return -1;
+    char *fd = htable_lindex(waiters, key, 0);
+    return fd != NULL ? strtoi(fd) : -1;
+}
+
+// hands over the set of ready keys, NULL when there are none
+char **block_ready() {
+    if (ready == NULL || ready->used == 0) return NULL;
+    char **keys = set_members(ready);
+    set_free(ready);
+    ready = set_init(HT_BASE_SIZE);
+    return keys;
+}
+
+// reply of a blocking command that timed out or can't block, RESP3 has a
+// single null for both shapes
+char *block_nil(int type, int resp) {
+    if (resp == 3) return "_\r\n";
+    return type == BLMOVE ? "$-1\r\n" : "*-1\r\n";
+}
@@ -69,6 +69,12 @@ static void parse_resp(char *resp) {
         case ':':
             printf("(integer) %d\n", parse_int(resp));
             break;
+        case '_':
+            puts("(nil)");
+            break;
+        case '#':
+            puts(resp[1] == 't' ? "(true)" : "(false)");
+            break;
         case '*': break;
         case '-':
             puts(parse_err(resp));
@@ -79,7 +85,12 @@ void repl(int sfd) {
     while (1) {
         char *inp = malloc(1024);
         printf("verokv> ");
-        fgets(inp, 1024, stdin);
+        if (fgets(inp, 1024, stdin) == NULL) break;
+        inp[strcspn(inp, "\n")] = '\0';
+        if (*inp == '\0') {
+            free(inp);
+            continue;
+        }
         writeline(sfd, inp);
         char *resp = readline(sfd);
         // printf("%d\n", resp == NULL);
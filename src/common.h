@@ -3,11 +3,31 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define LOCALHOST "127.0.0.1"
 #define PORT_NUM 6381
 #define SA struct sockaddr
 #define HT_BASE_SIZE 2
+#define HT_BATCH 16     // keys hashed and prefetched ahead by batched lookups
+#define MAX_CLIENTS 1024
+// values made of more allocations than this are freed in the background
+#define LAZYFREE_THRESHOLD 64
+// per connection memory for parsing a request and building its reply
+#define ARENA_SIZE (16 * 1024)
+#define AOF_FILE "verokv.aof"
+#define APPENDFSYNC FSYNC_EVERYSEC  // FSYNC_ALWAYS, FSYNC_EVERYSEC or FSYNC_NO
+#define AOF_FORMAT AOF_BINARY       // of new files, AOF_BINARY or AOF_TEXT
+// the AOF is rewritten once it grew this many percent past its size after
+// the last rewrite, and is at least AOF_REWRITE_MIN_SIZE bytes
+#define AOF_REWRITE_PERCENTAGE 100
+#define AOF_REWRITE_MIN_SIZE (64 * 1024 * 1024)
+#define BATCH_FILE "verokv.batch"
+#define BATCH_RING_SIZE (4 * 1024 * 1024)  // bytes of lines waiting to be written
+#define SNAPSHOT_FILE "snapshot.dat"
+#define SNAPSHOT_INTERVAL 3 // seconds between periodic background saves
+#define SNAPSHOT_THREADS 8  // most threads saving or loading a snapshot
+#define ENABLE_SNAPSHOTS 1
 
 typedef struct HashTableItem {
     enum {STR_T, HASH_T, LIST_T, SET_T} type;
@@ -15,9 +35,38 @@ typedef struct HashTableItem {
     void *value;
 } HashTableItem;
 
+typedef struct StrHeader {
+    int len;
+    int cap;
+    char buf[];
+} StrHeader;
+
+typedef struct Arena {
+    char *buf;
+    size_t size;
+    size_t used;
+    size_t last;        // offset of the latest allocation
+    struct ArenaSpill *spill;
+} Arena;
+
+// allocation counters, heap counts every dmalloc and drealloc. Only the
+// test build (-DALLOC_STATS) keeps them, the server doesn't pay for them
+typedef struct AllocStats {
+    long long heap;
+    long long arena;
+    long long arena_spills;
+} AllocStats;
+
+#ifdef ALLOC_STATS
+#define ALLOC_COUNT(field) __atomic_add_fetch(&alloc_stats.field, 1, __ATOMIC_RELAXED)
+#else
+#define ALLOC_COUNT(field) ((void)0)
+#endif
+
 typedef struct HashTable {
     int size;
     int used;
+    long long dirty;    // bumped by every change to the data set
     HashTableItem **items;
 } HashTable;
 
@@ -35,32 +84,94 @@ typedef struct List {
 
 enum ListDirection {LEFT, RIGHT};
 
+enum BitOp {BIT_AND, BIT_OR, BIT_XOR, BIT_NOT};
+
 typedef struct Set {
     int size;
     int used;
     char **members;
 } Set;
 
-typedef struct Parser {
-    char *string;
-    int pos;
-    char current_char;
-} Parser;
-
 typedef struct Command {
     enum {
-        DEL, EXISTS, TYPE,
+        DEL, UNLINK, EXISTS, TYPE, FLUSHALL, FLUSHDB,
         SET, GET, MSET, MGET, INCR, DECR, INCRBY, DECRBY, STRLEN,
+        APPEND, GETRANGE, SETRANGE, THROTTLE,
+        SETBIT, GETBIT, BITCOUNT, BITOP, BITPOS, PFADD, PFCOUNT, PFMERGE,
         HSET, HGET, HDEL, HGETALL, HEXISTS, HKEYS, HVALS, HMGET, HLEN,
         LPUSH, LPOP, RPUSH, RPOP, LLEN, LINDEX, LRANGE, LSET, LREM, LPOS,
+        BLPOP, BRPOP, LMOVE, BLMOVE,
         SADD, SREM, SISMEMBER, SMEMBERS, SMISMEMBER,
-        QUIT, SHUTDOWN, UNKNOWN, NOOP
+        MULTI, EXEC, DISCARD, WATCH, UNWATCH,
+        HELLO, BGSAVE, BGREWRITEAOF, INFO, QUIT, SHUTDOWN, UNKNOWN, NOOP
     } type;
+    char *name;
     int argc;
     char **argv;
+    int *argl;          // length of each argument
+    char *line;         // backing storage when the command owns its tokens
+    Arena *arena;       // where the command and its reply live, NULL for heap
+    int resp;           // protocol version the reply is encoded in, 2 or 3
 } Command;
 
+// longest command name, anything longer is rejected without a lookup
+#define COMMAND_MAXLEN 16
+
+typedef char *CommandProc(HashTable *ht, Command *cmd);
+
+#define CMD_WRITE 1     // may change the data set
+#define CMD_READONLY 2  // never changes the data set
+#define CMD_ADMIN 4     // acts on the server rather than on keys
+#define CMD_BLOCKING 8  // may park the client until a key is pushed to
+
+typedef struct CommandDef {
+    char *name;         // lowercase, NULL for commands that can't be called
+    CommandProc *proc;
+    int arity_min;
+    int arity_max;      // -1 when there is no upper bound
+    int flags;
+    int key_first;      // argv index of the first key
+    int key_last;       // negative values count back from the last argument
+    int key_step;       // 0 when the command takes no keys
+} CommandDef;
+
+// called after a command ran with the dirty counter sampled before it. The
+// writes of a transaction come between a MULTI and an EXEC with dirty -1,
+// which only mark where it starts and ends
+typedef void CommandHook(HashTable *ht, Command *cmd, long long dirty);
+
+typedef struct Multi {
+    Command **cmds;     // queued copies, run in order by EXEC
+    int len;
+    int cap;
+    bool failed;        // a command was rejected while queueing
+} Multi;
+
+typedef struct WatchedKey {
+    char *key;
+    long long version;  // version of key when it was watched
+} WatchedKey;
+
+typedef struct Client {
+    int fd;
+    char *buf;          // unprocessed input
+    int len;
+    int size;
+    Arena *arena;       // request scoped memory, reset after every reply
+    int resp;           // protocol version negotiated with HELLO
+    Multi *multi;       // open transaction, NULL outside MULTI
+    WatchedKey *watched;
+    int nwatched;
+    Command *blocked;   // blocking command retried when its keys are pushed to
+    int btype;
+    long long deadline; // ms on the monotonic clock, 0 blocks forever
+    char *out;          // replies not sent yet
+    int out_len;
+    int out_size;
+} Client;
+
 // helper.c
+extern AllocStats alloc_stats;
 void *dmalloc(size_t size);
 void *drealloc(void *p, size_t size);
 int next_prime(int n);
@@ -69,18 +180,69 @@ int ndigits(int x);
 bool is_number(char *str);
 int strtoi(char *str);
 char *intostr(int x);
+long long mstime(void);
+long long ustime(void);
+bool has_avx2(void);
+bool has_sse42(void);
+
+// arena.c
+Arena *arena_init(size_t size);
+void arena_free(Arena *a);
+void *arena_alloc(Arena *a, size_t n);
+void *arena_realloc(Arena *a, void *p, size_t old, size_t n);
+void arena_reset(Arena *a);
+
+// str.c
+char *str_new(const char *init, int len);
+char *str_new_in(Arena *a, const char *init, int len);
+char *str_dup(const char *cstr);
+char *str_fmt(const char *fmt, ...);
+char *str_fmt_in(Arena *a, const char *fmt, ...);
+int str_len(const char *s);
+int str_cap(const char *s);
+void str_free(char *s);
+char *str_grow(char *s, int len);
+char *str_cat(char *s, const char *t, int len);
+char *str_setrange(char *s, int off, const char *t, int len);
+char *str_assign(char *s, const char *t, int len);
+
+// bitops.c
+extern int BIT_SIMD;
+long bit_count(const unsigned char *p, long n);
+long bit_pos(const unsigned char *p, long n, int bit);
+void bit_op(int op, unsigned char *dst, long n,
+            unsigned char **srcs, long *lens, int nsrcs);
+
+// crc32c.c
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
 
 // htable.c
+extern HashTableItem HT_DELETED;
 HashTable *htable_init(int size);
 void htable_free(HashTable *ht);
 bool htable_del(HashTable *ht, char *key);
+bool htable_unlink(HashTable *ht, char *key);
+void htable_flush(HashTable *ht, bool async);
 bool htable_exists(HashTable *ht, char *key);
+HashTableItem *htable_search(HashTable *ht, char *key);
+void htable_prefetch(HashTable *ht, char **keys, int n, int step);
+void htable_search_n(HashTable *ht, char **keys, int n, int step,
+                     HashTableItem **res);
 char *htable_type(HashTable *ht, char *key);
 bool htable_set(HashTable *ht, char *key, char *value);
+bool htable_set_str(HashTable *ht, char *key, char *str);
+char *htable_str_grow(HashTable *ht, char *key, int len);
+int htable_append(HashTable *ht, char *key, char *value);
+int htable_setrange(HashTable *ht, char *key, int off, char *value);
 bool htable_hset(HashTable *ht, char *key, char *field, char *value);
 int htable_push(HashTable *ht, char *key, char *value, int dir);
+int htable_pfadd(HashTable *ht, char *key, char *elem);
 bool htable_sadd(HashTable *ht, char *key, char *value);
 char *htable_get(HashTable *ht, char *key);
+void htable_add(HashTable *ht, int type, char *key, void *value);
+void htable_add_atomic(HashTable *ht, int type, char *key, void *value);
+void htable_item_set(HashTable *ht, HashTableItem *item, char *value,
+                     int len);
 char *htable_hget(HashTable *ht, char *key, char *field);
 char *htable_pop(HashTable *ht, char *key, int dir);
 bool htable_sismember(HashTable *ht, char *key, char *value);
@@ -100,6 +262,114 @@ char **htable_lrange(HashTable *ht, char *key, int begin, int end);
 char **htable_smembers(HashTable *ht, char *key);
 char **set_members(Set *set);
 
+// block.c
+bool block_client(Client *c, Command *cmd);
+void unblock_client(Client *c);
+void block_signal(HashTable *ht, char *key);
+int block_first(char *key);
+char **block_ready(void);
+char *block_nil(int type, int resp);
+
+// hyperloglog.c
+#define HLL_REGISTERS 16384
+char *hll_new(void);
+bool hll_valid(const char *hll);
+int hll_add(char **hll, const char *elem, int len);
+void hll_merge(unsigned char *regs, const char *hll);
+long hll_count_regs(const unsigned char *regs);
+long hll_count(char *hll);
+char *hll_from_regs(const unsigned char *regs);
+
+// multi.c
+char *multi_process(Client *c, HashTable *ht, Command *cmd, CommandHook *hook);
+void multi_free(Multi *m);
+
+// watch.c
+void watch_key(Client *c, char *key);
+void unwatch_all(Client *c);
+bool watch_changed(Client *c);
+void watch_touch(char *key);
+void watch_touch_command(Command *cmd);
+
+// snapshot.c
+typedef struct SnapshotStats {
+    bool in_progress;
+    long long keys_done;        // progress of the running save
+    long long keys_total;
+    long long cow_bytes;        // copied on write so far by the running save
+    long long last_cow_bytes;   // copied on write by the last save
+    long long fork_usec;        // time the server was stopped by the last fork
+    long long last_save;        // unix time of the last successful save
+    bool last_ok;
+    long long saved_dirty;      // dirty counter captured by the last save
+} SnapshotStats;
+
+int save_snapshot(HashTable *ht, const char *filename);
+int load_snapshot(HashTable *ht, const char *filename);
+long long save_snapshot_at(HashTable *ht, int fd, long long off);
+int load_snapshot_at(HashTable *ht, const unsigned char *p, size_t size);
+bool snapshot_bgsave(HashTable *ht, const char *filename);
+void snapshot_wait(void);
+void snapshot_cron(HashTable *ht);
+SnapshotStats snapshot_stats(void);
+
+// aof.c
+enum {FSYNC_NO, FSYNC_EVERYSEC, FSYNC_ALWAYS};
+enum {AOF_TEXT, AOF_BINARY};
+
+typedef struct AofStats {
+    bool enabled;
+    const char *fsync;          // name of the fsync policy
+    const char *format;         // text or binary
+    long long size;             // bytes in the file
+    long long pending;          // bytes appended but not written yet
+    bool last_ok;               // whether the last write went through
+    bool rewrite_in_progress;
+    bool last_rewrite_ok;
+    long long base_size;        // size after the last rewrite or at startup
+    long long rewrites;
+    int segments;               // files the log is made of
+} AofStats;
+
+// bytes preallocated for each segment of the log
+extern long long AOF_SEGMENT_SIZE;
+// whether binary rewrites hold a snapshot instead of commands
+extern int AOF_USE_PREAMBLE;
+
+bool aof_has_manifest(const char *filename);
+long long aof_load(HashTable *ht, const char *filename);
+bool aof_open(const char *filename, int fsync_policy, int format,
+              const char *snapshot);
+void aof_append(Command *cmd);
+void aof_flush(void);
+void aof_close(void);
+bool aof_rewrite_start(HashTable *ht);
+void aof_rewrite_wait(void);
+void aof_cron(HashTable *ht);
+void aof_snapshot_start(void);
+void aof_snapshot_done(const char *tmp, bool ok);
+AofStats aof_stats(void);
+
+// batch.c
+typedef struct BatchStats {
+    bool enabled;
+    long long pending;          // bytes of the ring not written yet
+    long long written;          // bytes written to the file
+    long long stalls;           // appends that waited for room in the ring
+    bool last_ok;               // whether the last write went through
+} BatchStats;
+
+bool batch_open(const char *filename, size_t size);
+void batch_append(Command *cmd);
+void batch_close(void);
+BatchStats batch_stats(void);
+
+// lazyfree.c
+extern int LAZYFREE_USER_DEL;
+void lazyfree(void *ptr, void (*fn)(void *));
+int lazyfree_pending(void);
+void lazyfree_wait(void);
+
 // list.c
 List *list_init(void);
 void list_free(List *ls);
@@ -114,6 +384,7 @@ int list_rem(List *ls, int count, char *value);
 char **list_range(List *ls, int begin, int end);
 
 // set.c
+extern char SET_DELETED;
 Set *set_init(int size);
 void set_free(Set *set);
 bool set_add(Set *set, char *value);
@@ -121,20 +392,28 @@ bool set_rem(Set *set, char *key);
 bool set_ismember(Set *set, char *key);
 
 // parser.c
-Parser *parser_init(char *msg);
-void parser_free(Parser *parser);
 Command *parse(char *msg);
+Command *parse_line(Arena *a, char *line, int len);
+Command *command_dup(Command *cmd);
+char *command_join(Command *cmd);
+int arg_quote(char *dst, const char *arg);
+void command_rewrite(Command *cmd, int type, int argc, char **argv);
 void command_free(Command *cmd);
 
 // interpreter.c
+int command_lookup(const char *name, int len);
+char *command_check(Command *cmd);
+bool command_keys(Command *cmd, int *first, int *last, int *step);
+CommandDef *command_def(int type);
 char *interpret(HashTable *ht, Command *cmd);
 
 // server.c
+extern int ENABLE_AOF;
 int init_server(void);
 int accept_connection(int sfd);
 void close_socket(int sockfd);
 void close_client(int cfd);
-int verokv(int cfd, HashTable *ht);
+int verokv(int sfd, HashTable *ht);
 char *readline(int cfd);
 void writeline(int cfd, char *msg);
 
@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// crc32c (Castagnoli), the checksum of snapshots. The sse4.2 crc32
+// instruction computes it directly, other cpus use slicing by 8 tables
+
+#define CRC32C_POLY 0x82f63b78  // reflected
+
+static uint32_t table[8][256];
+static bool table_ready = false;
+
+static void init_table() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = table[k-1][i];
+            table[k][i] = (prev >> 8) ^ table[0][prev & 0xff];
+        }
+    }
+    table_ready = true;
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *p, size_t n) {
+    if (!table_ready) init_table();
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        w ^= crc;   // little endian, the low word lines up with crc
+        crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+              table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+              table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+              table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+    }
+    while (n--) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t n) {
+#ifdef __x86_64__
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = (uint32_t)c;
+#endif
+    while (n--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+// extends crc, the checksum of the bytes before buf, over len more bytes.
+// Start with 0
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+#ifdef HAVE_X86
+    if (has_sse42()) return ~crc32c_sse42(crc, buf, len);
+#endif
+    return ~crc32c_scalar(crc, buf, len);
+}
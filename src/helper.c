@@ -3,9 +3,13 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <time.h>
 #include "common.h"
 
+AllocStats alloc_stats;
+
 void *dmalloc(size_t size) {
+    ALLOC_COUNT(heap);
     void *p = malloc(size);
     if (p == NULL) {
         fprintf(stderr, "couldn't allocate memory");
@@ -16,6 +20,7 @@ void *dmalloc(size_t size) {
 
 void *drealloc(void *p, size_t size) {
     if (size == 0) return NULL; 
+    ALLOC_COUNT(heap);
     void *new_p = realloc(p, size);
     if (new_p == NULL) {
         fprintf(stderr, "couldn't allocate memory");
@@ -55,10 +60,12 @@ static int sdbm(char *str, int size) {
     return hash % size;
 }
 
+// double hashing, sizes are prime so any step in 1..size-1 visits every slot
 int hash_func(char *key, int size, int i) {
     int hash = djb2(key, size);
-    int res = i == 0 ? hash : hash + (i * (sdbm(key, size)));
-    return res % size;
+    if (i == 0) return hash;
+    long long step = 1 + (size > 1 ? sdbm(key, size - 1) : 0);
+    return (hash + i * step) % size;
 }
 
 int ndigits(int x) {
@@ -96,3 +103,37 @@ char *intostr(int x) {
     return res;
 }
 
+
+long long mstime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// wall clock in microseconds, unlike mstime it is meaningful across restarts
+long long ustime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// runtime check so simd kernels can be used without special build flags
+bool has_avx2() {
+#if defined(__x86_64__) || defined(__i386__)
+    static int res = -1;
+    if (res < 0) res = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return res;
+#else
+    return false;
+#endif
+}
+
+bool has_sse42() {
+#if defined(__x86_64__) || defined(__i386__)
+    static int res = -1;
+    if (res < 0) res = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    return res;
+#else
+    return false;
+#endif
+}
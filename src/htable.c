@@ -12,6 +12,7 @@ HashTable *htable_init(int size) {
     HashTable *ht = dmalloc(sizeof(HashTable));
     ht->size = next_prime(size);
     ht->used = 0;
+    ht->dirty = 0;
     ht->items = calloc(ht->size, sizeof(HashTableItem *));
     return ht;
 }
@@ -24,13 +25,17 @@ static HashTableItem *item_init(int type, char *key, void *value) {
     return item;
 }
 
-static void item_free(HashTableItem *item) {
-    switch(item->type) {
-        case STR_T: free(item->value); break;
-        case HASH_T: htable_free((HashTable *)item->value); break;
-        case LIST_T: list_free((List *)item->value); break;
-        case SET_T: set_free((Set *)item->value); break;
+static void value_free(int type, void *value) {
+    switch(type) {
+        case STR_T: str_free(value); break;
+        case HASH_T: htable_free((HashTable *)value); break;
+        case LIST_T: list_free((List *)value); break;
+        case SET_T: set_free((Set *)value); break;
     }
+}
+
+static void item_free(HashTableItem *item) {
+    value_free(item->type, item->value);
     free(item->key);
     free(item);
 }
@@ -86,23 +91,29 @@ static void htable_resize_down(HashTable *ht) {
     if (load < 10) htable_resize(ht, ht->size / 2);
 }
 
-static void htable_insert(HashTable *ht, int type, char *key, void *value) {
+static void insert_item(HashTable *ht, HashTableItem *item) {
     for (int i = 0; i < ht->size; i++) {
-        int hash = hash_func(key, ht->size, i);
+        int hash = hash_func(item->key, ht->size, i);
         HashTableItem *cur_item = ht->items[hash];
 
         if (cur_item == NULL || is_deleted(cur_item)) {
-            ht->items[hash] = item_init(type, key, value);
+            ht->items[hash] = item;
             ht->used++;
+            ht->dirty++;
             htable_resize_up(ht);
             break;
         }
     }
 }
 
-HashTableItem *htable_search(HashTable *ht, char *key) {
+static void htable_insert(HashTable *ht, int type, char *key, void *value) {
+    insert_item(ht, item_init(type, key, value));
+}
+
+// walks the probe sequence of key, whose first bucket is hash
+static HashTableItem *search_from(HashTable *ht, char *key, int hash) {
     for (int i = 0; i < ht->size; i++) {
-        int hash = hash_func(key, ht->size, i);
+        if (i > 0) hash = hash_func(key, ht->size, i);
         HashTableItem *cur_item = ht->items[hash];
         if (cur_item == NULL) return NULL;
         if (!is_deleted(cur_item) && strcmp(cur_item->key, key) == 0) {
@@ -112,24 +123,91 @@ HashTableItem *htable_search(HashTable *ht, char *key) {
     return NULL;
 }
 
+HashTableItem *htable_search(HashTable *ht, char *key) {
+    return search_from(ht, key, hash_func(key, ht->size, 0));
+}
+
+// hashes up to HT_BATCH keys taken every step entries of keys and prefetches
+// what resolving them will touch: the buckets, then the items they point to,
+// then the items' keys. Each pass only issues loads the previous one already
+// requested, so the misses of all keys are in flight at the same time
+static int prefetch_window(HashTable *ht, char **keys, int n, int step,
+                           int *hashes) {
+    if (n > HT_BATCH) n = HT_BATCH;
+    for (int j = 0; j < n; j++) {
+        hashes[j] = hash_func(keys[j * step], ht->size, 0);
+        __builtin_prefetch(&ht->items[hashes[j]]);
+    }
+    for (int j = 0; j < n; j++) {
+        HashTableItem *item = ht->items[hashes[j]];
+        if (item != NULL && !is_deleted(item)) __builtin_prefetch(item);
+    }
+    for (int j = 0; j < n; j++) {
+        HashTableItem *item = ht->items[hashes[j]];
+        if (item != NULL && !is_deleted(item)) __builtin_prefetch(item->key);
+    }
+    return n;
+}
+
+// warms the cache for n keys that are about to be written one by one
+void htable_prefetch(HashTable *ht, char **keys, int n, int step) {
+    int hashes[HT_BATCH];
+    for (int i = 0; i < n; i += HT_BATCH) {
+        prefetch_window(ht, keys + i * step, n - i, step, hashes);
+    }
+}
+
+// looks up n keys taken every step entries of keys, res[i] is the item of
+// the i-th key or NULL. Keys are resolved a window at a time so their cache
+// misses overlap instead of each lookup waiting for the previous one
+void htable_search_n(HashTable *ht, char **keys, int n, int step,
+                     HashTableItem **res) {
+    int hashes[HT_BATCH];
+    for (int i = 0; i < n; i += HT_BATCH) {
+        int w = prefetch_window(ht, keys + i * step, n - i, step, hashes);
+        for (int j = 0; j < w; j++) {
+            res[i + j] = search_from(ht, keys[(i + j) * step], hashes[j]);
+        }
+    }
+}
+
 bool htable_exists(HashTable *ht, char *key) {
     HashTableItem *item = htable_search(ht, key);
     return item != NULL ? true : false;
 }
 
+// name of the type of the value at key, a literal that must not be freed
 char *htable_type(HashTable *ht, char *key) {
     HashTableItem *item = htable_search(ht, key);
-    if (item == NULL) return strdup("none");
+    if (item == NULL) return "none";
     switch (item->type) {
-        case STR_T: return strdup("string");
-        case HASH_T: return strdup("hash");
-        case LIST_T: return strdup("list");
-        case SET_T: return strdup("set");
+        case STR_T: return "string";
+        case HASH_T: return "hash";
+        case LIST_T: return "list";
+        case SET_T: return "set";
     }
     return NULL;
 }
 
-bool htable_del(HashTable *ht, char *key) {
+// number of allocations a value is made of, a rough cost of freeing it
+static int item_effort(HashTableItem *item) {
+    switch(item->type) {
+        case HASH_T: return ((HashTable *)item->value)->used;
+        case LIST_T: return ((List *)item->value)->len;
+        case SET_T: return ((Set *)item->value)->used;
+        default: return 1;
+    }
+}
+
+static void item_free_cb(void *item) {
+    item_free((HashTableItem *)item);
+}
+
+static void htable_free_cb(void *ht) {
+    htable_free((HashTable *)ht);
+}
+
+static bool htable_remove(HashTable *ht, char *key, bool async) {
     for (int i = 0; i < ht->size; i++) {
         int hash = hash_func(key, ht->size, i);
         HashTableItem *cur_item = ht->items[hash];
@@ -137,9 +215,14 @@ bool htable_del(HashTable *ht, char *key) {
         if (cur_item == NULL) return false;
 
         if (!is_deleted(cur_item) && strcmp(cur_item->key, key) == 0) {
-            item_free(cur_item);
+            if (async && item_effort(cur_item) > LAZYFREE_THRESHOLD) {
+                lazyfree(cur_item, item_free_cb);
+            } else {
+                item_free(cur_item);
+            }
             ht->items[hash] = &HT_DELETED;
             ht->used--;
+            ht->dirty++;
             htable_resize_down(ht);
             return true;
         }
@@ -147,14 +230,37 @@ bool htable_del(HashTable *ht, char *key) {
     return false;
 }
 
+bool htable_del(HashTable *ht, char *key) {
+    return htable_remove(ht, key, false);
+}
+
+// removes key right away, large values are reclaimed in the background
+bool htable_unlink(HashTable *ht, char *key) {
+    return htable_remove(ht, key, true);
+}
+
+// empties ht, async hands the old bucket array to the free thread
+void htable_flush(HashTable *ht, bool async) {
+    HashTable *old = dmalloc(sizeof(HashTable));
+    *old = *ht;
+    ht->size = next_prime(HT_BASE_SIZE);
+    ht->used = 0;
+    ht->dirty += old->used;
+    ht->items = calloc(ht->size, sizeof(HashTableItem *));
+    async ? lazyfree(old, htable_free_cb) : htable_free(old);
+}
+
 static void htable_update_str(HashTable *ht, char *key, void *value) {
     for (int i = 0; i < ht->size; i++) {
         int hash = hash_func(key, ht->size, i);
         HashTableItem *cur_item = ht->items[hash];
         if (cur_item == NULL) break;
         if (!is_deleted(cur_item) && strcmp(cur_item->key, key) == 0) {
-            item_free(cur_item);
-            ht->items[hash] = item_init(STR_T, key, value);
+            // the item and its key are kept, only the value is swapped
+            value_free(cur_item->type, cur_item->value);
+            cur_item->type = STR_T;
+            cur_item->value = value;
+            ht->dirty++;
             break;
         }
     }
@@ -168,6 +274,7 @@ static bool htable_update_hash(HashTable *ht, char *key,
         if (cur_item == NULL) break;
         if (!is_deleted(cur_item) && strcmp(cur_item->key, key) == 0) {
             HashTable *tmp = (HashTable *)cur_item->value;
+            ht->dirty++;
             return htable_set(tmp, field, value);
         }
     }
@@ -182,6 +289,7 @@ static int htable_update_list(HashTable *ht, char *key, char *value, int dir) {
         if (!is_deleted(cur_item) && strcmp(cur_item->key, key) == 0) {
             List *tmp = (List *)cur_item->value;
             dir == LEFT ? list_lpush(tmp, value) : list_rpush(tmp, value);
+            ht->dirty++;
             return tmp->len;
         }
     }
@@ -195,23 +303,78 @@ static bool htable_update_set(HashTable *ht, char *key, char *value) {
         if (cur_item == NULL) break;
         if (!is_deleted(cur_item) && strcmp(cur_item->key, key) == 0) {
             Set *tmp = (Set *)cur_item->value;
-            return set_add(tmp, value);
+            if (!set_add(tmp, value)) return false;
+            ht->dirty++;
+            return true;
         }
     }
     return false;
 }
 
+// overwriting a string reuses its buffer when the new value fits without
+// leaving most of it unused, so a steady stream of sets doesn't allocate
 bool htable_set(HashTable *ht, char *key, char *value) {
+    HashTableItem *item = htable_search(ht, key);
+    int len = strlen(value);
+    if (item != NULL && item->type == STR_T && len <= str_cap(item->value) &&
+        str_cap(item->value) <= 2 * len + 32) {
+        htable_item_set(ht, item, value, len);
+        return false;
+    }
     // allocate mem for str constants
-    char *dup = strdup(value);
+    return htable_set_str(ht, key, str_new(value, len));
+}
+
+// appends in place, the string keeps spare capacity so this is amortized
+// O(1), returns the new length
+int htable_append(HashTable *ht, char *key, char *value) {
+    HashTableItem *tmp = htable_search(ht, key);
+    if (tmp == NULL) {
+        htable_insert(ht, STR_T, key, str_dup(value));
+        return strlen(value);
+    }
+    tmp->value = str_cat(tmp->value, value, strlen(value));
+    ht->dirty++;
+    return str_len(tmp->value);
+}
+
+// patches value in at off, returns the new length
+int htable_setrange(HashTable *ht, char *key, int off, char *value) {
+    HashTableItem *tmp = htable_search(ht, key);
+    if (*value == '\0') return tmp == NULL ? 0 : str_len(tmp->value);
+    if (tmp == NULL) {
+        htable_insert(ht, STR_T, key, str_new(NULL, 0));
+        tmp = htable_search(ht, key);
+    }
+    tmp->value = str_setrange(tmp->value, off, value, strlen(value));
+    ht->dirty++;
+    return str_len(tmp->value);
+}
+
+// takes ownership of str, which must come from str_new
+bool htable_set_str(HashTable *ht, char *key, char *str) {
     if (htable_exists(ht, key)) {
-        htable_update_str(ht, key, dup);
+        htable_update_str(ht, key, str);
         return false;
     }
-    htable_insert(ht, STR_T, key, dup);
+    htable_insert(ht, STR_T, key, str);
     return true;
 }
 
+// zero pads the string at key to at least len bytes, creating it if needed.
+// The caller is about to write into it, so this counts as a change
+char *htable_str_grow(HashTable *ht, char *key, int len) {
+    HashTableItem *tmp = htable_search(ht, key);
+    if (tmp == NULL) {
+        char *str = str_new(NULL, len);
+        htable_insert(ht, STR_T, key, str);
+        return str;
+    }
+    tmp->value = str_grow(tmp->value, len);
+    ht->dirty++;
+    return tmp->value;
+}
+
 bool htable_hset(HashTable *ht, char *key, char *field, char *value) {
     if (htable_exists(ht, key)) {
         return htable_update_hash(ht, key, field, value);
@@ -223,6 +386,7 @@ bool htable_hset(HashTable *ht, char *key, char *field, char *value) {
 }
 
 int htable_push(HashTable *ht, char *key, char *value, int dir) {
+    block_signal(ht, key);
     if (htable_exists(ht, key)) {
         return htable_update_list(ht, key, value, dir);
     }
@@ -232,6 +396,15 @@ int htable_push(HashTable *ht, char *key, char *value, int dir) {
     return 1;
 }
 
+// the string at key must already hold a valid hyperloglog
+int htable_pfadd(HashTable *ht, char *key, char *elem) {
+    HashTableItem *tmp = htable_search(ht, key);
+    if (tmp == NULL) return 0;
+    int res = hll_add((char **)&tmp->value, elem, strlen(elem));
+    ht->dirty += res;
+    return res;
+}
+
 bool htable_sadd(HashTable *ht, char *key, char *value) {
     if (htable_exists(ht, key)) {
         return htable_update_set(ht, key, value);
@@ -246,6 +419,44 @@ static bool is_type(char *given, char *expected) {
     return strcmp(given, expected) == 0 || strcmp(given, "none") == 0;
 }
 
+// inserts value of type at key taking ownership of both, key must not
+// exist. Used by the snapshot loader, which knows its keys are unique and
+// already holds them in allocations of their own
+void htable_add(HashTable *ht, int type, char *key, void *value) {
+    HashTableItem *item = dmalloc(sizeof(HashTableItem));
+    item->type = type;
+    item->key = key;
+    item->value = value;
+    insert_item(ht, item);
+}
+
+// like htable_add, callable from several threads at once. ht must already
+// be large enough for every key, this neither resizes nor counts: the
+// caller sets used once all the threads are done
+void htable_add_atomic(HashTable *ht, int type, char *key, void *value) {
+    HashTableItem *item = dmalloc(sizeof(HashTableItem));
+    item->type = type;
+    item->key = key;
+    item->value = value;
+    for (int i = 0; i < ht->size; i++) {
+        HashTableItem *expected = NULL;
+        int hash = hash_func(key, ht->size, i);
+        if (__atomic_compare_exchange_n(&ht->items[hash], &expected, item,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+// overwrites the string held by item, an item of ht found with
+// htable_search, without looking its key up again
+void htable_item_set(HashTable *ht, HashTableItem *item, char *value,
+                     int len) {
+    item->value = str_assign(item->value, value, len);
+    ht->dirty++;
+}
+
 char *htable_get(HashTable *ht, char *key) {
     HashTableItem *res = htable_search(ht, key);
     return res != NULL ? (char *)res->value : NULL;
@@ -264,6 +475,8 @@ char *htable_pop(HashTable *ht, char *key, int dir) {
     List *tmp_ls = (List *)tmp->value;
     ListNode *tmp_nd = dir == LEFT ? list_lpop(tmp_ls) : list_rpop(tmp_ls);
     char *res = tmp_nd->value;
+    free(tmp_nd);
+    ht->dirty++;
     if (tmp_ls->len == 0) htable_del(ht, key);
     return res;
 }
@@ -325,7 +538,9 @@ bool htable_lset(HashTable *ht, char*key, int id, char *value) {
     HashTableItem *tmp = htable_search(ht, key);
     if (tmp == NULL) return false;
     List *tmp_ls = (List *)tmp->value;
-    return list_set(tmp_ls, id, value);
+    if (!list_set(tmp_ls, id, value)) return false;
+    ht->dirty++;
+    return true;
 }
 
 bool htable_hdel(HashTable *ht, char *key, char *field) {
@@ -333,6 +548,7 @@ bool htable_hdel(HashTable *ht, char *key, char *field) {
     if (tmp == NULL) return false;
     HashTable *tmp_ht = (HashTable *)tmp->value;
     bool res = htable_del(tmp_ht, field);
+    ht->dirty += res;
     if (tmp_ht->used == 0) htable_del(ht, key);
     return res;
 }
@@ -342,6 +558,7 @@ int htable_lrem(HashTable *ht, char *key, int count, char *value) {
     if (tmp == NULL) return 0;
     List *tmp_ls = (List *)tmp->value;
     int res = list_rem(tmp_ls, count, value);
+    ht->dirty += res;
     if (tmp_ls->len == 0) htable_del(ht, key);
     return res;
 }
@@ -351,6 +568,7 @@ bool htable_srem(HashTable *ht, char *key, char *value) {
     if (tmp == NULL) return false;
     Set *tmp_st = (Set *)tmp->value;
     bool res = set_rem(tmp_st, value);
+    ht->dirty += res;
     if (tmp_st->used == 0) htable_del(ht, key);
     return res;
 }
@@ -406,7 +624,6 @@ char **htable_hkeyvals(HashTable *ht, char *key, int ky) {
 char **htable_lrange(HashTable *ht, char *key, int begin, int end) {
     char *type = htable_type(ht, key);
     if (is_type(type, "list")) {
-        free(type);
         HashTableItem *tmp = htable_search(ht, key);
         List *tmp_ls = (List *)tmp->value;
         return list_range(tmp_ls, begin, end);
@@ -0,0 +1,335 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// hyperloglogs are stored as plain string values laid out as
+//   "HYLL" | encoding | 3 unused bytes | 8 byte cached cardinality | data
+// the dense encoding packs 16384 6-bit registers into 12KB, the sparse one
+// keeps only the non zero registers as sorted 3 byte (index, value) entries
+#define HLL_P 14
+#define HLL_Q (64 - HLL_P)
+#define HLL_BITS 6
+#define HLL_REGISTER_MAX ((1 << HLL_BITS) - 1)
+#define HLL_HDR_SIZE 16
+#define HLL_DENSE_SIZE (HLL_HDR_SIZE + (HLL_REGISTERS * HLL_BITS + 7) / 8)
+#define HLL_DENSE 0
+#define HLL_SPARSE 1
+// sparse entries past this size cost more to search than a dense array
+#define HLL_SPARSE_MAX 3000
+#define HLL_ALPHA_INF 0.721347520444481703680
+
+static uint64_t murmur64a(const void *key, int len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const uint8_t *data = key;
+    const uint8_t *end = data + (len - (len & 7));
+
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        data += 8;
+    }
+
+    switch (len & 7) {
+        case 7: h ^= (uint64_t)data[6] << 48; // fallthrough
+        case 6: h ^= (uint64_t)data[5] << 40; // fallthrough
+        case 5: h ^= (uint64_t)data[4] << 32; // fallthrough
+        case 4: h ^= (uint64_t)data[3] << 24; // fallthrough
+        case 3: h ^= (uint64_t)data[2] << 16; // fallthrough
+        case 2: h ^= (uint64_t)data[1] << 8; // fallthrough
+        case 1: h ^= (uint64_t)data[0];
+                h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// register index of elem and the run of zeros (+1) in the rest of its hash
+static int hll_pattern(const char *elem, int len, int *index) {
+    uint64_t hash = murmur64a(elem, len, 0xadc83b19ULL);
+    *index = hash & (HLL_REGISTERS - 1);
+    hash >>= HLL_P;
+    hash |= 1ULL << HLL_Q; // the count stops at HLL_Q + 1
+    return __builtin_ctzll(hash) + 1;
+}
+
+static uint8_t *hll_data(const char *hll) {
+    return (uint8_t *)hll + HLL_HDR_SIZE;
+}
+
+static int hll_encoding(const char *hll) {
+    return hll[4];
+}
+
+static void hll_invalidate(char *hll) {
+    hll[15] |= 0x80;
+}
+
+static int dense_get(const uint8_t *regs, int i) {
+    int b = i * HLL_BITS / 8, fb = i * HLL_BITS & 7;
+    return ((regs[b] >> fb) | (regs[b + 1] << (8 - fb))) & HLL_REGISTER_MAX;
+}
+
+// the last register touches the byte after the array, which is the str's
+// null terminator and is left untouched since its bits are all masked out
+static void dense_set(uint8_t *regs, int i, int val) {
+    int b = i * HLL_BITS / 8, fb = i * HLL_BITS & 7;
+    regs[b] &= ~(HLL_REGISTER_MAX << fb);
+    regs[b] |= val << fb;
+    regs[b + 1] &= ~(HLL_REGISTER_MAX >> (8 - fb));
+    regs[b + 1] |= val >> (8 - fb);
+}
+
+// expands the packed registers into one byte per register
+static void dense_unpack(const uint8_t *p, uint8_t *regs) {
+    for (int i = 0; i < HLL_REGISTERS; i += 4, p += 3) {
+        regs[i] = p[0] & 63;
+        regs[i + 1] = (p[0] >> 6 | p[1] << 2) & 63;
+        regs[i + 2] = (p[1] >> 4 | p[2] << 4) & 63;
+        regs[i + 3] = p[2] >> 2;
+    }
+}
+
+static int sparse_entries(const char *hll) {
+    return (str_len(hll) - HLL_HDR_SIZE) / 3;
+}
+
+static int sparse_index(const uint8_t *e) {
+    return (e[0] << 16 | e[1] << 8 | e[2]) >> HLL_BITS;
+}
+
+static int sparse_value(const uint8_t *e) {
+    return e[2] & HLL_REGISTER_MAX;
+}
+
+static void sparse_write(uint8_t *e, int index, int val) {
+    int packed = index << HLL_BITS | val;
+    e[0] = packed >> 16;
+    e[1] = packed >> 8;
+    e[2] = packed;
+}
+
+// slot of the first entry whose index is >= index
+static int sparse_find(const char *hll, int index) {
+    const uint8_t *data = hll_data(hll);
+    int lo = 0, hi = sparse_entries(hll);
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sparse_index(data + mid * 3) < index) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static char *sparse_to_dense(char *hll) {
+    char *dense = str_new(NULL, HLL_DENSE_SIZE);
+    memcpy(dense, hll, HLL_HDR_SIZE);
+    dense[4] = HLL_DENSE;
+    const uint8_t *e = hll_data(hll);
+    int n = sparse_entries(hll);
+    for (int i = 0; i < n; i++, e += 3) {
+        dense_set(hll_data(dense), sparse_index(e), sparse_value(e));
+    }
+    str_free(hll);
+    return dense;
+}
+
+// max of two register arrays, one byte per register
+static void regs_max_scalar(uint8_t *dst, const uint8_t *src, int n) {
+    for (int i = 0; i < n; i++) if (src[i] > dst[i]) dst[i] = src[i];
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void regs_max_avx2(uint8_t *dst, const uint8_t *src, int n) {
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_max_epu8(a, b));
+    }
+    regs_max_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+static void regs_max(uint8_t *dst, const uint8_t *src, int n) {
+#ifdef HAVE_X86
+    if (has_avx2()) {
+        regs_max_avx2(dst, src, n);
+        return;
+    }
+#endif
+    regs_max_scalar(dst, src, n);
+}
+
+static double hll_tau(double x) {
+    if (x == 0. || x == 1.) return 0.;
+    double prev, y = 1.0, z = 1 - x;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2) * y;
+    } while (prev != z);
+    return z / 3;
+}
+
+static double hll_sigma(double x) {
+    if (x == 1.) return INFINITY;
+    double prev, y = 1, z = x;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+// Ertl's improved estimator over a histogram of register values
+static long hll_estimate(const int *histo) {
+    double m = HLL_REGISTERS;
+    double z = m * hll_tau((m - histo[HLL_Q + 1]) / m);
+    for (int j = HLL_Q; j >= 1; j--) {
+        z += histo[j];
+        z *= 0.5;
+    }
+    z += m * hll_sigma(histo[0] / m);
+    return llroundl(HLL_ALPHA_INF * m * m / z);
+}
+
+char *hll_new() {
+    char *hll = str_new(NULL, HLL_HDR_SIZE);
+    memcpy(hll, "HYLL", 4);
+    hll[4] = HLL_SPARSE;
+    return hll;
+}
+
+// any string may be set on the key, so sparse entries are checked before
+// their indexes and values are used to address registers
+bool hll_valid(const char *hll) {
+    int len = str_len(hll);
+    if (len < HLL_HDR_SIZE || memcmp(hll, "HYLL", 4) != 0) return false;
+    if (hll_encoding(hll) == HLL_DENSE) return len == HLL_DENSE_SIZE;
+    if (hll_encoding(hll) != HLL_SPARSE || (len - HLL_HDR_SIZE) % 3 != 0) {
+        return false;
+    }
+    const uint8_t *e = hll_data(hll);
+    int n = sparse_entries(hll), prev = -1;
+    for (int i = 0; i < n; i++, e += 3) {
+        int index = sparse_index(e);
+        if (index >= HLL_REGISTERS || index <= prev) return false;
+        if (sparse_value(e) > HLL_Q + 1) return false;
+        prev = index;
+    }
+    return true;
+}
+
+// sets the register of elem, may reallocate *hll, 1 if it changed
+int hll_add(char **hll, const char *elem, int len) {
+    int index, count = hll_pattern(elem, len, &index);
+    char *cur = *hll;
+
+    if (hll_encoding(cur) == HLL_SPARSE) {
+        int slot = sparse_find(cur, index);
+        uint8_t *e = hll_data(cur) + slot * 3;
+        if (slot < sparse_entries(cur) && sparse_index(e) == index) {
+            if (sparse_value(e) >= count) return 0;
+            sparse_write(e, index, count);
+            hll_invalidate(cur);
+            return 1;
+        }
+        if (str_len(cur) - HLL_HDR_SIZE + 3 <= HLL_SPARSE_MAX) {
+            int tail = str_len(cur) - HLL_HDR_SIZE - slot * 3;
+            cur = str_grow(cur, str_len(cur) + 3);
+            e = hll_data(cur) + slot * 3;
+            memmove(e + 3, e, tail);
+            sparse_write(e, index, count);
+            hll_invalidate(cur);
+            *hll = cur;
+            return 1;
+        }
+        cur = *hll = sparse_to_dense(cur);
+    }
+
+    uint8_t *regs = hll_data(cur);
+    if (dense_get(regs, index) >= count) return 0;
+    dense_set(regs, index, count);
+    hll_invalidate(cur);
+    return 1;
+}
+
+// folds hll into one byte per register regs with max
+void hll_merge(uint8_t *regs, const char *hll) {
+    if (hll_encoding(hll) == HLL_DENSE) {
+        uint8_t tmp[HLL_REGISTERS];
+        dense_unpack(hll_data(hll), tmp);
+        regs_max(regs, tmp, HLL_REGISTERS);
+        return;
+    }
+    const uint8_t *e = hll_data(hll);
+    int n = sparse_entries(hll);
+    for (int i = 0; i < n; i++, e += 3) {
+        int index = sparse_index(e), val = sparse_value(e);
+        if (val > regs[index]) regs[index] = val;
+    }
+}
+
+long hll_count_regs(const uint8_t *regs) {
+    int histo[64] = {0};
+    for (int i = 0; i < HLL_REGISTERS; i++) histo[regs[i]]++;
+    return hll_estimate(histo);
+}
+
+// cardinality of hll, served from the header cache when it is still valid
+long hll_count(char *hll) {
+    uint8_t *card = (uint8_t *)hll + 8;
+    long res = 0;
+    if ((card[7] & 0x80) == 0) {
+        for (int i = 7; i >= 0; i--) res = res << 8 | card[i];
+        return res;
+    }
+
+    if (hll_encoding(hll) == HLL_DENSE) {
+        uint8_t regs[HLL_REGISTERS];
+        dense_unpack(hll_data(hll), regs);
+        res = hll_count_regs(regs);
+    } else {
+        int histo[64] = {0};
+        const uint8_t *e = hll_data(hll);
+        int n = sparse_entries(hll);
+        histo[0] = HLL_REGISTERS - n;
+        for (int i = 0; i < n; i++, e += 3) histo[sparse_value(e)]++;
+        res = hll_estimate(histo);
+    }
+
+    for (int i = 0; i < 8; i++) card[i] = res >> (i * 8);
+    return res;
+}
+
+// dense hll holding the given one byte per register array
+char *hll_from_regs(const uint8_t *regs) {
+    char *hll = str_new(NULL, HLL_DENSE_SIZE);
+    memcpy(hll, "HYLL", 4);
+    hll[4] = HLL_DENSE;
+    hll_invalidate(hll);
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        if (regs[i]) dense_set(hll_data(hll), i, regs[i]);
+    }
+    return hll;
+}
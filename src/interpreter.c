@@ -1,132 +1,209 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "common.h"
 
-static char *reply_string(char *str) {
-    if (str == NULL) return strdup("$-1\r\n");
-    int n = strlen(str);
-    char *res = dmalloc((n + ndigits(n) + 7) * sizeof(char));
-    sprintf(res, "$%d\r\n%s\r\n", n, str);
+// arena of the command being interpreted, replies are built in it so that
+// they cost no heap allocation and are released along with the request
+static Arena *reply_arena = NULL;
+// protocol of the command being interpreted. RESP3 has native nulls, maps
+// and booleans where RESP2 makes do with arrays and integers
+static int reply_resp = 2;
+
+#define reply_fmt(...) str_fmt_in(reply_arena, __VA_ARGS__)
+
+static char *reply_dup(const char *msg) {
+    return str_new_in(reply_arena, msg, strlen(msg));
+}
+
+static char *reply_bulk(const char *buf, int len) {
+    char hdr[16];
+    int n = sprintf(hdr, "$%d\r\n", len);
+    char *res = str_new_in(reply_arena, NULL, n + len + 2);
+    memcpy(res, hdr, n);
+    memcpy(res + n, buf, len);
+    memcpy(res + n + len, "\r\n", 2);
     return res;
 }
 
-static char *reply_integer(int x) {
-    char *res = dmalloc((ndigits(x) + 5) * sizeof(char));
-    sprintf(res, ":%d\r\n", x);
+static char *reply_null() {
+    return reply_dup(reply_resp == 3 ? "_\r\n" : "$-1\r\n");
+}
+
+static char *reply_string(char *str) {
+    if (str == NULL) return reply_null();
+    return reply_bulk(str, strlen(str));
+}
+
+// replies with a stored value, which may hold arbitrary bytes
+static char *reply_value(char *str) {
+    if (str == NULL) return reply_string(NULL);
+    return reply_bulk(str, str_len(str));
+}
+
+static char *reply_integer(long long x) {
+    return reply_fmt(":%lld\r\n", x);
+}
+
+static char *reply_bool(bool x) {
+    if (reply_resp == 3) return reply_dup(x ? "#t\r\n" : "#f\r\n");
+    return reply_integer(x);
+}
+
+// appends the encoded element part to the aggregate reply res
+static char *reply_add(char *res, char *part) {
+    res = str_cat(res, part, str_len(part));
+    str_free(part);
     return res;
 }
 
+// elements are always sent as bulk strings, a value that looks like a
+// number is still a string
 static char *reply_array_n(char **arr, int n) {
-    char *res = dmalloc((ndigits(n) + 5) * sizeof(char));
-    sprintf(res, "*%d\r\n", n);
-    for (int i = 0; i < n; i++) {
-        char *tmp;
-        if (arr[i] == NULL)  {
-            tmp = reply_string(NULL);
-        } else {
-            tmp = is_number(arr[i])
-                ? reply_integer(strtoi(arr[i]))
-                : reply_string(arr[i]);
-        }
-        res = drealloc(res, (strlen(res) + strlen(tmp) + 1) * sizeof(char));
-        strncat(res, tmp, strlen(tmp) + 1);
-    }
+    char *res = reply_fmt("*%d\r\n", n);
+    for (int i = 0; i < n; i++) res = reply_add(res, reply_string(arr[i]));
     return res;
 }
 
 static char *reply_array(char **arr) {
-    if (arr == NULL) return strdup("*0\r\n");
-    char *res = dmalloc(sizeof(char));
-    *res = '\0';
+    if (arr == NULL) return reply_dup("*0\r\n");
     int n = 0;
-    while (*arr != NULL) {
-        char *tmp = is_number(*arr)
-            ? reply_integer(strtoi(*arr))
-            : reply_string(*arr);
-        res = drealloc(res, (strlen(res) + strlen(tmp) + 1) * sizeof(char));
-        strncat(res, tmp, strlen(tmp) + 1);
-        arr++;
-        n++;
-    }
-    char *new_res = dmalloc((strlen(res) + ndigits(n) + 5) * sizeof(char));
-    sprintf(new_res, "*%d\r\n%s", n, res);
-    return new_res;
+    while (arr[n] != NULL) n++;
+    return reply_array_n(arr, n);
 }
 
-static char *reply_err_argc(int given, char *expected) {
-    char *res = dmalloc((ndigits(given) + strlen(expected) + 54) * sizeof(char));
-    sprintf(res, "-ERR wrong number of arguments (given %d, expected %s)\r\n",
-            given, expected);
+// arr holds field value pairs, sent as a flat array in RESP2
+static char *reply_map(char **arr) {
+    int n = 0;
+    while (arr != NULL && arr[n] != NULL) n++;
+    char *res = reply_resp == 3 ? reply_fmt("%%%d\r\n", n / 2)
+                                : reply_fmt("*%d\r\n", n);
+    for (int i = 0; i < n; i++) res = reply_add(res, reply_string(arr[i]));
     return res;
 }
 
+// the htable.c getters hand out arrays of copies, freed once replied with
+static void free_strings(char **arr) {
+    if (arr == NULL) return;
+    for (int i = 0; arr[i] != NULL; i++) free(arr[i]);
+    free(arr);
+}
+
+static char *reply_err_argc(int given, char *expected) {
+    return reply_fmt("-ERR wrong number of arguments (given %d, expected %s)\r\n",
+                   given, expected);
+}
+
 static char *reply_err_type() {
-    return strdup("-ERR wrongtype operation\r\n");
+    return reply_dup("-ERR wrongtype operation\r\n");
 }
 
 static char *reply_err_intid() {
-    return strdup("-ERR value is not an integer or out of range\r\n");
+    return reply_dup("-ERR value is not an integer or out of range\r\n");
+}
+
+static char *reply_err_syntax() {
+    return reply_dup("-ERR syntax error\r\n");
+}
+
+static char *reply_err_timeout() {
+    return reply_dup("-ERR timeout is not an integer or out of range\r\n");
+}
+
+// tells the server to park the client until one of its keys is pushed to
+static char *reply_block() {
+    return reply_dup("b");
 }
 
 static bool is_type(char *given, char *expected) {
     return strcmp(given, expected) == 0 || strcmp(given, "none") == 0;
 }
 
+// scratch memory for a handler, taken from the request's arena when it has
+// one and otherwise released by scratch_free
+static void *scratch_alloc(Command *cmd, size_t size) {
+    return cmd->arena != NULL ? arena_alloc(cmd->arena, size) : dmalloc(size);
+}
+
+static void scratch_free(Command *cmd, void *p) {
+    if (cmd->arena == NULL) free(p);
+}
+
+// multi key commands resolve their keys with a batched lookup so the cache
+// misses of all keys overlap
+static HashTableItem **search_keys(HashTable *ht, Command *cmd,
+                                   char **keys, int n) {
+    HashTableItem **items = scratch_alloc(cmd, n * sizeof(HashTableItem *));
+    htable_search_n(ht, keys, n, 1, items);
+    return items;
+}
+
+static char *exec_remove(HashTable *ht, Command *cmd, bool async) {
+    int oks = 0;
+    htable_prefetch(ht, cmd->argv, cmd->argc, 1);
+    for (int i = 0; i < cmd->argc; i++) {
+        oks += async ? htable_unlink(ht, cmd->argv[i])
+                     : htable_del(ht, cmd->argv[i]);
+    }
+    return reply_integer(oks);
+}
+
 char *exec_del(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 1) {
-        int oks = 0;
-        for (int i = 0; i < cmd->argc; i++) {
-            oks += htable_del(ht, cmd->argv[i]);
-        }
-        return reply_integer(oks);
+    return exec_remove(ht, cmd, LAZYFREE_USER_DEL);
+}
+
+char *exec_unlink(HashTable *ht, Command *cmd) {
+    return exec_remove(ht, cmd, true);
+}
+
+char *exec_flushall(HashTable *ht, Command *cmd) {
+    bool async = LAZYFREE_USER_DEL;
+    if (cmd->argc == 1) {
+        if (strcasecmp(cmd->argv[0], "async") == 0) async = true;
+        else if (strcasecmp(cmd->argv[0], "sync") == 0) async = false;
+        else return reply_err_syntax();
     }
-    return reply_err_argc(cmd->argc, "1+");
+    htable_flush(ht, async);
+    return reply_string("OK");
+}
+
+// there is a single database, so flushdb is flushall
+char *exec_flushdb(HashTable *ht, Command *cmd) {
+    return exec_flushall(ht, cmd);
 }
 
 char *exec_exists(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 1) {
-        int oks = 0;
-        for (int i = 0; i < cmd->argc; i++) {
-            oks += htable_exists(ht, cmd->argv[i]);
-        }
-        return reply_integer(oks);
-    }
-    return reply_err_argc(cmd->argc, "1+");
+    HashTableItem **items = search_keys(ht, cmd, cmd->argv, cmd->argc);
+    int oks = 0;
+    for (int i = 0; i < cmd->argc; i++) oks += items[i] != NULL;
+    scratch_free(cmd, items);
+    return reply_integer(oks);
 }
 
 char *exec_type(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *res = htable_type(ht, cmd->argv[0]);
-        return reply_string(res);
-    }
-    return reply_err_argc(cmd->argc, "1");
+    char *res = htable_type(ht, cmd->argv[0]);
+    return reply_string(res);
 }
 
 char *exec_set(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 0 && cmd->argc <= 2) {
-        if (cmd->argc == 1) htable_set(ht, cmd->argv[0], "");
-        if (cmd->argc == 2) htable_set(ht, cmd->argv[0], cmd->argv[1]);
-        return reply_string("OK");
-    }
-    return reply_err_argc(cmd->argc, "0..2");
+    if (cmd->argc == 1) htable_set(ht, cmd->argv[0], "");
+    if (cmd->argc == 2) htable_set(ht, cmd->argv[0], cmd->argv[1]);
+    return reply_string("OK");
 }
 
 char *exec_get(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "string")) {
-            free(type);
-            char *res = htable_get(ht, cmd->argv[0]);
-            return reply_string(res);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *res = htable_get(ht, cmd->argv[0]);
+        return reply_value(res);
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_mset(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 2 && cmd->argc % 2 == 0) {
+    if (cmd->argc % 2 == 0) {
+        htable_prefetch(ht, cmd->argv, cmd->argc / 2, 2);
         for (int i = 0; i < cmd->argc; i += 2) {
             htable_set(ht, cmd->argv[i], cmd->argv[i+1]);
         }
@@ -136,130 +213,452 @@ char *exec_mset(HashTable *ht, Command *cmd) {
 }
 
 char *exec_mget(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "string")) {
-            free(type);
-            char **res = dmalloc(cmd->argc * sizeof(char *));
-            for (int i = 0; i < cmd->argc; i++) {
-                char *tmp = htable_get(ht, cmd->argv[i]);
-                res[i] = tmp == NULL ? NULL : strdup(tmp);
-            }
-            return reply_array_n(res, cmd->argc);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        HashTableItem **items = search_keys(ht, cmd, cmd->argv, cmd->argc);
+        char *res = reply_fmt("*%d\r\n", cmd->argc);
+        for (int i = 0; i < cmd->argc; i++) {
+            bool str = items[i] != NULL && items[i]->type == STR_T;
+            res = reply_add(res, reply_value(str ? items[i]->value : NULL));
         }
-        return reply_err_type();
+        scratch_free(cmd, items);
+        return res;
     }
-    return reply_err_argc(cmd->argc, "1+");
+    return reply_err_type();
+}
+
+// stores x at key as text, htable_set copies it
+static void set_integer(HashTable *ht, char *key, int x) {
+    char num[16];
+    sprintf(num, "%d", x);
+    htable_set(ht, key, num);
 }
 
 char *exec_incr(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "string")) {
-            free(type);
-            char *res = htable_get(ht, cmd->argv[0]);
-            if (res == NULL) {
-                htable_set(ht, cmd->argv[0], "1");
-                return reply_integer(1);
-            }
-            if (is_number(res)) {
-                int tmp = strtoi(res) + 1;
-                htable_set(ht, cmd->argv[0], intostr(tmp));
-                return reply_integer(tmp);
-            }
-            return reply_err_intid();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *res = htable_get(ht, cmd->argv[0]);
+        if (res == NULL) {
+            htable_set(ht, cmd->argv[0], "1");
+            return reply_integer(1);
         }
-        return reply_err_type();
+        if (is_number(res)) {
+            int tmp = strtoi(res) + 1;
+            set_integer(ht, cmd->argv[0], tmp);
+            return reply_integer(tmp);
+        }
+        return reply_err_intid();
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_decr(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "string")) {
-            free(type);
-            char *res = htable_get(ht, cmd->argv[0]);
-            if (res == NULL) {
-                htable_set(ht, cmd->argv[0], "-1");
-                return reply_integer(-1);
-            }
-            if (is_number(res)) {
-                int tmp = strtoi(res) - 1;
-                htable_set(ht, cmd->argv[0], intostr(tmp));
-                return reply_integer(tmp);
-            }
-            return reply_err_intid();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *res = htable_get(ht, cmd->argv[0]);
+        if (res == NULL) {
+            htable_set(ht, cmd->argv[0], "-1");
+            return reply_integer(-1);
         }
-        return reply_err_type();
+        if (is_number(res)) {
+            int tmp = strtoi(res) - 1;
+            set_integer(ht, cmd->argv[0], tmp);
+            return reply_integer(tmp);
+        }
+        return reply_err_intid();
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_incrby(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "string")) {
-            free(type);
-            char *res = htable_get(ht, cmd->argv[0]);
-            if (res == NULL && is_number(cmd->argv[1])) {
-                int tmp = strtoi(cmd->argv[1]);
-                htable_set(ht, cmd->argv[0], intostr(tmp));
-                return reply_integer(tmp);
-            }
-            if (is_number(res) && is_number(cmd->argv[1])) {
-                int tmp = strtoi(res) + strtoi(cmd->argv[1]);
-                htable_set(ht, cmd->argv[0], intostr(tmp));
-                return reply_integer(tmp);
-            }
-            return reply_err_intid();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *res = htable_get(ht, cmd->argv[0]);
+        if (res == NULL && is_number(cmd->argv[1])) {
+            int tmp = strtoi(cmd->argv[1]);
+            set_integer(ht, cmd->argv[0], tmp);
+            return reply_integer(tmp);
         }
-        return reply_err_type();
+        if (is_number(res) && is_number(cmd->argv[1])) {
+            int tmp = strtoi(res) + strtoi(cmd->argv[1]);
+            set_integer(ht, cmd->argv[0], tmp);
+            return reply_integer(tmp);
+        }
+        return reply_err_intid();
     }
-    return reply_err_argc(cmd->argc, "2");
+    return reply_err_type();
 }
 
 char *exec_decrby(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "string")) {
-            free(type);
-            char *res = htable_get(ht, cmd->argv[0]);
-            if (res == NULL && is_number(cmd->argv[1])) {
-                int tmp = strtoi(cmd->argv[1]);
-                htable_set(ht, cmd->argv[0], intostr(tmp));
-                return reply_integer(tmp);
-            }
-            if (is_number(res) && is_number(cmd->argv[1])) {
-                int tmp = strtoi(res) - strtoi(cmd->argv[1]);
-                htable_set(ht, cmd->argv[0], intostr(tmp));
-                return reply_integer(tmp);
-            }
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *res = htable_get(ht, cmd->argv[0]);
+        if (res == NULL && is_number(cmd->argv[1])) {
+            int tmp = strtoi(cmd->argv[1]);
+            set_integer(ht, cmd->argv[0], tmp);
+            return reply_integer(tmp);
+        }
+        if (is_number(res) && is_number(cmd->argv[1])) {
+            int tmp = strtoi(res) - strtoi(cmd->argv[1]);
+            set_integer(ht, cmd->argv[0], tmp);
+            return reply_integer(tmp);
+        }
+        return reply_err_intid();
+    }
+    return reply_err_type();
+}
+
+char *exec_strlen(HashTable *ht, Command *cmd) {
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *res = htable_get(ht, cmd->argv[0]);
+        return reply_integer(res == NULL ? 0 : str_len(res));
+    }
+    return reply_err_type();
+}
+
+// strings and bitmaps are capped at 512MB, so every byte index fits an int
+#define STR_MAX_SIZE (512LL * 1024 * 1024)
+#define BIT_MAX_OFFSET (STR_MAX_SIZE * 8 - 1)
+
+static char *reply_err_strmax() {
+    return reply_dup("-ERR string exceeds maximum allowed size (512MB)\r\n");
+}
+
+// resolves a redis style inclusive byte range against a string of len bytes,
+// false if the range is empty
+static bool byte_range(int len, int *start, int *end) {
+    if (*start < 0) *start += len;
+    if (*end < 0) *end += len;
+    if (*start < 0) *start = 0;
+    if (*end < 0) *end = 0;
+    if (*end >= len) *end = len - 1;
+    return len > 0 && *start <= *end;
+}
+
+char *exec_append(HashTable *ht, Command *cmd) {
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *res = htable_get(ht, cmd->argv[0]);
+        long long len = res == NULL ? 0 : str_len(res);
+        if (len + strlen(cmd->argv[1]) > STR_MAX_SIZE) {
+            return reply_err_strmax();
+        }
+        return reply_integer(htable_append(ht, cmd->argv[0], cmd->argv[1]));
+    }
+    return reply_err_type();
+}
+
+char *exec_getrange(HashTable *ht, Command *cmd) {
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        if (!is_number(cmd->argv[1]) || !is_number(cmd->argv[2])) {
+            return reply_err_intid();
+        }
+        char *res = htable_get(ht, cmd->argv[0]);
+        int len = res == NULL ? 0 : str_len(res);
+        int start = strtoi(cmd->argv[1]), end = strtoi(cmd->argv[2]);
+        if (!byte_range(len, &start, &end)) return reply_bulk("", 0);
+        // the slice is copied straight into the reply
+        return reply_bulk(res + start, end - start + 1);
+    }
+    return reply_err_type();
+}
+
+char *exec_setrange(HashTable *ht, Command *cmd) {
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *off = cmd->argv[1];
+        if (*off == '\0' || *off == '-' || !is_number(off) ||
+            strlen(off) > 10) {
+            return reply_dup("-ERR offset is out of range\r\n");
+        }
+        if (atoll(off) + strlen(cmd->argv[2]) > STR_MAX_SIZE) {
+            return reply_err_strmax();
+        }
+        int res = htable_setrange(ht, cmd->argv[0], atoll(off),
+                                  cmd->argv[2]);
+        return reply_integer(res);
+    }
+    return reply_err_type();
+}
+
+// non negative integer argument of THROTTLE, -1 if it isn't one
+static long long throttle_arg(char *str) {
+    if (*str == '\0' || *str == '-' || !is_number(str) || strlen(str) > 9) {
+        return -1;
+    }
+    return atoll(str);
+}
+
+// microseconds to whole seconds, rounded up so a client that waits that long
+// is never early
+static long long ceil_secs(long long us) {
+    return (us + 999999) / 1000000;
+}
+
+// THROTTLE key max_burst count period [quantity] is a rate limiter based on
+// the generic cell rate algorithm: count requests per period seconds, with
+// bursts of up to max_burst more. The key holds a single timestamp, the
+// theoretical arrival time (tat) at which the limiter would be idle again.
+// A request is allowed if moving tat forward by quantity emission intervals
+// keeps it within the burst tolerance of now. Replies with limited (0 or 1),
+// the limit, the remaining quantity, the seconds until a retry can succeed
+// (-1 if it was allowed or never can be) and until the limiter is reset
+char *exec_throttle(HashTable *ht, Command *cmd) {
+    long long args[4] = {0, 0, 0, 1};
+    for (int i = 1; i < cmd->argc; i++) {
+        if ((args[i-1] = throttle_arg(cmd->argv[i])) < 0) {
             return reply_err_intid();
         }
+    }
+    long long burst = args[0], count = args[1], period = args[2];
+    long long quantity = args[3];
+    if (count == 0 || period == 0) {
+        return reply_dup("-ERR count and period must be positive\r\n");
+    }
+    HashTableItem *item = htable_search(ht, cmd->argv[0]);
+    if (item != NULL && (item->type != STR_T || !is_number(item->value))) {
         return reply_err_type();
     }
-    return reply_err_argc(cmd->argc, "2");
+
+    long long now = ustime(), tolerance, increment;
+    long long interval = period * 1000000 / count;
+    if (interval == 0) interval = 1;
+    if (__builtin_mul_overflow(interval, burst + 1, &tolerance) ||
+        __builtin_mul_overflow(interval, quantity, &increment)) {
+        return reply_err_intid();
+    }
+    long long tat = item != NULL ? atoll(item->value) : now;
+    if (tat < now) tat = now;
+    long long next_tat = tat + increment;
+    long long wait = next_tat - tolerance - now;
+
+    int limited = wait > 0;
+    long long retry = -1, reset = tat - now;
+    if (limited) {
+        if (increment <= tolerance) retry = ceil_secs(wait);
+    } else {
+        reset = next_tat - now;
+        char buf[24];
+        int len = sprintf(buf, "%lld", next_tat);
+        if (item != NULL) htable_item_set(ht, item, buf, len);
+        else htable_set(ht, cmd->argv[0], buf);
+        // logged as the state it left behind, replaying THROTTLE would
+        // run it against the clock at replay time
+        command_rewrite(cmd, SET, 2, (char *[]){cmd->argv[0], buf});
+    }
+    long long remaining = (tolerance - reset) / interval;
+    return reply_fmt("*5\r\n:%d\r\n:%lld\r\n:%lld\r\n:%lld\r\n:%lld\r\n",
+                     limited, burst + 1, remaining < 0 ? 0 : remaining,
+                     retry, ceil_secs(reset));
 }
 
-char *exec_strlen(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
+static long long bit_offset(char *str) {
+    if (*str == '\0' || *str == '-' || !is_number(str) || strlen(str) > 10) {
+        return -1;
+    }
+    long long off = atoll(str);
+    return off <= BIT_MAX_OFFSET ? off : -1;
+}
+
+static char *reply_err_bitoffset() {
+    return reply_dup("-ERR bit offset is not an integer or out of range\r\n");
+}
+
+static char *reply_err_bit() {
+    return reply_dup("-ERR bit is not an integer or out of range\r\n");
+}
+
+char *exec_setbit(HashTable *ht, Command *cmd) {
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        long long off = bit_offset(cmd->argv[1]);
+        if (off < 0) return reply_err_bitoffset();
+        char *val = cmd->argv[2];
+        if (strcmp(val, "0") != 0 && strcmp(val, "1") != 0) {
+            return reply_err_bit();
+        }
+        int byte = off >> 3, mask = 1 << (7 - (off & 7));
+        char *bits = htable_str_grow(ht, cmd->argv[0], byte + 1);
+        int old = (bits[byte] & mask) != 0;
+        bits[byte] = *val == '1' ? bits[byte] | mask : bits[byte] & ~mask;
+        return reply_integer(old);
+    }
+    return reply_err_type();
+}
+
+char *exec_getbit(HashTable *ht, Command *cmd) {
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        long long off = bit_offset(cmd->argv[1]);
+        if (off < 0) return reply_err_bitoffset();
+        char *bits = htable_get(ht, cmd->argv[0]);
+        int byte = off >> 3;
+        if (bits == NULL || byte >= str_len(bits)) return reply_integer(0);
+        return reply_integer((bits[byte] >> (7 - (off & 7))) & 1);
+    }
+    return reply_err_type();
+}
+
+char *exec_bitcount(HashTable *ht, Command *cmd) {
+    if (cmd->argc == 1 || cmd->argc == 3) {
         char *type = htable_type(ht, cmd->argv[0]);
         if (is_type(type, "string")) {
-            free(type);
-            char *res = htable_get(ht, cmd->argv[0]);
-            return reply_integer(res == NULL ? 0 : strlen(res));
+            char *bits = htable_get(ht, cmd->argv[0]);
+            int len = bits != NULL ? str_len(bits) : 0;
+            int start = 0, end = -1;
+            if (cmd->argc == 3) {
+                if (!is_number(cmd->argv[1]) || !is_number(cmd->argv[2])) {
+                    return reply_err_intid();
+                }
+                start = strtoi(cmd->argv[1]);
+                end = strtoi(cmd->argv[2]);
+            }
+            if (!byte_range(len, &start, &end)) return reply_integer(0);
+            unsigned char *p = (unsigned char *)bits + start;
+            return reply_integer(bit_count(p, end - start + 1));
         }
         return reply_err_type();
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_argc(cmd->argc, "1 or 3");
+}
+
+char *exec_bitpos(HashTable *ht, Command *cmd) {
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "string")) {
+        char *val = cmd->argv[1];
+        if (strcmp(val, "0") != 0 && strcmp(val, "1") != 0) {
+            return reply_err_bit();
+        }
+        for (int i = 2; i < cmd->argc; i++) {
+            if (!is_number(cmd->argv[i])) return reply_err_intid();
+        }
+        int bit = *val == '1';
+        char *bits = htable_get(ht, cmd->argv[0]);
+        if (bits == NULL) return reply_integer(bit ? -1 : 0);
+
+        int len = str_len(bits);
+        int start = cmd->argc > 2 ? strtoi(cmd->argv[2]) : 0;
+        int end = cmd->argc > 3 ? strtoi(cmd->argv[3]) : -1;
+        if (!byte_range(len, &start, &end)) return reply_integer(-1);
+
+        unsigned char *p = (unsigned char *)bits + start;
+        long pos = bit_pos(p, end - start + 1, bit);
+        // bit positions of a 512MB string don't fit an int
+        if (pos >= 0) return reply_integer(start * 8LL + pos);
+        // without an explicit end the string counts as padded with zeros
+        if (!bit && cmd->argc <= 3) return reply_integer((end + 1) * 8LL);
+        return reply_integer(-1);
+    }
+    return reply_err_type();
+}
+
+char *exec_bitop(HashTable *ht, Command *cmd) {
+    char *name = cmd->argv[0];
+    int op;
+    if (strcasecmp(name, "and") == 0) op = BIT_AND;
+    else if (strcasecmp(name, "or") == 0) op = BIT_OR;
+    else if (strcasecmp(name, "xor") == 0) op = BIT_XOR;
+    else if (strcasecmp(name, "not") == 0) op = BIT_NOT;
+    else return reply_err_syntax();
+    if (op == BIT_NOT && cmd->argc != 3) {
+        return reply_dup("-ERR BITOP NOT must be called with a single source key\r\n");
+    }
+
+    int n = cmd->argc - 2;
+    unsigned char **srcs = dmalloc(n * sizeof(unsigned char *));
+    long *lens = dmalloc(n * sizeof(long));
+    long maxlen = 0;
+    for (int i = 0; i < n; i++) {
+        char *type = htable_type(ht, cmd->argv[i + 2]);
+        bool ok = is_type(type, "string");
+        if (!ok) {
+            free(srcs);
+            free(lens);
+            return reply_err_type();
+        }
+        char *bits = htable_get(ht, cmd->argv[i + 2]);
+        srcs[i] = (unsigned char *)bits;
+        lens[i] = bits != NULL ? str_len(bits) : 0;
+        if (lens[i] > maxlen) maxlen = lens[i];
+    }
+
+    if (maxlen == 0) {
+        htable_del(ht, cmd->argv[1]);
+    } else {
+        char *res = str_new(NULL, maxlen);
+        bit_op(op, (unsigned char *)res, maxlen, srcs, lens, n);
+        htable_set_str(ht, cmd->argv[1], res);
+    }
+    free(srcs);
+    free(lens);
+    return reply_integer(maxlen);
+}
+
+static char *reply_err_hll() {
+    return reply_dup("-ERR key is not a valid HyperLogLog string value\r\n");
+}
+
+// string keys that are missing or hold a hyperloglog
+static bool is_hll(HashTable *ht, char *key) {
+    char *type = htable_type(ht, key);
+    bool ok = is_type(type, "string");
+    if (!ok) return false;
+    char *hll = htable_get(ht, key);
+    return hll == NULL || hll_valid(hll);
+}
+
+char *exec_pfadd(HashTable *ht, Command *cmd) {
+    if (!is_hll(ht, cmd->argv[0])) return reply_err_hll();
+    int oks = 0;
+    if (!htable_exists(ht, cmd->argv[0])) {
+        htable_set_str(ht, cmd->argv[0], hll_new());
+        oks = 1;
+    }
+    for (int i = 1; i < cmd->argc; i++) {
+        oks |= htable_pfadd(ht, cmd->argv[0], cmd->argv[i]);
+    }
+    return reply_integer(oks);
+}
+
+char *exec_pfcount(HashTable *ht, Command *cmd) {
+    for (int i = 0; i < cmd->argc; i++) {
+        if (!is_hll(ht, cmd->argv[i])) return reply_err_hll();
+    }
+    if (cmd->argc == 1) {
+        char *hll = htable_get(ht, cmd->argv[0]);
+        return reply_integer(hll != NULL ? hll_count(hll) : 0);
+    }
+    unsigned char *regs = calloc(HLL_REGISTERS, sizeof(unsigned char));
+    for (int i = 0; i < cmd->argc; i++) {
+        char *hll = htable_get(ht, cmd->argv[i]);
+        if (hll != NULL) hll_merge(regs, hll);
+    }
+    long res = hll_count_regs(regs);
+    free(regs);
+    return reply_integer(res);
+}
+
+char *exec_pfmerge(HashTable *ht, Command *cmd) {
+    for (int i = 0; i < cmd->argc; i++) {
+        if (!is_hll(ht, cmd->argv[i])) return reply_err_hll();
+    }
+    // the destination takes part in the union as well
+    unsigned char *regs = calloc(HLL_REGISTERS, sizeof(unsigned char));
+    for (int i = 0; i < cmd->argc; i++) {
+        char *hll = htable_get(ht, cmd->argv[i]);
+        if (hll != NULL) hll_merge(regs, hll);
+    }
+    htable_set_str(ht, cmd->argv[0], hll_from_regs(regs));
+    free(regs);
+    return reply_string("OK");
 }
 
 char *exec_hset(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 3 && cmd->argc % 2 == 1) {
+    if (cmd->argc % 2 == 1) {
         char *type = htable_type(ht, cmd->argv[0]);
         if (is_type(type, "hash")) {
-            free(type);
             int oks = 0;
             for (int i = 1; i < cmd->argc; i += 2) {
                 oks += htable_hset(ht, cmd->argv[0],
@@ -273,71 +672,55 @@ char *exec_hset(HashTable *ht, Command *cmd) {
 }
 
 char *exec_hget(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "hash")) {
-            free(type);
-            char *res = htable_hget(ht, cmd->argv[0], cmd->argv[1]);
-            return reply_string(res);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "hash")) {
+        char *res = htable_hget(ht, cmd->argv[0], cmd->argv[1]);
+        return reply_string(res);
     }
-    return reply_err_argc(cmd->argc, "2");
+    return reply_err_type();
 }
 
 char *exec_hdel(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "hash")) {
-            free(type);
-            int oks = 0;
-            for (int i = 1; i < cmd->argc; i++) {
-                oks += htable_hdel(ht, cmd->argv[0], cmd->argv[i]);
-            }
-            return reply_integer(oks);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "hash")) {
+        int oks = 0;
+        for (int i = 1; i < cmd->argc; i++) {
+            oks += htable_hdel(ht, cmd->argv[0], cmd->argv[i]);
         }
-        return reply_err_type();
+        return reply_integer(oks);
     }
-    return reply_err_argc(cmd->argc, "2+");
+    return reply_err_type();
 }
 
 char *exec_hgetall(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "hash")) {
-            free(type);
-            char **res = htable_hgetall(ht, cmd->argv[0]);
-            return reply_array(res);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "hash")) {
+        char **res = htable_hgetall(ht, cmd->argv[0]);
+        char *reply = reply_map(res);
+        free_strings(res);
+        return reply;
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_hexists(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "hash")) {
-            free(type);
-            char *res = htable_hget(ht, cmd->argv[0], cmd->argv[1]);
-            return reply_integer(res == NULL ? 0 : 1);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "hash")) {
+        char *res = htable_hget(ht, cmd->argv[0], cmd->argv[1]);
+        return reply_bool(res != NULL);
     }
-    return reply_err_argc(cmd->argc, "2");
+    return reply_err_type();
 }
 
 static char *exec_hkeyvals(HashTable *ht, Command *cmd, int key) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "hash")) {
-            free(type);
-            char **res = htable_hkeyvals(ht, cmd->argv[0], key);
-            return reply_array(res);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "hash")) {
+        char **res = htable_hkeyvals(ht, cmd->argv[0], key);
+        char *reply = reply_array(res);
+        free_strings(res);
+        return reply;
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_hkeys(HashTable *ht, Command *cmd) {
@@ -349,50 +732,41 @@ char *exec_hvals(HashTable *ht, Command *cmd) {
 }
 
 char *exec_hmget(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "hash")) {
-            free(type);
-            if (!htable_exists(ht, cmd->argv[0])) return reply_array(NULL);
-            char **res = dmalloc((cmd->argc - 1) * sizeof(char *));
-            int id = 0;
-            for (int i = 1; i < cmd->argc; i++) {
-                char *tmp = htable_hget(ht, cmd->argv[0], cmd->argv[i]);
-                res[id++] = tmp == NULL ? NULL : strdup(tmp);
-            }
-            return reply_array_n(res, cmd->argc - 1);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "hash")) {
+        HashTableItem *hash = htable_search(ht, cmd->argv[0]);
+        if (hash == NULL) return reply_array(NULL);
+        HashTableItem **items = search_keys(hash->value, cmd, cmd->argv + 1,
+                                            cmd->argc - 1);
+        char *res = reply_fmt("*%d\r\n", cmd->argc - 1);
+        for (int i = 0; i < cmd->argc - 1; i++) {
+            char *val = items[i] != NULL ? items[i]->value : NULL;
+            res = reply_add(res, reply_value(val));
         }
-        return reply_err_type();
+        scratch_free(cmd, items);
+        return res;
     }
-    return reply_err_argc(cmd->argc, "2+");
+    return reply_err_type();
 }
 
 char *exec_hlen(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "hash")) {
-            free(type);
-            return reply_integer(htable_hlen(ht, cmd->argv[0]));
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "hash")) {
+        return reply_integer(htable_hlen(ht, cmd->argv[0]));
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 static char *exec_push(HashTable *ht, Command *cmd, int dir) {
-    if (cmd->argc >= 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            int len;
-            for (int i = 1; i < cmd->argc; i++) {
-                len = htable_push(ht, cmd->argv[0], cmd->argv[i], dir);
-            }
-            return reply_integer(len);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        int len;
+        for (int i = 1; i < cmd->argc; i++) {
+            len = htable_push(ht, cmd->argv[0], cmd->argv[i], dir);
         }
-        return reply_err_type();
+        return reply_integer(len);
     }
-    return reply_err_argc(cmd->argc, "2+");
+    return reply_err_type();
 }
 
 char *exec_lpush(HashTable *ht, Command *cmd) {
@@ -404,16 +778,14 @@ char *exec_rpush(HashTable *ht, Command *cmd) {
 }
 
 char *exec_pop(HashTable *ht, Command *cmd, int dir) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            char *res = htable_pop(ht, cmd->argv[0], dir);
-            return reply_string(res);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        char *res = htable_pop(ht, cmd->argv[0], dir);
+        char *reply = reply_string(res);
+        free(res);
+        return reply;
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_lpop(HashTable *ht, Command *cmd) {
@@ -425,184 +797,208 @@ char *exec_rpop(HashTable *ht, Command *cmd) {
 }
 
 char *exec_llen(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            return reply_integer(htable_llen(ht, cmd->argv[0]));
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        return reply_integer(htable_llen(ht, cmd->argv[0]));
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_lindex(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            if (is_number(cmd->argv[1])) {
-                int id = strtoi(cmd->argv[1]);
-                int code = htable_check_id(ht, cmd->argv[0], &id);
-                if (!code) return reply_err_intid();
-                char *res = code > 0 
-                    ? htable_lindex(ht, cmd->argv[0], id)
-                    : NULL;
-                return reply_string(res);
-            }
-            return reply_err_intid();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        if (is_number(cmd->argv[1])) {
+            int id = strtoi(cmd->argv[1]);
+            int code = htable_check_id(ht, cmd->argv[0], &id);
+            if (!code) return reply_err_intid();
+            char *res = code > 0 
+                ? htable_lindex(ht, cmd->argv[0], id)
+                : NULL;
+            return reply_string(res);
         }
-        return reply_err_type();
+        return reply_err_intid();
     }
-    return reply_err_argc(cmd->argc, "2");
+    return reply_err_type();
 }
 
 char *exec_lrange(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 3) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            if (is_number(cmd->argv[1]) && is_number(cmd->argv[2])) {
-                int bgn = strtoi(cmd->argv[1]), end = strtoi(cmd->argv[2]);
-                int code = htable_check_ids(ht, cmd->argv[0], &bgn, &end);
-                if (!code) return reply_err_intid();
-                char **res = code > 0
-                    ? htable_lrange(ht, cmd->argv[0], bgn, end)
-                    : NULL;
-                return reply_array(res);
-            }
-            return reply_err_intid();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        if (is_number(cmd->argv[1]) && is_number(cmd->argv[2])) {
+            int bgn = strtoi(cmd->argv[1]), end = strtoi(cmd->argv[2]);
+            int code = htable_check_ids(ht, cmd->argv[0], &bgn, &end);
+            if (!code) return reply_err_intid();
+            char **res = code > 0
+                ? htable_lrange(ht, cmd->argv[0], bgn, end)
+                : NULL;
+            char *reply = reply_array(res);
+            free_strings(res);
+            return reply;
         }
-        return reply_err_type();
+        return reply_err_intid();
     }
-    return reply_err_argc(cmd->argc, "3");
+    return reply_err_type();
 }
 
 char *exec_lset(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 3) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            if (is_number(cmd->argv[1])) {
-                int id = strtoi(cmd->argv[1]);
-                int code = htable_check_id(ht, cmd->argv[0], &id);
-                if (!code) return reply_err_intid();
-                htable_lset(ht, cmd->argv[0], id, cmd->argv[2]);
-                char *res = code > 0 ?  "OK" : NULL;
-                return reply_string(res);
-            }
-            return reply_err_intid();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        if (is_number(cmd->argv[1])) {
+            int id = strtoi(cmd->argv[1]);
+            int code = htable_check_id(ht, cmd->argv[0], &id);
+            if (!code) return reply_err_intid();
+            htable_lset(ht, cmd->argv[0], id, cmd->argv[2]);
+            char *res = code > 0 ?  "OK" : NULL;
+            return reply_string(res);
         }
-        return reply_err_type();
+        return reply_err_intid();
     }
-    return reply_err_argc(cmd->argc, "3");
+    return reply_err_type();
 }
 
 char *exec_lrem(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 3) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            if (is_number(cmd->argv[1])) {
-                int count = strtoi(cmd->argv[1]);
-                int res = htable_lrem(ht, cmd->argv[0], count, cmd->argv[2]);
-                return reply_integer(res);
-            }
-            return reply_err_intid();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        if (is_number(cmd->argv[1])) {
+            int count = strtoi(cmd->argv[1]);
+            int res = htable_lrem(ht, cmd->argv[0], count, cmd->argv[2]);
+            return reply_integer(res);
         }
-        return reply_err_type();
+        return reply_err_intid();
     }
-    return reply_err_argc(cmd->argc, "3");
+    return reply_err_type();
 }
 
 char *exec_lpos(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "list")) {
-            free(type);
-            int res = htable_lpos(ht, cmd->argv[0], cmd->argv[1]);
-            return res < 0 ? reply_string(NULL) : reply_integer(res);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "list")) {
+        int res = htable_lpos(ht, cmd->argv[0], cmd->argv[1]);
+        return res < 0 ? reply_string(NULL) : reply_integer(res);
+    }
+    return reply_err_type();
+}
+
+static char *exec_bpop(HashTable *ht, Command *cmd, int dir) {
+    char *timeout = cmd->argv[cmd->argc - 1];
+    if (!is_number(timeout) || strtoi(timeout) < 0) {
+        return reply_err_timeout();
+    }
+    for (int i = 0; i < cmd->argc - 1; i++) {
+        char *type = htable_type(ht, cmd->argv[i]);
+        bool ok = is_type(type, "list");
+        if (!ok) return reply_err_type();
+    }
+    for (int i = 0; i < cmd->argc - 1; i++) {
+        if (htable_exists(ht, cmd->argv[i])) {
+            char *res[] = {cmd->argv[i], htable_pop(ht, cmd->argv[i], dir)};
+            char *reply = reply_array_n(res, 2);
+            free(res[1]);
+            return reply;
         }
-        return reply_err_type();
     }
-    return reply_err_argc(cmd->argc, "2");
+    return reply_block();
+}
+
+char *exec_blpop(HashTable *ht, Command *cmd) {
+    return exec_bpop(ht, cmd, LEFT);
+}
+
+char *exec_brpop(HashTable *ht, Command *cmd) {
+    return exec_bpop(ht, cmd, RIGHT);
+}
+
+static int list_dir(char *str) {
+    if (strcasecmp(str, "left") == 0) return LEFT;
+    if (strcasecmp(str, "right") == 0) return RIGHT;
+    return -1;
+}
+
+static char *exec_move(HashTable *ht, Command *cmd, bool blocking) {
+    char *src = cmd->argv[0], *dst = cmd->argv[1];
+    int from = list_dir(cmd->argv[2]), to = list_dir(cmd->argv[3]);
+    if (from < 0 || to < 0) return reply_err_syntax();
+
+    char *src_type = htable_type(ht, src), *dst_type = htable_type(ht, dst);
+    bool ok = is_type(src_type, "list") && is_type(dst_type, "list");
+    if (!ok) return reply_err_type();
+
+    if (!htable_exists(ht, src)) {
+        return blocking ? reply_block() : reply_string(NULL);
+    }
+    char *value = htable_pop(ht, src, from);
+    htable_push(ht, dst, value, to);
+    char *res = reply_string(value);
+    free(value);
+    return res;
+}
+
+char *exec_lmove(HashTable *ht, Command *cmd) {
+    return exec_move(ht, cmd, false);
+}
+
+char *exec_blmove(HashTable *ht, Command *cmd) {
+    if (!is_number(cmd->argv[4]) || strtoi(cmd->argv[4]) < 0) {
+        return reply_err_timeout();
+    }
+    return exec_move(ht, cmd, true);
 }
 
 char *exec_sadd(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "set")) {
-            free(type);
-            int oks = 0;
-            for (int i = 1; i < cmd->argc; i++) {
-                oks += htable_sadd(ht, cmd->argv[0], cmd->argv[i]);
-            }
-            return reply_integer(oks);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "set")) {
+        int oks = 0;
+        for (int i = 1; i < cmd->argc; i++) {
+            oks += htable_sadd(ht, cmd->argv[0], cmd->argv[i]);
         }
-        return reply_err_type();
+        return reply_integer(oks);
     }
-    return reply_err_argc(cmd->argc, "2+");
+    return reply_err_type();
 }
 
 char *exec_srem(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "set")) {
-            free(type);
-            int oks = 0;
-            for (int i = 1; i < cmd->argc; i++) {
-                oks += htable_srem(ht, cmd->argv[0], cmd->argv[i]);
-            }
-            return reply_integer(oks);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "set")) {
+        int oks = 0;
+        for (int i = 1; i < cmd->argc; i++) {
+            oks += htable_srem(ht, cmd->argv[0], cmd->argv[i]);
         }
-        return reply_err_type();
+        return reply_integer(oks);
     }
-    return reply_err_argc(cmd->argc, "2+");
+    return reply_err_type();
 }
 
 char *exec_sismember(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "set")) {
-            free(type);
-            int x = htable_sismember(ht, cmd->argv[0], cmd->argv[1]);
-            return reply_integer(x);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "set")) {
+        bool x = htable_sismember(ht, cmd->argv[0], cmd->argv[1]);
+        return reply_bool(x);
     }
-    return reply_err_argc(cmd->argc, "2");
+    return reply_err_type();
 }
 
 char *exec_smembers(HashTable *ht, Command *cmd) {
-    if (cmd->argc == 1) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "set")) {
-            free(type);
-            char **res = htable_smembers(ht, cmd->argv[0]);
-            return reply_array(res);
-        }
-        return reply_err_type();
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "set")) {
+        char **res = htable_smembers(ht, cmd->argv[0]);
+        char *reply = reply_array(res);
+        free_strings(res);
+        return reply;
     }
-    return reply_err_argc(cmd->argc, "1");
+    return reply_err_type();
 }
 
 char *exec_smismember(HashTable *ht, Command *cmd) {
-    if (cmd->argc >= 2) {
-        char *type = htable_type(ht, cmd->argv[0]);
-        if (is_type(type, "set")) {
-            free(type);
-            if (!htable_exists(ht, cmd->argv[0])) return reply_array(NULL);
-            char **res = dmalloc((cmd->argc - 1) * sizeof(char *));
-            int id = 0;
-            for (int i = 1; i < cmd->argc; i++) {
-                int x = htable_sismember(ht, cmd->argv[0], cmd->argv[i]);
-                res[id++] = intostr(x);
-            }
-            return reply_array_n(res, cmd->argc - 1);
+    char *type = htable_type(ht, cmd->argv[0]);
+    if (is_type(type, "set")) {
+        if (!htable_exists(ht, cmd->argv[0])) return reply_array(NULL);
+        char *res = reply_fmt("*%d\r\n", cmd->argc - 1);
+        for (int i = 1; i < cmd->argc; i++) {
+            bool x = htable_sismember(ht, cmd->argv[0], cmd->argv[i]);
+            res = reply_add(res, reply_bool(x));
         }
-        return reply_err_type();
+        return res;
     }
-    return reply_err_argc(cmd->argc, "2+");
+    return reply_err_type();
 }
 
 // char *exec_(HashTable *ht, Command *cmd) {
@@ -617,37 +1013,289 @@ char *exec_smismember(HashTable *ht, Command *cmd) {
 // }
 
 char *exec_unknown(HashTable *ht, Command *cmd) {
-    return strdup("-ERR unrecognized command\r\n");
+    return reply_dup("-ERR unrecognized command\r\n");
+}
+
+// HELLO [protover] switches the protocol of the connection. The reply is
+// already encoded in the new version, the server picks it up from cmd
+char *exec_hello(HashTable *ht, Command *cmd) {
+    if (cmd->argc == 1) {
+        char *ver = cmd->argv[0];
+        if (strcmp(ver, "2") != 0 && strcmp(ver, "3") != 0) {
+            return reply_dup("-NOPROTO unsupported protocol version\r\n");
+        }
+        cmd->resp = reply_resp = *ver - '0';
+    }
+    char *res = reply_resp == 3 ? reply_dup("%2\r\n") : reply_dup("*4\r\n");
+    res = reply_add(res, reply_string("server"));
+    res = reply_add(res, reply_string("verokv"));
+    res = reply_add(res, reply_string("proto"));
+    return reply_add(res, reply_integer(reply_resp));
+}
+
+char *exec_bgsave(HashTable *ht, Command *cmd) {
+    if (snapshot_stats().in_progress) {
+        return reply_dup("-ERR Background save already in progress\r\n");
+    }
+    if (aof_stats().rewrite_in_progress) {
+        return reply_dup("-ERR An AOF rewrite is in progress\r\n");
+    }
+    if (!snapshot_bgsave(ht, SNAPSHOT_FILE)) {
+        return reply_dup("-ERR Background save could not be started\r\n");
+    }
+    return reply_string("Background saving started");
+}
+
+char *exec_bgrewriteaof(HashTable *ht, Command *cmd) {
+    AofStats aof = aof_stats();
+    if (!aof.enabled) return reply_dup("-ERR AOF is disabled\r\n");
+    if (aof.rewrite_in_progress) {
+        return reply_dup("-ERR AOF rewrite already in progress\r\n");
+    }
+    if (snapshot_stats().in_progress) {
+        return reply_dup("-ERR Background save in progress\r\n");
+    }
+    if (!aof_rewrite_start(ht)) {
+        return reply_dup("-ERR AOF rewrite could not be started\r\n");
+    }
+    return reply_string("Background append only file rewriting started");
+}
+
+// INFO [section], only the persistence section exists so far
+char *exec_info(HashTable *ht, Command *cmd) {
+    if (cmd->argc == 1 && strcasecmp(cmd->argv[0], "persistence") != 0 &&
+        strcasecmp(cmd->argv[0], "all") != 0 &&
+        strcasecmp(cmd->argv[0], "default") != 0) {
+        return reply_string("");
+    }
+    SnapshotStats st = snapshot_stats();
+    AofStats aof = aof_stats();
+    BatchStats batch = batch_stats();
+    char *res = str_fmt(
+        "# Persistence\r\n"
+        "rdb_changes_since_last_save:%lld\r\n"
+        "rdb_bgsave_in_progress:%d\r\n"
+        "rdb_last_save_time:%lld\r\n"
+        "rdb_last_bgsave_status:%s\r\n"
+        "rdb_current_bgsave_keys_processed:%lld\r\n"
+        "rdb_current_bgsave_keys_total:%lld\r\n"
+        "rdb_current_cow_size:%lld\r\n"
+        "rdb_last_cow_size:%lld\r\n"
+        "latest_fork_usec:%lld\r\n"
+        "aof_enabled:%d\r\n"
+        "aof_fsync:%s\r\n"
+        "aof_format:%s\r\n"
+        "aof_current_size:%lld\r\n"
+        "aof_buffer_length:%lld\r\n"
+        "aof_last_write_status:%s\r\n"
+        "aof_rewrite_in_progress:%d\r\n"
+        "aof_last_bgrewrite_status:%s\r\n"
+        "aof_base_size:%lld\r\n"
+        "aof_rewrites:%lld\r\n"
+        "aof_segments:%d\r\n"
+        "batch_enabled:%d\r\n"
+        "batch_pending:%lld\r\n"
+        "batch_written:%lld\r\n"
+        "batch_stalls:%lld\r\n"
+        "batch_last_write_status:%s\r\n",
+        ht->dirty - st.saved_dirty, st.in_progress, st.last_save,
+        st.last_ok ? "ok" : "err", st.keys_done, st.keys_total,
+        st.cow_bytes, st.last_cow_bytes, st.fork_usec, aof.enabled,
+        aof.fsync, aof.format, aof.size, aof.pending, aof.last_ok ? "ok" : "err",
+        aof.rewrite_in_progress, aof.last_rewrite_ok ? "ok" : "err",
+        aof.base_size, aof.rewrites, aof.segments, batch.enabled,
+        batch.pending, batch.written, batch.stalls,
+        batch.last_ok ? "ok" : "err");
+    char *reply = reply_value(res);
+    str_free(res);
+    return reply;
+}
+
+// MULTI, EXEC, DISCARD, WATCH and UNWATCH need a client and are handled by
+// multi.c before a command reaches the interpreter
+char *exec_transaction(HashTable *ht, Command *cmd) {
+    return reply_dup("-ERR transactions need a client connection\r\n");
 }
 
 char *exec_quit(HashTable *ht, Command *cmd) {
-    return strdup("q");
+    return reply_dup("q");
 }
 
 char *exec_shutdown(HashTable *ht, Command *cmd) {
-    return strdup("x");
+    return reply_dup("x");
 }
 
 char *exec_noop(HashTable *ht, Command *cmd) {
-    return strdup("");
-}
-
-static char *(*fns[])(HashTable *, Command *) = {
-    &exec_del, &exec_exists, &exec_type,
-    &exec_set, &exec_get, &exec_mset, &exec_mget,
-    &exec_incr, &exec_decr, &exec_incrby, &exec_decrby, &exec_strlen,
-    &exec_hset, &exec_hget, &exec_hdel, &exec_hgetall,
-    &exec_hexists, &exec_hkeys, &exec_hvals, &exec_hmget, &exec_hlen,
-    &exec_lpush, &exec_lpop, &exec_rpush, &exec_rpop, &exec_llen,
-    &exec_lindex, &exec_lrange, &exec_lset, &exec_lrem, &exec_lpos,
-    &exec_sadd, &exec_srem, &exec_sismember, &exec_smembers,
-    &exec_smismember, &exec_quit, &exec_shutdown, &exec_unknown, &exec_noop
+    return reply_dup("");
+}
+
+// command registry, indexed by Command.type. Columns are name, handler,
+// min and max argc (-1 for no limit), flags, and the first, last (negative
+// counts from the end) and step of the arguments that are keys
+static CommandDef commands[] = {
+    [DEL] = {"del", exec_del, 1, -1, CMD_WRITE, 0, -1, 1},
+    [UNLINK] = {"unlink", exec_unlink, 1, -1, CMD_WRITE, 0, -1, 1},
+    [EXISTS] = {"exists", exec_exists, 1, -1, CMD_READONLY, 0, -1, 1},
+    [TYPE] = {"type", exec_type, 1, 1, CMD_READONLY, 0, 0, 1},
+    [FLUSHALL] = {"flushall", exec_flushall, 0, 1, CMD_WRITE | CMD_ADMIN, 0, 0, 0},
+    [FLUSHDB] = {"flushdb", exec_flushdb, 0, 1, CMD_WRITE | CMD_ADMIN, 0, 0, 0},
+    [SET] = {"set", exec_set, 0, 2, CMD_WRITE, 0, 0, 1},
+    [GET] = {"get", exec_get, 1, 1, CMD_READONLY, 0, 0, 1},
+    [MSET] = {"mset", exec_mset, 2, -1, CMD_WRITE, 0, -1, 2},
+    [MGET] = {"mget", exec_mget, 1, -1, CMD_READONLY, 0, -1, 1},
+    [INCR] = {"incr", exec_incr, 1, 1, CMD_WRITE, 0, 0, 1},
+    [DECR] = {"decr", exec_decr, 1, 1, CMD_WRITE, 0, 0, 1},
+    [INCRBY] = {"incrby", exec_incrby, 2, 2, CMD_WRITE, 0, 0, 1},
+    [DECRBY] = {"decrby", exec_decrby, 2, 2, CMD_WRITE, 0, 0, 1},
+    [STRLEN] = {"strlen", exec_strlen, 1, 1, CMD_READONLY, 0, 0, 1},
+    [APPEND] = {"append", exec_append, 2, 2, CMD_WRITE, 0, 0, 1},
+    [GETRANGE] = {"getrange", exec_getrange, 3, 3, CMD_READONLY, 0, 0, 1},
+    [SETRANGE] = {"setrange", exec_setrange, 3, 3, CMD_WRITE, 0, 0, 1},
+    [THROTTLE] = {"throttle", exec_throttle, 4, 5, CMD_WRITE, 0, 0, 1},
+    [SETBIT] = {"setbit", exec_setbit, 3, 3, CMD_WRITE, 0, 0, 1},
+    [GETBIT] = {"getbit", exec_getbit, 2, 2, CMD_READONLY, 0, 0, 1},
+    [BITCOUNT] = {"bitcount", exec_bitcount, 1, 3, CMD_READONLY, 0, 0, 1},
+    [BITOP] = {"bitop", exec_bitop, 3, -1, CMD_WRITE, 1, -1, 1},
+    [BITPOS] = {"bitpos", exec_bitpos, 2, 4, CMD_READONLY, 0, 0, 1},
+    [PFADD] = {"pfadd", exec_pfadd, 1, -1, CMD_WRITE, 0, 0, 1},
+    [PFCOUNT] = {"pfcount", exec_pfcount, 1, -1, CMD_READONLY, 0, -1, 1},
+    [PFMERGE] = {"pfmerge", exec_pfmerge, 1, -1, CMD_WRITE, 0, -1, 1},
+    [HSET] = {"hset", exec_hset, 3, -1, CMD_WRITE, 0, 0, 1},
+    [HGET] = {"hget", exec_hget, 2, 2, CMD_READONLY, 0, 0, 1},
+    [HDEL] = {"hdel", exec_hdel, 2, -1, CMD_WRITE, 0, 0, 1},
+    [HGETALL] = {"hgetall", exec_hgetall, 1, 1, CMD_READONLY, 0, 0, 1},
+    [HEXISTS] = {"hexists", exec_hexists, 2, 2, CMD_READONLY, 0, 0, 1},
+    [HKEYS] = {"hkeys", exec_hkeys, 1, 1, CMD_READONLY, 0, 0, 1},
+    [HVALS] = {"hvals", exec_hvals, 1, 1, CMD_READONLY, 0, 0, 1},
+    [HMGET] = {"hmget", exec_hmget, 2, -1, CMD_READONLY, 0, 0, 1},
+    [HLEN] = {"hlen", exec_hlen, 1, 1, CMD_READONLY, 0, 0, 1},
+    [LPUSH] = {"lpush", exec_lpush, 2, -1, CMD_WRITE, 0, 0, 1},
+    [LPOP] = {"lpop", exec_lpop, 1, 1, CMD_WRITE, 0, 0, 1},
+    [RPUSH] = {"rpush", exec_rpush, 2, -1, CMD_WRITE, 0, 0, 1},
+    [RPOP] = {"rpop", exec_rpop, 1, 1, CMD_WRITE, 0, 0, 1},
+    [LLEN] = {"llen", exec_llen, 1, 1, CMD_READONLY, 0, 0, 1},
+    [LINDEX] = {"lindex", exec_lindex, 2, 2, CMD_READONLY, 0, 0, 1},
+    [LRANGE] = {"lrange", exec_lrange, 3, 3, CMD_READONLY, 0, 0, 1},
+    [LSET] = {"lset", exec_lset, 3, 3, CMD_WRITE, 0, 0, 1},
+    [LREM] = {"lrem", exec_lrem, 3, 3, CMD_WRITE, 0, 0, 1},
+    [LPOS] = {"lpos", exec_lpos, 2, 2, CMD_READONLY, 0, 0, 1},
+    [BLPOP] = {"blpop", exec_blpop, 2, -1, CMD_WRITE | CMD_BLOCKING, 0, -2, 1},
+    [BRPOP] = {"brpop", exec_brpop, 2, -1, CMD_WRITE | CMD_BLOCKING, 0, -2, 1},
+    [LMOVE] = {"lmove", exec_lmove, 4, 4, CMD_WRITE, 0, 1, 1},
+    [BLMOVE] = {"blmove", exec_blmove, 5, 5, CMD_WRITE | CMD_BLOCKING, 0, 1, 1},
+    [SADD] = {"sadd", exec_sadd, 2, -1, CMD_WRITE, 0, 0, 1},
+    [SREM] = {"srem", exec_srem, 2, -1, CMD_WRITE, 0, 0, 1},
+    [SISMEMBER] = {"sismember", exec_sismember, 2, 2, CMD_READONLY, 0, 0, 1},
+    [SMEMBERS] = {"smembers", exec_smembers, 1, 1, CMD_READONLY, 0, 0, 1},
+    [SMISMEMBER] = {"smismember", exec_smismember, 2, -1, CMD_READONLY, 0, 0, 1},
+    [MULTI] = {"multi", exec_transaction, 0, 0, 0, 0, 0, 0},
+    [EXEC] = {"exec", exec_transaction, 0, 0, 0, 0, 0, 0},
+    [DISCARD] = {"discard", exec_transaction, 0, 0, 0, 0, 0, 0},
+    [WATCH] = {"watch", exec_transaction, 1, -1, 0, 0, -1, 1},
+    [UNWATCH] = {"unwatch", exec_transaction, 0, 0, 0, 0, 0, 0},
+    [HELLO] = {"hello", exec_hello, 0, 1, 0, 0, 0, 0},
+    [BGSAVE] = {"bgsave", exec_bgsave, 0, 0, CMD_ADMIN, 0, 0, 0},
+    [BGREWRITEAOF] = {"bgrewriteaof", exec_bgrewriteaof, 0, 0, CMD_ADMIN, 0, 0, 0},
+    [INFO] = {"info", exec_info, 0, 1, CMD_ADMIN, 0, 0, 0},
+    [QUIT] = {"quit", exec_quit, 0, -1, 0, 0, 0, 0},
+    [SHUTDOWN] = {"shutdown", exec_shutdown, 0, -1, CMD_ADMIN, 0, 0, 0},
+    [UNKNOWN] = {NULL, exec_unknown, 0, -1, 0, 0, 0, 0},
+    [NOOP] = {NULL, exec_noop, 0, -1, 0, 0, 0, 0},
 };
 
+#define COMMAND_BUCKETS 256
+
+// lookup index over the registry: names are bucketed by their length and
+// first and last bytes, which leaves almost every bucket with one entry
+static signed char buckets[COMMAND_BUCKETS];
+static signed char chain[NOOP + 1];
+static bool indexed = false;
+
+static int command_hash(const char *name, int len) {
+    int first = name[0] | 0x20, last = name[len - 1] | 0x20; // ascii lower
+    return (len * 31 + first * 7 + last) & (COMMAND_BUCKETS - 1);
+}
+
+static void command_index() {
+    memset(buckets, -1, sizeof(buckets));
+    for (int i = 0; i <= NOOP; i++) {
+        if (commands[i].name == NULL) continue;
+        int h = command_hash(commands[i].name, strlen(commands[i].name));
+        chain[i] = buckets[h];
+        buckets[h] = i;
+    }
+    indexed = true;
+}
+
+// case insensitive lookup of a command name of len bytes, UNKNOWN if none
+int command_lookup(const char *name, int len) {
+    if (!indexed) command_index();
+    if (len == 0 || len > COMMAND_MAXLEN) return UNKNOWN;
+    for (int i = buckets[command_hash(name, len)]; i >= 0; i = chain[i]) {
+        if (strncasecmp(commands[i].name, name, len) == 0 &&
+            commands[i].name[len] == '\0') return i;
+    }
+    return UNKNOWN;
+}
+
+CommandDef *command_def(int type) {
+    return &commands[type];
+}
+
+static char *reply_err_arity(CommandDef *def, int given) {
+    char expected[32];
+    if (def->arity_max < 0) {
+        sprintf(expected, "%d+", def->arity_min);
+    } else if (def->arity_min == def->arity_max) {
+        sprintf(expected, "%d", def->arity_min);
+    } else {
+        sprintf(expected, "%d..%d", def->arity_min, def->arity_max);
+    }
+    return reply_err_argc(given, expected);
+}
+
+static char *check(Command *cmd) {
+    CommandDef *def = &commands[cmd->type];
+    if (cmd->type == UNKNOWN) return exec_unknown(NULL, cmd);
+    if (cmd->argc < def->arity_min ||
+        (def->arity_max >= 0 && cmd->argc > def->arity_max)) {
+        return reply_err_arity(def, cmd->argc);
+    }
+    return NULL;
+}
+
+// argv indexes of the first and last key of cmd and the step between keys,
+// false if it has none
+bool command_keys(Command *cmd, int *first, int *last, int *step) {
+    CommandDef *def = &commands[cmd->type];
+    if (def->key_step == 0) return false;
+    *first = def->key_first;
+    *last = def->key_last < 0 ? cmd->argc + def->key_last : def->key_last;
+    if (*last >= cmd->argc) *last = cmd->argc - 1;
+    *step = def->key_step;
+    return *first <= *last;
+}
+
+// error reply if cmd can't run as sent, NULL if it can
+char *command_check(Command *cmd) {
+    Arena *prev = reply_arena;
+    reply_arena = cmd->arena;
+    char *res = check(cmd);
+    reply_arena = prev;
+    return res;
+}
+
+// checks the argument count against the registry before running cmd. The
+// command is left to the caller, which may still need its arguments
 char *interpret(HashTable *ht, Command *cmd) {
-    char *res;
-    res = fns[cmd->type](ht, cmd);
-    command_free(cmd);
+    Arena *prev = reply_arena;
+    int prev_resp = reply_resp;
+    reply_arena = cmd->arena;
+    reply_resp = cmd->resp;
+    char *res = check(cmd);
+    if (res == NULL) res = commands[cmd->type].proc(ht, cmd);
+    reply_arena = prev;
+    reply_resp = prev_resp;
     return res;
 }
 
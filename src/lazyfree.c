@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "common.h"
+
+// 1 makes DEL and FLUSHALL/FLUSHDB reclaim memory in the background too
+int LAZYFREE_USER_DEL = 0;
+
+typedef struct FreeJob {
+    void *ptr;
+    void (*fn)(void *);
+    struct FreeJob *next;
+} FreeJob;
+
+static FreeJob *head = NULL, *tail = NULL;
+static int pending = 0;
+static pthread_t thread;
+static bool started = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+static void *lazyfree_thread(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (head == NULL) pthread_cond_wait(&more, &lock);
+        FreeJob *job = head;
+        head = job->next;
+        if (head == NULL) tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        job->fn(job->ptr);
+        free(job);
+
+        pthread_mutex_lock(&lock);
+        if (--pending == 0) pthread_cond_broadcast(&done);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+// hands ptr over to the free thread, it must be unreachable from now on
+void lazyfree(void *ptr, void (*fn)(void *)) {
+    FreeJob *job = dmalloc(sizeof(FreeJob));
+    job->ptr = ptr;
+    job->fn = fn;
+    job->next = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (!started) {
+        pthread_create(&thread, NULL, lazyfree_thread, NULL);
+        pthread_detach(thread);
+        started = true;
+    }
+    tail != NULL ? (tail->next = job) : (head = job);
+    tail = job;
+    pending++;
+    pthread_cond_signal(&more);
+    pthread_mutex_unlock(&lock);
+}
+
+int lazyfree_pending() {
+    pthread_mutex_lock(&lock);
+    int res = pending;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+// blocks until every queued object has been freed
+void lazyfree_wait() {
+    pthread_mutex_lock(&lock);
+    while (pending > 0) pthread_cond_wait(&done, &lock);
+    pthread_mutex_unlock(&lock);
+}
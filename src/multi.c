@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// transactions: between MULTI and EXEC the commands of a client are only
+// checked and queued. EXEC runs them back to back, with nothing from other
+// clients in between, and replies with all of their replies in one array.
+// If a key the client watched changed before EXEC, nothing runs and EXEC
+// replies with a null array. The writes of a transaction reach the hook
+// between a MULTI and an EXEC marker, so the logs can replay all of it or
+// nothing
+
+static char *reply(Arena *a, const char *msg) {
+    return str_new_in(a, msg, strlen(msg));
+}
+
+static Multi *multi_init() {
+    Multi *m = dmalloc(sizeof(Multi));
+    m->cap = 8;
+    m->len = 0;
+    m->cmds = dmalloc(m->cap * sizeof(Command *));
+    m->failed = false;
+    return m;
+}
+
+void multi_free(Multi *m) {
+    if (m == NULL) return;
+    for (int i = 0; i < m->len; i++) command_free(m->cmds[i]);
+    free(m->cmds);
+    free(m);
+}
+
+// queued commands outlive the request, so they are copied off its arena
+static void multi_queue(Multi *m, Command *cmd) {
+    if (m->len == m->cap) {
+        m->cap *= 2;
+        m->cmds = drealloc(m->cmds, m->cap * sizeof(Command *));
+    }
+    m->cmds[m->len++] = command_dup(cmd);
+}
+
+// hands the hook a MULTI or EXEC marker, dirty -1 tells it from a command
+// that ran
+static void mark(HashTable *ht, CommandHook *hook, int type) {
+    Command marker = {.type = type, .name = command_def(type)->name};
+    hook(ht, &marker, -1);
+}
+
+// runs the queued commands, blocking ones get their timeout reply instead
+// of blocking. hook sees every command once it ran, and the markers around
+// them once one of them changed the data set
+static char *multi_exec(HashTable *ht, Multi *m, Arena *a, CommandHook *hook) {
+    char *res = str_fmt_in(a, "*%d\r\n", m->len);
+    bool marked = false;
+    for (int i = 0; i < m->len; i++) {
+        Command *cmd = m->cmds[i];
+        long long dirty = ht->dirty;
+        char *resp = interpret(ht, cmd);
+        if (*resp == 'b') {
+            str_free(resp);
+            resp = reply(NULL, block_nil(cmd->type, cmd->resp));
+        }
+        res = str_cat(res, resp, str_len(resp));
+        str_free(resp);
+        if (hook == NULL) continue;
+        if (!marked && ht->dirty != dirty) {
+            mark(ht, hook, MULTI);
+            marked = true;
+        }
+        hook(ht, cmd, dirty);
+    }
+    if (marked) mark(ht, hook, EXEC);
+    return res;
+}
+
+// handles cmd if it belongs to the transaction layer: MULTI, EXEC, DISCARD,
+// or any command sent while a transaction is open. Returns the reply, or
+// NULL when cmd should run as usual
+char *multi_process(Client *c, HashTable *ht, Command *cmd, CommandHook *hook) {
+    Arena *a = cmd->arena;
+    switch (cmd->type) {
+        case MULTI:
+            if (c->multi != NULL) {
+                return reply(a, "-ERR MULTI calls can not be nested\r\n");
+            }
+            c->multi = multi_init();
+            return reply(a, "$2\r\nOK\r\n");
+        case EXEC:
+        case DISCARD: {
+            if (c->multi == NULL) {
+                return cmd->type == EXEC
+                    ? reply(a, "-ERR EXEC without MULTI\r\n")
+                    : reply(a, "-ERR DISCARD without MULTI\r\n");
+            }
+            Multi *m = c->multi;
+            c->multi = NULL;
+            char *res;
+            if (cmd->type == DISCARD) {
+                res = reply(a, "$2\r\nOK\r\n");
+            } else if (m->failed) {
+                res = reply(a, "-EXECABORT Transaction discarded "
+                               "because of previous errors.\r\n");
+            } else if (watch_changed(c)) {
+                res = reply(a, cmd->resp == 3 ? "_\r\n" : "*-1\r\n");
+            } else {
+                res = multi_exec(ht, m, a, hook);
+            }
+            unwatch_all(c);
+            multi_free(m);
+            return res;
+        }
+        case WATCH:
+            if (c->multi != NULL) {
+                return reply(a, "-ERR WATCH inside MULTI is not allowed\r\n");
+            }
+            for (int i = 0; i < cmd->argc; i++) watch_key(c, cmd->argv[i]);
+            return reply(a, "$2\r\nOK\r\n");
+        case UNWATCH:
+            unwatch_all(c);
+            return reply(a, "$2\r\nOK\r\n");
+        case HELLO:
+        case QUIT:
+        case SHUTDOWN:
+            return NULL;
+        default:
+            break;
+    }
+    if (c->multi == NULL) return NULL;
+
+    char *err = command_check(cmd);
+    if (err != NULL) {
+        c->multi->failed = true;
+        return err;
+    }
+    multi_queue(c->multi, cmd);
+    return reply(a, "$6\r\nQUEUED\r\n");
+}
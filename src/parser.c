@@ -4,168 +4,188 @@
 #include <ctype.h>
 #include "common.h"
 
-static Command *command_init(int type, int argc, char **argv) {
-    Command *cmd = dmalloc(sizeof(Command));
+// commands with more arguments spill the token slices over to the heap
+#define PARSER_SLICES 32
+
+typedef struct Slice {
+    char *ptr;
+    int len;
+} Slice;
+
+// argv and argl live in the same allocation as the command itself, which
+// comes from a when given
+static Command *command_init(Arena *a, int type, int argc) {
+    size_t size = sizeof(Command) + argc * (sizeof(char *) + sizeof(int));
+    Command *cmd = a != NULL ? arena_alloc(a, size) : dmalloc(size);
     cmd->type = type;
+    cmd->name = NULL;
     cmd->argc = argc;
-    cmd->argv = argv;
+    cmd->argv = (char **)(cmd + 1);
+    cmd->argl = (int *)(cmd->argv + argc);
+    cmd->line = NULL;
+    cmd->arena = a;
+    cmd->resp = 2;
     return cmd;
 }
 
+// commands parsed into an arena are released with it
 void command_free(Command *cmd) {
-    for (int i = 0; i < cmd->argc; i++) free(cmd->argv[i]);
-    free(cmd->argv);
+    if (cmd->arena != NULL) return;
+    free(cmd->line);
     free(cmd);
 }
 
-static void parser_advance(Parser *parser) {
-    if (parser->pos < strlen(parser->string)) {
-        parser->pos++;
-        parser->current_char = parser->string[parser->pos];
+// copy of cmd that owns its arguments, for commands that outlive their line
+Command *command_dup(Command *cmd) {
+    int size = strlen(cmd->name) + 1;
+    for (int i = 0; i < cmd->argc; i++) size += cmd->argl[i] + 1;
+
+    Command *dup = command_init(NULL, cmd->type, cmd->argc);
+    dup->resp = cmd->resp;
+    char *p = dup->line = dmalloc(size * sizeof(char));
+    dup->name = p;
+    p = stpcpy(p, cmd->name) + 1;
+    for (int i = 0; i < cmd->argc; i++) {
+        memcpy(p, cmd->argv[i], cmd->argl[i] + 1);
+        dup->argv[i] = p;
+        dup->argl[i] = cmd->argl[i];
+        p += cmd->argl[i] + 1;
     }
+    return dup;
 }
 
-static char *parse_id(Parser *parser) {
-    char *token = dmalloc(sizeof(char));
-    *token = '\0';
-    int n = 1;
-    while (!isspace(parser->current_char) &&
-            parser->pos < strlen(parser->string)) {
-        token = drealloc(token, ++n);
-        char *tmp = token;
-        sprintf(token, "%s%c", tmp, parser->current_char);
-        parser_advance(parser);
+static bool needs_quotes(const char *arg) {
+    if (*arg == '\0') return true;
+    for (; *arg != '\0'; arg++) {
+        if (isspace(*arg) || *arg == '"' || *arg == '\'') return true;
     }
-    token = realloc(token, ++n);
-    token[n-1] = '\0';
-    return token;
+    return false;
 }
 
+// writes arg to dst the way tokenize reads it back and returns the length
+// written, dst must have room for strlen(arg) + 2 bytes. tokenize only
+// reads quotes at the start of a token, so an argument holding both kinds
+// is written bare. One that also holds whitespace or starts with a quote
+// can't be written, tokenize never produces one
+int arg_quote(char *dst, const char *arg) {
+    bool both = strchr(arg, '"') != NULL && strchr(arg, '\'') != NULL;
+    if (!needs_quotes(arg) || both) return stpcpy(dst, arg) - dst;
+    char quote = strchr(arg, '"') != NULL ? '\'' : '"';
+    char *p = dst;
+    *p++ = quote;
+    p = stpcpy(p, arg);
+    *p++ = quote;
+    return p - dst;
+}
 
-static char *parse_string(Parser *parser) {
-    // first quote
-    char *token = dmalloc(sizeof(char));
-    *token = '\0';
-    int n = 1;
-    parser_advance(parser);
-    while ((parser->current_char != '"' && parser->current_char != '\'') &&
-           parser->pos < strlen(parser->string)) {
-        token = drealloc(token, ++n);
-        char *tmp = token;
-        sprintf(token, "%s%c", tmp, parser->current_char);
-        parser_advance(parser);
+// turns cmd back into a line that parses to the same command, the line is
+// allocated next to cmd and must only be freed if cmd isn't in an arena
+char *command_join(Command *cmd) {
+    int size = strlen(cmd->name) + 1;
+    for (int i = 0; i < cmd->argc; i++) size += cmd->argl[i] + 3;
+
+    char *line = cmd->arena != NULL ? arena_alloc(cmd->arena, size)
+                                    : dmalloc(size * sizeof(char));
+    char *p = stpcpy(line, cmd->name);
+    for (int i = 0; i < cmd->argc; i++) {
+        *p++ = ' ';
+        p += arg_quote(p, cmd->argv[i]);
     }
-    // last quote
-    parser_advance(parser);
-    token = realloc(token, ++n);
-    token[n-1] = '\0';
-    return token;
+    *p = '\0';
+    return line;
 }
 
-static char *get_next_token(Parser *parser) {
-    if (parser->pos < strlen(parser->string)) {
-        // skip whitespace
-        if (isspace(parser->current_char)) {
-            while (isspace(parser->current_char)) parser_advance(parser);
-        }
-
-        // handle if whitespace skips until terminating null byte
-        if (parser->current_char == '\0') return NULL;
-
-        // parse string literals
-        if (parser->current_char == '"' || parser->current_char == '\'') {
-            return parse_string(parser);
-        }
-
-        // parse identifiers
-        if (isspace(parser->current_char) == 0) return parse_id(parser);
-    } 
-
-    return NULL;
+// turns cmd into a command of type with argc arguments, no more than cmd
+// already has. Commands whose effect depends on more than their arguments,
+// like the clock, rewrite themselves into one that replays to the same
+// result before they get logged. argv may point into cmd, it is copied
+void command_rewrite(Command *cmd, int type, int argc, char **argv) {
+    int size = 0;
+    for (int i = 0; i < argc; i++) size += strlen(argv[i]) + 1;
+
+    char *line = cmd->arena != NULL ? arena_alloc(cmd->arena, size)
+                                    : dmalloc(size * sizeof(char));
+    char *p = line;
+    for (int i = 0; i < argc; i++) {
+        int len = strlen(argv[i]);
+        memcpy(p, argv[i], len + 1);
+        cmd->argv[i] = p;
+        cmd->argl[i] = len;
+        p += len + 1;
+    }
+    if (cmd->arena == NULL) {
+        free(cmd->line);
+        cmd->line = line;
+    }
+    cmd->type = type;
+    cmd->name = command_def(type)->name;
+    cmd->argc = argc;
 }
 
-static int get_argc(Parser *parser) {
-    Parser *dup = parser_init(parser->string); 
-    int argc = 0;
-    while (get_next_token(dup) != NULL) argc++;
-    free(dup);
-    return argc - 1; // -1 for command
-}
+// splits line into tokens in a single pass. Tokens are not copied: the byte
+// ending each of them (whitespace or a closing quote) is overwritten with a
+// null byte so every token is a null terminated slice of line itself
+static int tokenize(char *line, int len, Slice **slices, int max) {
+    char *p = line, *end = line + len;
+    int n = 0;
+    while (p < end) {
+        while (p < end && isspace(*p)) p++;
+        if (p == end || *p == '\0') break;
+
+        char *start = p;
+        if (*p == '"' || *p == '\'') {
+            char quote = *p++;
+            start = p;
+            while (p < end && *p != quote) p++;
+        } else {
+            while (p < end && !isspace(*p)) p++;
+        }
 
-Parser *parser_init(char *msg) {
-    Parser *parser = dmalloc(sizeof(Parser));
-    parser->string = strdup(msg);
-    parser->pos = 0;
-    parser->current_char = msg[0];
-    return parser;
+        if (n == max) {
+            Slice *tmp = dmalloc(max * 2 * sizeof(Slice));
+            memcpy(tmp, *slices, max * sizeof(Slice));
+            if (max > PARSER_SLICES) free(*slices);
+            *slices = tmp;
+            max *= 2;
+        }
+        (*slices)[n].ptr = start;
+        (*slices)[n++].len = p - start;
+        if (p < end) *p++ = '\0';
+    }
+    return n;
 }
 
-void parser_free(Parser *parser) {
-    free(parser->string);
-    free(parser);
-}
+// parses len bytes of line in place, line[len] is overwritten with a null
+// byte to end the last token. The command points into line and is only valid
+// as long as line is, it is allocated in a unless a is NULL
+Command *parse_line(Arena *a, char *line, int len) {
+    Slice buf[PARSER_SLICES], *slices = buf;
+    line[len] = '\0';
+    int n = tokenize(line, len, &slices, PARSER_SLICES);
 
-Command *parse(char *msg) {
-    Parser *parser = parser_init(msg);
-    char *token = get_next_token(parser);
-    int argc = get_argc(parser);
     Command *cmd;
-    if (argc >= 0) {
-        int type;
-        if (strcmp(token, "del") == 0) type = DEL;
-        else if (strcmp(token, "exists") == 0) type = EXISTS;
-        else if (strcmp(token, "type") == 0) type = TYPE;
-        else if (strcmp(token, "set") == 0) type = SET;
-        else if (strcmp(token, "get") == 0) type = GET;
-        else if (strcmp(token, "mset") == 0) type = MSET;
-        else if (strcmp(token, "mget") == 0) type = MGET;
-        else if (strcmp(token, "incr") == 0) type = INCR;
-        else if (strcmp(token, "decr") == 0) type = DECR;
-        else if (strcmp(token, "incrby") == 0) type = INCRBY;
-        else if (strcmp(token, "decrby") == 0) type = DECRBY;
-        else if (strcmp(token, "strlen") == 0) type = STRLEN;
-        else if (strcmp(token, "hset") == 0) type = HSET;
-        else if (strcmp(token, "hget") == 0) type = HGET;
-        else if (strcmp(token, "hdel") == 0) type = HDEL;
-        else if (strcmp(token, "hgetall") == 0) type = HGETALL;
-        else if (strcmp(token, "hexists") == 0) type = HEXISTS;
-        else if (strcmp(token, "hkeys") == 0) type = HKEYS;
-        else if (strcmp(token, "hvals") == 0) type = HVALS;
-        else if (strcmp(token, "hmget") == 0) type = HMGET;
-        else if (strcmp(token, "hlen") == 0) type = HLEN;
-        else if (strcmp(token, "lpush") == 0) type = LPUSH;
-        else if (strcmp(token, "lpop") == 0) type = LPOP;
-        else if (strcmp(token, "rpush") == 0) type = RPUSH;
-        else if (strcmp(token, "llen") == 0) type = LLEN;
-        else if (strcmp(token, "lindex") == 0) type = LINDEX;
-        else if (strcmp(token, "lrange") == 0) type = LRANGE;
-        else if (strcmp(token, "lset") == 0) type = LSET;
-        else if (strcmp(token, "lrem") == 0) type = LREM;
-        else if (strcmp(token, "lpos") == 0) type = LPOS;
-        else if (strcmp(token, "rpop") == 0) type = RPOP;
-        else if (strcmp(token, "sadd") == 0) type = SADD;
-        else if (strcmp(token, "srem") == 0) type = SREM;
-        else if (strcmp(token, "sismember") == 0) type = SISMEMBER;
-        else if (strcmp(token, "smembers") == 0) type = SMEMBERS;
-        else if (strcmp(token, "smismember") == 0) type = SMISMEMBER;
-        else if (strcmp(token, "quit") == 0) type = QUIT;
-        else if (strcmp(token, "shutdown") == 0) type = SHUTDOWN;
-        else type = UNKNOWN;
-        
-        // parse arguments
-        char **args = dmalloc(argc * sizeof(char *));
-        for (int i = 0; i < argc; i++) {
-            token = get_next_token(parser);
-            args[i] = dmalloc((strlen(token) + 1) * sizeof(char));
-            strcpy(args[i], token);
+    if (n > 0) {
+        int type = command_lookup(slices[0].ptr, slices[0].len);
+        cmd = command_init(a, type, n - 1);
+        cmd->name = slices[0].ptr;
+        for (int i = 1; i < n; i++) {
+            cmd->argv[i-1] = slices[i].ptr;
+            cmd->argl[i-1] = slices[i].len;
         }
-        cmd = command_init(type, argc, args);
     } else {
-        cmd = command_init(NOOP, 0, NULL);
+        cmd = command_init(a, NOOP, 0);
+        cmd->name = "";
     }
 
-    parser_free(parser);
-    free(token);
+    if (slices != buf) free(slices);
     return cmd;
 }
 
+Command *parse(char *msg) {
+    int len = strlen(msg);
+    char *line = dmalloc((len + 1) * sizeof(char));
+    memcpy(line, msg, len + 1);
+    Command *cmd = parse_line(NULL, line, len);
+    cmd->line = line;
+    return cmd;
+}
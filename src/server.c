@@ -2,189 +2,351 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <pthread.h>
 #include <time.h>
+#include <poll.h>
+#include <errno.h>
 
 #include "common.h"
 
-#define AOF_FILE "verokv.aof"
-#define BATCH_FILE "verokv.batch"
-#define BATCH_SIZE 100 // Set a batch size limit for flushing
-#define FLUSH_INTERVAL 10 // Time in seconds for flushing batch file
+// pipelined commands are parsed this many at a time so that the keys of the
+// whole window can be prefetched before the first of them runs
+#define PIPELINE_WINDOW 16
+
+// a client with this many bytes of replies it hasn't taken yet isn't read
+// from until it takes some, so its pipeline can't grow them without bound
+#define OUTPUT_PAUSE (1024 * 1024)
+
+// out of descriptors the listening socket stays readable, it is left alone
+// this long rather than spinning on accept
+#define ACCEPT_PAUSE_MS 100
 
 // Toggle variables for AOF and Batch processing
 int ENABLE_AOF = 1;  // 1 to enable AOF, 0 to disable
 int ENABLE_BATCH = 1; // 1 to enable Batch processing, 0 to disable
 
-typedef struct QueueNode {
-    char *cmd;
-    struct QueueNode *next;
-} QueueNode;
-
-typedef struct {
-    QueueNode *front, *rear;
-    pthread_mutex_t lock;
-    int size;
-} Queue;
-
-Queue *initQueue() {
-    Queue *q = malloc(sizeof(Queue));
-    q->front = q->rear = NULL;
-    q->size = 0;
-    pthread_mutex_init(&q->lock, NULL);
-    return q;
-}
-
-void enqueue(Queue *q, const char *cmd) {
-    QueueNode *newNode = malloc(sizeof(QueueNode));
-    newNode->cmd = strdup(cmd);
-    newNode->next = NULL;
-
-    pthread_mutex_lock(&q->lock);
-    if (q->rear) {
-        q->rear->next = newNode;
-    } else {
-        q->front = newNode;
+char *readline(int cfd) {
+    char *msg = dmalloc(1024 * sizeof(char));
+    read(cfd, msg, 1024);
+    msg[strlen(msg) - 1] = '\0';
+    return msg;
+}
+
+void writeline(int cfd, char *msg) {
+    char *tmp = dmalloc((strlen(msg) + 2) * sizeof(char));
+    sprintf(tmp, "%s\n", msg);
+    write(cfd, tmp, strlen(tmp) + 1);
+    free(tmp);
+}
+
+static Client *clients[MAX_CLIENTS];
+static bool shutdown_asked = false;
+
+// client sockets never block, so a client that doesn't read its replies
+// can't hold up the event loop for everyone else
+static Client *client_init(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Client *c = dmalloc(sizeof(Client));
+    c->fd = fd;
+    c->size = 1024;
+    c->len = 0;
+    c->buf = dmalloc(c->size * sizeof(char));
+    c->arena = arena_init(ARENA_SIZE);
+    c->resp = 2;
+    c->multi = NULL;
+    c->watched = NULL;
+    c->nwatched = 0;
+    c->blocked = NULL;
+    c->btype = NOOP;
+    c->deadline = 0;
+    c->out_size = 1024;
+    c->out_len = 0;
+    c->out = dmalloc(c->out_size);
+    return c;
+}
+
+// sends as much of the replies buffered for the client as its socket
+// takes, the rest waits until poll says there is room. False if the client
+// went away
+static bool send_replies(Client *c) {
+    int done = 0;
+    bool ok = true;
+    while (done < c->out_len) {
+        ssize_t n = send(c->fd, c->out + done, c->out_len - done,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+        done += n;
     }
-    q->rear = newNode;
-    q->size++;
-    pthread_mutex_unlock(&q->lock);
+    c->out_len -= done;
+    memmove(c->out, c->out + done, c->out_len);
+    return ok;
 }
 
-void flushQueueToFile(Queue *q, FILE *batchFile) {
-    pthread_mutex_lock(&q->lock);
-    if (q->size == 0) {
-        pthread_mutex_unlock(&q->lock);
-        return;
+static void client_free(Client *c) {
+    aof_flush();        // replies never go out ahead of their writes
+    send_replies(c);
+    unblock_client(c);
+    multi_free(c->multi);
+    unwatch_all(c);
+    clients[c->fd] = NULL;
+    close_client(c->fd);
+    free(c->buf);
+    free(c->out);
+    arena_free(c->arena);
+    free(c);
+}
+
+// queues a reply, framed like writeline so that replies may hold any byte.
+// Replies are sent once the commands of the event loop iteration are in the
+// AOF, see flush_output
+static void add_reply(Client *c, const char *resp, int len) {
+    if (c->out_len + len + 2 > c->out_size) {
+        while (c->out_len + len + 2 > c->out_size) c->out_size *= 2;
+        c->out = drealloc(c->out, c->out_size);
     }
+    memcpy(c->out + c->out_len, resp, len);
+    memcpy(c->out + c->out_len + len, "\n", 2); // newline and its null byte
+    c->out_len += len + 2;
+}
 
-    QueueNode *temp;
-    while (q->front) {
-        fputs(q->front->cmd, batchFile);
-        fputc('\n', batchFile);
-        temp = q->front;
-        q->front = q->front->next;
-        free(temp->cmd);
-        free(temp);
-        q->size--;
+static void log_command(Command *cmd) {
+    if (ENABLE_AOF) aof_append(cmd);
+    if (ENABLE_BATCH) batch_append(cmd);
+}
+
+// everything that follows a command which changed the data set: writes are
+// persisted, and so are the markers around those of a transaction
+static void command_done(HashTable *ht, Command *cmd, long long dirty) {
+    if (dirty < 0) {
+        log_command(cmd);
+        return;
     }
-    q->rear = NULL;
-    pthread_mutex_unlock(&q->lock);
-    fflush(batchFile);
+    if (ht->dirty == dirty) return;
+    watch_touch_command(cmd);
+    if (command_def(cmd->type)->flags & CMD_WRITE) log_command(cmd);
 }
 
-void *batch_flush_thread(void *arg) {
-    Queue *q = (Queue *)arg;
-    FILE *batchFile = fopen(BATCH_FILE, "a+");
-    if (!batchFile) {
-        perror("Failed to open batch file");
-        pthread_exit(NULL);
+// runs a single command parsed from the client's buffer. Returns 'q' to
+// close the client, 'b' if the client got blocked and 0 otherwise
+static int execute(Client *c, HashTable *ht, Command *cmd) {
+    cmd->resp = c->resp;    // an earlier HELLO of the window may switch it
+    long long dirty = ht->dirty;
+    char *resp = multi_process(c, ht, cmd, command_done);
+    if (resp == NULL) resp = interpret(ht, cmd);
+    c->resp = cmd->resp;    // HELLO switches the protocol
+    int code = 0;
+    if (*resp == 'q') {
+        code = 'q';
+    } else if (*resp == 'x') {
+        shutdown_asked = true;
+        code = 'q';
+    } else if (*resp == 'b') {
+        if (block_client(c, cmd)) code = 'b';
+    } else {
+        add_reply(c, resp, str_len(resp));
+        command_done(ht, cmd, dirty);
     }
+    str_free(resp);
+    command_free(cmd);
+    return code;
+}
 
-    struct timespec req;
-    req.tv_sec = FLUSH_INTERVAL;
-    req.tv_nsec = 0;
+// tokenizes up to PIPELINE_WINDOW complete lines starting at *pos into cmds
+// and collects the first key of each. Lines are tokenized in place and can't
+// be parsed again, so the window ends after a command that may block: the
+// lines behind it stay untouched until the client is woken up
+static int parse_window(Client *c, int *pos, Command **cmds,
+                        char **keys, int *nkeys) {
+    int n = 0;
+    *nkeys = 0;
+    while (n < PIPELINE_WINDOW) {
+        char *nl = memchr(c->buf + *pos, '\n', c->len - *pos);
+        if (nl == NULL) break;
+        *nl = '\0';
+        char *msg = c->buf + *pos;
+        *pos = nl - c->buf + 1;
+
+        while (*msg == '\0' && msg < nl) msg++; // writeline's trailing null
+        if (strspn(msg, " \t\r") == strlen(msg)) continue;
+        Command *cmd = cmds[n++] = parse_line(c->arena, msg, nl - msg);
+        int first, last, step;
+        if (command_keys(cmd, &first, &last, &step)) {
+            keys[(*nkeys)++] = cmd->argv[first];
+        }
+        if (command_def(cmd->type)->flags & CMD_BLOCKING) break;
+    }
+    return n;
+}
 
-    while (1) {
-        nanosleep(&req, NULL);
-        flushQueueToFile(q, batchFile);
+// consumes every complete line buffered for the client, stops early if the
+// client gets blocked so the rest of its pipeline waits behind the pop.
+// Commands run strictly in order, but a window of them is parsed first and
+// their keys prefetched so the lookups of a deep pipeline don't each stall
+// on their own cache misses
+static int process_input(Client *c, HashTable *ht) {
+    int code = 0, pos = 0;
+    while (c->blocked == NULL && code != 'q') {
+        Command *cmds[PIPELINE_WINDOW];
+        char *keys[PIPELINE_WINDOW];
+        int nkeys, n = parse_window(c, &pos, cmds, keys, &nkeys);
+        if (n == 0) break;
+        if (n > 1) htable_prefetch(ht, keys, nkeys, 1);
+        for (int i = 0; i < n && code != 'q'; i++) {
+            code = execute(c, ht, cmds[i]);
+        }
+        arena_reset(c->arena);
     }
+    c->len -= pos;
+    memmove(c->buf, c->buf + pos, c->len);
+    return code == 'b' ? 0 : code;
+}
 
-    fclose(batchFile);
-    pthread_exit(NULL);
+// retries the blocked command of the client, false if it is still blocked
+static bool serve_client(Client *c, HashTable *ht) {
+    long long dirty = ht->dirty;
+    char *resp = interpret(ht, c->blocked);
+    if (*resp == 'b') {
+        str_free(resp);
+        return false;
+    }
+    add_reply(c, resp, str_len(resp));
+    command_done(ht, c->blocked, dirty);
+    str_free(resp);
+    unblock_client(c);
+    if (process_input(c, ht) == 'q') client_free(c);
+    return true;
 }
 
-void log_to_aof(FILE *aof, const char *cmd) {
-    if (ENABLE_AOF) {
-        if (fputs(cmd, aof) == EOF || fputc('\n', aof) == EOF) {
-            perror("Error writing to AOF file");
+// wakes clients blocked on keys that were pushed to, oldest client first
+static void serve_blocked(HashTable *ht) {
+    char **keys;
+    while ((keys = block_ready()) != NULL) {
+        for (int i = 0; keys[i] != NULL; i++) {
+            int fd;
+            // a transaction may have pushed to the key and then replaced
+            // it, its waiters stay blocked unless it still holds a list
+            while (strcmp(htable_type(ht, keys[i]), "list") == 0 &&
+                   htable_llen(ht, keys[i]) > 0 &&
+                   (fd = block_first(keys[i])) >= 0) {
+                if (!serve_client(clients[fd], ht)) break;
+            }
+            free(keys[i]);
         }
-        fflush(aof);
+        free(keys);
     }
 }
 
-char *readline(int cfd) {
-    char *msg = dmalloc(1024 * sizeof(char));
-    read(cfd, msg, 1024);
-    msg[strlen(msg) - 1] = '\0';
-    return msg;
+// replies nil to blocked clients whose timeout has elapsed and returns the
+// poll timeout until the next deadline
+static int expire_blocked(HashTable *ht) {
+    long long now = mstime(), next = -1;
+    for (int fd = 0; fd < MAX_CLIENTS; fd++) {
+        Client *c = clients[fd];
+        if (c == NULL || c->blocked == NULL || c->deadline == 0) continue;
+        if (c->deadline <= now) {
+            const char *nil = block_nil(c->btype, c->resp);
+            add_reply(c, nil, strlen(nil));
+            unblock_client(c);
+            if (process_input(c, ht) == 'q') client_free(c);
+        } else if (next < 0 || c->deadline - now < next) {
+            next = c->deadline - now;
+        }
+    }
+    return (int)next;
 }
 
-void writeline(int cfd, char *msg) {
-    char *tmp = dmalloc((strlen(msg) + 2) * sizeof(char));
-    sprintf(tmp, "%s\n", msg);
-    write(cfd, tmp, strlen(tmp) + 1);
-    free(tmp);
+// reads whatever the client sent, returns 'q' if it went away
+static int read_client(Client *c, HashTable *ht) {
+    if (c->size - c->len < 512) {
+        c->size *= 2;
+        c->buf = drealloc(c->buf, c->size * sizeof(char));
+    }
+    int n = read(c->fd, c->buf + c->len, c->size - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) return 'q';
+    c->len += n;
+    return process_input(c, ht);
 }
 
-void replay_commands(FILE *file, HashTable *ht) {
-    char line[1024];
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = 0; // Remove the newline character
-        Command *cmd = parse(line);
-        char *resp = interpret(ht, cmd);
-        // You may want to handle the response here
+// group commit: the writes of the whole iteration go to the AOF in one
+// go, then the clients get their replies
+static void flush_output() {
+    aof_flush();
+    for (int fd = 0; fd < MAX_CLIENTS; fd++) {
+        Client *c = clients[fd];
+        if (c != NULL && c->out_len > 0 && !send_replies(c)) client_free(c);
     }
 }
 
-int verokv(int cfd, HashTable *ht) {
-    FILE *aof = NULL;
-    if (ENABLE_AOF) {
-        aof = fopen(AOF_FILE, "a+");
-        if (!aof) {
-            perror("Failed to open AOF file");
-            exit(EXIT_FAILURE);
+int verokv(int sfd, HashTable *ht) {
+    if (ENABLE_BATCH) batch_open(BATCH_FILE, BATCH_RING_SIZE);
+
+    struct pollfd fds[MAX_CLIENTS + 1];
+    long long accept_after = 0;
+    while (!shutdown_asked) {
+        snapshot_cron(ht);
+        aof_cron(ht);
+        int timeout = expire_blocked(ht);
+        // wake up at least once a second for the snapshot cron
+        if (timeout < 0 || timeout > 1000) timeout = 1000;
+        flush_output();
+        int n = 0;
+        fds[n].fd = sfd;
+        fds[n++].events = mstime() >= accept_after ? POLLIN : 0;
+        if (accept_after > 0 && timeout > ACCEPT_PAUSE_MS) {
+            timeout = ACCEPT_PAUSE_MS;
+        }
+        for (int fd = 0; fd < MAX_CLIENTS; fd++) {
+            Client *c = clients[fd];
+            if (c == NULL) continue;
+            fds[n].fd = fd;
+            fds[n].events = c->out_len < OUTPUT_PAUSE ? POLLIN : 0;
+            if (c->out_len > 0) fds[n].events |= POLLOUT;
+            n++;
+        }
+
+        if (poll(fds, n, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
         }
 
-        // Replay AOF commands at the start
-        rewind(aof);
-        replay_commands(aof, ht);
-    }
-
-    Queue *batchQueue = NULL;
-    pthread_t batchThread;
-    if (ENABLE_BATCH) {
-        batchQueue = initQueue();
-        pthread_create(&batchThread, NULL, batch_flush_thread, (void *)batchQueue);
-    }
-
-    while (1) {
-        char *msg = readline(cfd);
-        Command *cmd = parse(msg);
-        char *resp = interpret(ht, cmd);
-        
-        if (resp) {
-            writeline(cfd, resp);
-            if (strncmp(msg, "set", 3) == 0 || strncmp(msg, "del", 3) == 0) {
-                if (ENABLE_AOF) {
-                    log_to_aof(aof, msg);  // Log command to AOF if enabled
-                }
-                if (ENABLE_BATCH) {
-                    enqueue(batchQueue, msg); // Enqueue command for batch writing
-
-                    if (batchQueue->size >= BATCH_SIZE) {
-                        FILE *batchFile = fopen(BATCH_FILE, "a+");
-                        flushQueueToFile(batchQueue, batchFile);
-                        fclose(batchFile);
-                    }
-                }
+        if (fds[0].revents & POLLIN) {
+            int cfd = accept_connection(sfd);
+            accept_after = 0;
+            if (cfd >= 0 && cfd < MAX_CLIENTS) {
+                clients[cfd] = client_init(cfd);
+            } else if (cfd >= 0) {
+                close_client(cfd);
+            } else if (errno == EMFILE || errno == ENFILE) {
+                accept_after = mstime() + ACCEPT_PAUSE_MS;
             }
         }
-        
-        free(msg);
-        if (*resp == 'q') break; // Exit command
+
+        for (int i = 1; i < n && !shutdown_asked; i++) {
+            Client *c = clients[fds[i].fd];
+            // room for replies is used by flush_output on the next round
+            if (c == NULL || (fds[i].revents & ~POLLOUT) == 0) continue;
+            if (read_client(c, ht) == 'q') client_free(c);
+            serve_blocked(ht);
+        }
     }
 
-    if (ENABLE_AOF) fclose(aof);
-    if (ENABLE_BATCH) {
-        pthread_cancel(batchThread);
-        flushQueueToFile(batchQueue, fopen(BATCH_FILE, "a+")); // Flush remaining commands
-        free(batchQueue);
+    for (int fd = 0; fd < MAX_CLIENTS; fd++) {
+        if (clients[fd] != NULL) client_free(clients[fd]);
     }
-    return 0;
+    batch_close();
+    return shutdown_asked ? 1 : 0;
 }
 
 int init_server() {
@@ -213,13 +375,16 @@ int init_server() {
     return sfd;
 }
 
+// -1 if the connection couldn't be taken, out of descriptors or a client
+// that hung up first. The server and everyone connected carry on
 int accept_connection(int sfd) {
     struct sockaddr_in client_addr;
     unsigned int len = sizeof(struct sockaddr_in);
     int cfd = accept(sfd, (SA *)&client_addr, &len);
     if (cfd < 0) {
-        fputs("failed to accept connection", stderr);
-        exit(1);
+        int err = errno;    // for the caller, perror may change it
+        perror("failed to accept connection");
+        errno = err;
     }
     return cfd;
 }
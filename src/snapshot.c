@@ -0,0 +1,867 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include "common.h"
+
+// snapshots are written by a forked child. The child sees the data set as
+// it was at the fork, the kernel copies the pages the parent changes
+// afterwards, so the parent keeps serving while the child walks the table.
+// The child reports how far it got through a shared mapping
+//
+// File format, integers are unsigned LEB128 varints:
+//   "VEROKV" version(1 byte) nkeys nsections
+//   sections: records, then the crc32c of the section's records
+//   records: type(1 byte) keylen key value
+//     string: len bytes
+//     hash:   nfields, then fieldlen field valuelen value for each
+//     list:   nelems, then len elem for each, head to tail
+//     set:    nmembers, then len member for each
+//   SNAP_EOF(1 byte), then offset, length and key count of each section
+//   (8 bytes each), then the crc32c of the header and this footer
+// Fixed width integers and checksums are little endian. Sections hold the
+// keys of disjoint ranges of buckets and decode independently, so they are
+// written and read by several threads at once. Files without the magic are
+// read as the old headerless format, which only held strings
+
+typedef struct Progress {
+    long long keys_done;
+    long long keys_total;
+    long long cow_bytes;
+    long long end;          // mstime the child finished at
+} Progress;
+
+// the copy on write size is sampled every this many keys
+#define COW_SAMPLE_KEYS 65536
+
+#define SNAP_MAGIC "VEROKV"
+#define SNAP_VERSION 2
+#define SNAP_BUF (64 * 1024)
+#define SNAP_INDEX_ENTRY 24         // offset, length and keys of a section
+#define SNAP_MAX_SECTIONS 64
+#define SECTION_MIN_KEYS 16384      // smaller tables aren't worth splitting
+#define PROGRESS_BATCH 1024         // keys a thread saves between reports
+
+enum SnapType {SNAP_STR, SNAP_HASH, SNAP_LIST, SNAP_SET, SNAP_EOF = 0xff};
+
+// buffered output at a given offset of the file that checksums whatever
+// goes through it
+typedef struct Writer {
+    int fd;                 // -1 only counts the bytes that would be written
+    off_t off;              // where buf goes in the file
+    uint32_t crc;
+    bool failed;
+    size_t len;
+    unsigned char buf[SNAP_BUF];
+} Writer;
+
+// one save shared by the threads writing its sections
+typedef struct SaveJob {
+    HashTable *ht;
+    Writer **writers;       // one per thread
+    Progress *progress;
+    int nsections;
+    int next;               // next section a thread takes
+    int nthreads;
+    int started;            // threads that picked their writer
+    off_t *off;             // of each section, filled after measuring
+    uint64_t *len;
+    uint64_t *nkeys;
+    off_t base;             // where the snapshot starts in the file
+} SaveJob;
+
+typedef struct LoadJob {
+    HashTable *ht;
+    const unsigned char *base;
+    int nsections;
+    int next;
+    bool shared;            // several threads insert into ht
+    bool failed;
+    uint64_t *off;
+    uint64_t *len;
+    uint64_t *nkeys;
+} LoadJob;
+
+// cursor over a mapped snapshot, whose checksum was verified up front
+typedef struct Reader {
+    const unsigned char *pos;
+    const unsigned char *end;
+    char *str;              // scratch for strings that get copied anyway
+    size_t str_cap;
+} Reader;
+
+static Progress *progress = NULL;
+static pid_t child = -1;
+static long long child_start = 0;   // mstime of the fork
+static long long child_dirty = 0;   // dirty counter the child saves
+static char child_file[256];        // where the save ends up
+static char child_tmp[256];         // where the child writes it
+static long long last_try = 0;      // mstime of the last periodic save
+static SnapshotStats stats = {.last_ok = true};
+
+// Function to calculate elapsed time in microseconds
+static long calculate_elapsed_time(struct timeval start, struct timeval end) {
+    long seconds = end.tv_sec - start.tv_sec;
+    long microseconds = end.tv_usec - start.tv_usec;
+    return (seconds * 1000000) + microseconds; // Return in microseconds
+}
+
+// bytes of memory this process no longer shares with its parent
+static long long private_dirty() {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) return 0;
+    char line[256];
+    long long kb = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "Private_Dirty: %lld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+static void put_le(unsigned char *p, uint64_t x, int n) {
+    for (int i = 0; i < n; i++) p[i] = x >> (8 * i);
+}
+
+static uint64_t get_le(const unsigned char *p, int n) {
+    uint64_t x = 0;
+    for (int i = 0; i < n; i++) x |= (uint64_t)p[i] << (8 * i);
+    return x;
+}
+
+static int put_varint(unsigned char *p, uint64_t x) {
+    int n = 0;
+    while (x >= 0x80) {
+        p[n++] = (x & 0x7f) | 0x80;
+        x >>= 7;
+    }
+    p[n++] = x;
+    return n;
+}
+
+static bool pwrite_all(int fd, const void *p, size_t n, off_t off) {
+    while (n > 0) {
+        ssize_t k = pwrite(fd, p, n, off);
+        if (k < 0) return false;
+        p = (const char *)p + k;
+        n -= k;
+        off += k;
+    }
+    return true;
+}
+
+static void w_flush(Writer *w) {
+    if (w->len == 0) return;
+    w->crc = crc32c(w->crc, w->buf, w->len);
+    if (!pwrite_all(w->fd, w->buf, w->len, w->off)) w->failed = true;
+    w->off += w->len;
+    w->len = 0;
+}
+
+static void w_bytes(Writer *w, const void *p, size_t n) {
+    if (w->fd < 0) {
+        w->off += n;
+        return;
+    }
+    if (n > SNAP_BUF - w->len) w_flush(w);
+    if (n >= SNAP_BUF) {
+        w->crc = crc32c(w->crc, p, n);
+        if (!pwrite_all(w->fd, p, n, w->off)) w->failed = true;
+        w->off += n;
+        return;
+    }
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+}
+
+static void w_varint(Writer *w, uint64_t x) {
+    unsigned char tmp[10];
+    w_bytes(w, tmp, put_varint(tmp, x));
+}
+
+static void w_string(Writer *w, const char *s, size_t len) {
+    w_varint(w, len);
+    w_bytes(w, s, len);
+}
+
+static void write_hash(Writer *w, HashTable *hash) {
+    w_varint(w, hash->used);
+    for (int i = 0; i < hash->size; i++) {
+        HashTableItem *item = hash->items[i];
+        if (item == NULL || item == &HT_DELETED) continue;
+        w_string(w, item->key, strlen(item->key));
+        w_string(w, item->value, str_len(item->value));
+    }
+}
+
+static void write_list(Writer *w, List *ls) {
+    w_varint(w, ls->len);
+    ListNode *node = ls->head;
+    for (int i = 0; i < ls->len; i++, node = node->next) {
+        w_string(w, node->value, strlen(node->value));
+    }
+}
+
+static void write_set(Writer *w, Set *set) {
+    w_varint(w, set->used);
+    for (int i = 0; i < set->size; i++) {
+        char *member = set->members[i];
+        if (member == NULL || member == &SET_DELETED) continue;
+        w_string(w, member, strlen(member));
+    }
+}
+
+static void write_item(Writer *w, HashTableItem *item) {
+    static const unsigned char tags[] = {
+        [STR_T] = SNAP_STR, [HASH_T] = SNAP_HASH,
+        [LIST_T] = SNAP_LIST, [SET_T] = SNAP_SET,
+    };
+    w_bytes(w, &tags[item->type], 1);
+    w_string(w, item->key, strlen(item->key));
+    switch (item->type) {
+        case STR_T: w_string(w, item->value, str_len(item->value)); break;
+        case HASH_T: write_hash(w, item->value); break;
+        case LIST_T: write_list(w, item->value); break;
+        case SET_T: write_set(w, item->value); break;
+    }
+}
+
+// adds n saved keys to the progress, sampling the copy on write size each
+// time the total crosses a multiple of COW_SAMPLE_KEYS
+static void report(Progress *p, long long n) {
+    if (p == NULL || n == 0) return;
+    long long done = __atomic_add_fetch(&p->keys_done, n, __ATOMIC_RELAXED);
+    if (done / COW_SAMPLE_KEYS != (done - n) / COW_SAMPLE_KEYS) {
+        p->cow_bytes = private_dirty();
+    }
+}
+
+// the items of section i, then its checksum, at the section's offset. With
+// a measuring writer this only finds the section's length and key count
+static void save_section(SaveJob *job, Writer *w, int i) {
+    HashTable *ht = job->ht;
+    int first = (long long)ht->size * i / job->nsections;
+    int last = (long long)ht->size * (i + 1) / job->nsections;
+    bool measure = w->fd < 0;
+    w->off = measure ? 0 : job->base + job->off[i];
+    w->crc = 0;
+    uint64_t nkeys = 0;
+    long long batch = 0;
+    for (int j = first; j < last; j++) {
+        HashTableItem *item = ht->items[j];
+        if (item == NULL || item == &HT_DELETED) continue;
+        write_item(w, item);
+        nkeys++;
+        if (!measure && ++batch == PROGRESS_BATCH) {
+            report(job->progress, batch);
+            batch = 0;
+        }
+    }
+    job->nkeys[i] = nkeys;
+    if (measure) {
+        job->len[i] = w->off + 4;
+        return;
+    }
+    report(job->progress, batch);
+    w_flush(w);
+    unsigned char crc[4];
+    put_le(crc, w->crc, 4);
+    if (!pwrite_all(w->fd, crc, sizeof(crc), w->off)) w->failed = true;
+    job->len[i] = w->off + 4 - job->base - job->off[i];
+}
+
+static void *save_worker(void *arg) {
+    SaveJob *job = arg;
+    int t = __atomic_fetch_add(&job->started, 1, __ATOMIC_RELAXED);
+    Writer *w = job->writers[t];
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+           job->nsections) {
+        save_section(job, w, i);
+    }
+    return NULL;
+}
+
+// runs fn on arg in n threads, the calling one included
+static void run_threads(int n, void *(*fn)(void *), void *arg) {
+    pthread_t threads[SNAPSHOT_THREADS];
+    int spawned = 0;
+    for (; spawned < n - 1; spawned++) {
+        if (pthread_create(&threads[spawned], NULL, fn, arg) != 0) break;
+    }
+    fn(arg);
+    for (int i = 0; i < spawned; i++) pthread_join(threads[i], NULL);
+}
+
+// threads worth using for nsections sections
+static int thread_count(int nsections) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus < 1 ? 1 : cpus > SNAPSHOT_THREADS ? SNAPSHOT_THREADS : cpus;
+    return n < nsections ? n : nsections;
+}
+
+// writes ht to fd from base on and returns the length of the snapshot, -1
+// if a write failed. With several threads the sections are measured in
+// parallel, which places each of them in the file, then written in
+// parallel. A single thread writes them one after the other
+static long long write_sections(HashTable *ht, int fd, off_t base,
+                                Progress *p) {
+    int nsections = 1 + ht->used / SECTION_MIN_KEYS;
+    if (nsections > SNAP_MAX_SECTIONS) nsections = SNAP_MAX_SECTIONS;
+    if (nsections > ht->size) nsections = ht->size;
+    off_t off[SNAP_MAX_SECTIONS];
+    uint64_t len[SNAP_MAX_SECTIONS], nkeys[SNAP_MAX_SECTIONS];
+    Writer *writers[SNAPSHOT_THREADS];
+    SaveJob job = {ht, writers, p, nsections, 0, thread_count(nsections), 0,
+                   off, len, nkeys, base};
+    bool parallel = job.nthreads > 1;
+    for (int t = 0; t < job.nthreads; t++) {
+        writers[t] = dmalloc(sizeof(Writer));
+        writers[t]->fd = parallel ? -1 : fd;
+        writers[t]->len = 0;
+        writers[t]->failed = false;
+    }
+
+    unsigned char header[32];
+    size_t header_len = strlen(SNAP_MAGIC);
+    memcpy(header, SNAP_MAGIC, header_len);
+    header[header_len++] = SNAP_VERSION;
+    header_len += put_varint(header + header_len, ht->used);
+    header_len += put_varint(header + header_len, nsections);
+    off_t end = header_len;
+    if (parallel) {
+        run_threads(job.nthreads, save_worker, &job);
+        for (int i = 0; i < nsections; i++) {
+            off[i] = end;
+            end += len[i];
+        }
+    } else {
+        for (int i = 0; i < nsections; i++) {
+            off[i] = end;
+            save_section(&job, writers[0], i);
+            end += len[i];
+        }
+    }
+
+    size_t footer_len = 1 + nsections * SNAP_INDEX_ENTRY;
+    unsigned char *footer = dmalloc(footer_len + 4);
+    footer[0] = SNAP_EOF;
+    for (int i = 0; i < nsections; i++) {
+        unsigned char *entry = footer + 1 + i * SNAP_INDEX_ENTRY;
+        put_le(entry, off[i], 8);
+        put_le(entry + 8, len[i], 8);
+        put_le(entry + 16, nkeys[i], 8);
+    }
+    uint32_t crc = crc32c(crc32c(0, header, header_len), footer, footer_len);
+    put_le(footer + footer_len, crc, 4);
+
+    if (parallel) {
+        job.next = job.started = 0;
+        for (int t = 0; t < job.nthreads; t++) writers[t]->fd = fd;
+        run_threads(job.nthreads, save_worker, &job);
+    }
+    bool ok = pwrite_all(fd, header, header_len, base) &&
+              pwrite_all(fd, footer, footer_len + 4, base + end);
+    for (int t = 0; t < job.nthreads; t++) {
+        ok = ok && !writers[t]->failed;
+        free(writers[t]);
+    }
+    free(footer);
+    return ok ? end + footer_len + 4 : -1;
+}
+
+// writes the snapshot to tmp, which install_snapshot puts in place once
+// it is complete, so a crash never leaves a truncated snapshot behind
+static int write_snapshot(HashTable *ht, const char *tmp, Progress *p) {
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open file for snapshot");
+        return -1;
+    }
+
+    bool ok = write_sections(ht, fd, 0, p) >= 0 && fsync(fd) == 0;
+    if (p != NULL) {
+        p->cow_bytes = private_dirty();
+        p->end = mstime();
+    }
+
+    if (!ok || close(fd) != 0) {
+        perror("Failed to write snapshot");
+        if (!ok) close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void tmp_name(char *buf, size_t size, const char *filename) {
+    snprintf(buf, size, "%s.%d.tmp", filename, (int)getpid());
+}
+
+// renames the snapshot saved in tmp over filename. The AOF first switches
+// to a link of its own to tmp and drops the segments it holds, so a crash
+// at any point never pairs a snapshot with commands it already has
+static int install_snapshot(const char *tmp, const char *filename, bool ok) {
+    aof_snapshot_done(tmp, ok);
+    if (!ok) {
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, filename) != 0) {
+        perror("Failed to write snapshot");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// saves ht in the foreground, the server is stopped while it runs
+int save_snapshot(HashTable *ht, const char *filename) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    char tmp[256];
+    tmp_name(tmp, sizeof(tmp), filename);
+    aof_snapshot_start();
+    int res = write_snapshot(ht, tmp, NULL);
+    res = install_snapshot(tmp, filename, res == 0);
+    gettimeofday(&end, NULL);
+    if (res == 0) {
+        long microseconds = calculate_elapsed_time(start, end);
+        printf("Snapshot saved in %ld microseconds.\n", microseconds);
+        stats.last_save = time(NULL);
+        stats.saved_dirty = ht->dirty;
+    }
+    stats.last_ok = res == 0;
+    return res;
+}
+
+// writes ht as a snapshot into fd at off, for files that start with one.
+// Returns its length, -1 if a write failed
+long long save_snapshot_at(HashTable *ht, int fd, long long off) {
+    return write_sections(ht, fd, off, NULL);
+}
+
+// a table sized for n entries, so filling it never rehashes
+#define PRESIZE(n) ((n) * 10 / 7 + 1)
+
+// the next n bytes, NULL if the snapshot ends first
+static const unsigned char *r_bytes(Reader *r, size_t n) {
+    if ((size_t)(r->end - r->pos) < n) return NULL;
+    const unsigned char *p = r->pos;
+    r->pos += n;
+    return p;
+}
+
+static bool r_varint(Reader *r, uint64_t *x) {
+    *x = 0;
+    for (int shift = 0; shift < 64 && r->pos < r->end; shift += 7) {
+        unsigned char b = *r->pos++;
+        *x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// reads the count of a collection. Every element takes at least a byte, so
+// a count larger than what is left can't be right
+static bool r_count(Reader *r, uint64_t *n) {
+    return r_varint(r, n) && *n <= (uint64_t)(r->end - r->pos) &&
+           *n < INT_MAX / 10;
+}
+
+// a length prefixed string in the mapping, not null terminated
+static const char *r_string(Reader *r, size_t *len) {
+    uint64_t n;
+    if (!r_varint(r, &n) || n >= INT_MAX) return NULL;
+    *len = n;
+    return (const char *)r_bytes(r, n);
+}
+
+// a length prefixed string copied to its own null terminated allocation
+static char *r_key(Reader *r) {
+    size_t len;
+    const char *p = r_string(r, &len);
+    if (p == NULL) return NULL;
+    char *key = dmalloc(len + 1);
+    memcpy(key, p, len);
+    key[len] = '\0';
+    return key;
+}
+
+// a length prefixed string copied to the reader's scratch buffer, for the
+// list and set calls that duplicate what they are given
+static char *r_scratch(Reader *r) {
+    size_t len;
+    const char *p = r_string(r, &len);
+    if (p == NULL) return NULL;
+    if (len + 1 > r->str_cap) {
+        r->str_cap = len + 1 > 2 * r->str_cap ? len + 1 : 2 * r->str_cap;
+        r->str = drealloc(r->str, r->str_cap);
+    }
+    memcpy(r->str, p, len);
+    r->str[len] = '\0';
+    return r->str;
+}
+
+static HashTable *read_hash(Reader *r) {
+    uint64_t n;
+    if (!r_count(r, &n)) return NULL;
+    HashTable *hash = htable_init(PRESIZE(n));
+    for (uint64_t i = 0; i < n; i++) {
+        char *field = r_key(r);
+        size_t len;
+        const char *value = field != NULL ? r_string(r, &len) : NULL;
+        if (value == NULL) {
+            free(field);
+            htable_free(hash);
+            return NULL;
+        }
+        htable_add(hash, STR_T, field, str_new(value, len));
+    }
+    return hash;
+}
+
+static List *read_list(Reader *r) {
+    uint64_t n;
+    if (!r_count(r, &n)) return NULL;
+    List *ls = list_init();
+    for (uint64_t i = 0; i < n; i++) {
+        char *elem = r_scratch(r);
+        if (elem == NULL) {
+            list_free(ls);
+            return NULL;
+        }
+        list_rpush(ls, elem);
+    }
+    return ls;
+}
+
+static Set *read_set(Reader *r) {
+    uint64_t n;
+    if (!r_count(r, &n)) return NULL;
+    Set *set = set_init(PRESIZE(n));
+    for (uint64_t i = 0; i < n; i++) {
+        char *member = r_scratch(r);
+        if (member == NULL) {
+            set_free(set);
+            return NULL;
+        }
+        set_add(set, member);
+    }
+    return set;
+}
+
+// decodes the record that follows tag, false if it doesn't parse
+static bool read_record(Reader *r, unsigned char tag, char **key, int *type,
+                        void **value) {
+    *key = r_key(r);
+    if (*key == NULL) return false;
+    *value = NULL;
+    switch (tag) {
+        case SNAP_STR: {
+            size_t len;
+            const char *str = r_string(r, &len);
+            if (str != NULL) *value = str_new(str, len);
+            *type = STR_T;
+            break;
+        }
+        case SNAP_HASH: *value = read_hash(r); *type = HASH_T; break;
+        case SNAP_LIST: *value = read_list(r); *type = LIST_T; break;
+        case SNAP_SET: *value = read_set(r); *type = SET_T; break;
+    }
+    if (*value == NULL) free(*key);
+    return *value != NULL;
+}
+
+// checks and decodes section i straight into the shared table
+static bool load_section(LoadJob *job, Reader *r, int i) {
+    const unsigned char *start = job->base + job->off[i];
+    const unsigned char *sum = start + job->len[i] - 4;
+    if (crc32c(0, start, sum - start) != get_le(sum, 4)) return false;
+    r->pos = start;
+    r->end = sum;
+    for (uint64_t k = 0; k < job->nkeys[i]; k++) {
+        const unsigned char *tag = r_bytes(r, 1);
+        char *key;
+        int type;
+        void *value;
+        if (tag == NULL || !read_record(r, *tag, &key, &type, &value)) {
+            return false;
+        }
+        if (job->shared) {
+            htable_add_atomic(job->ht, type, key, value);
+        } else {
+            htable_add(job->ht, type, key, value);
+        }
+    }
+    return r->pos == r->end;
+}
+
+static void *load_worker(void *arg) {
+    LoadJob *job = arg;
+    Reader r = {NULL, NULL, NULL, 0};
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+           job->nsections) {
+        if (__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) break;
+        if (!load_section(job, &r, i)) {
+            __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    free(r.str);
+    return NULL;
+}
+
+// reads a version 2 snapshot: the header and the footer are checked
+// together, then the sections are decoded in parallel into a table
+// presized from the key count
+static int read_sections(Reader *r, HashTable **res) {
+    const unsigned char *base = r->pos - strlen(SNAP_MAGIC) - 1;
+    uint64_t nkeys, nsections;
+    if (!r_varint(r, &nkeys) || nkeys >= INT_MAX / 10 ||
+        !r_varint(r, &nsections) || nsections == 0 ||
+        nsections > SNAP_MAX_SECTIONS) {
+        return -1;
+    }
+    size_t header_len = r->pos - base;
+    size_t footer_len = 1 + nsections * SNAP_INDEX_ENTRY;
+    if ((size_t)(r->end - r->pos) < footer_len + 4) return -1;
+    const unsigned char *footer = r->end - 4 - footer_len;
+    uint32_t crc = crc32c(crc32c(0, base, header_len), footer, footer_len);
+    if (crc != get_le(r->end - 4, 4) || footer[0] != SNAP_EOF) return -1;
+
+    // sections must tile the space between header and footer exactly,
+    // so that no key can be decoded twice
+    uint64_t off[SNAP_MAX_SECTIONS], len[SNAP_MAX_SECTIONS];
+    uint64_t keys[SNAP_MAX_SECTIONS], pos = header_len, total = 0;
+    for (int i = 0; i < nsections; i++) {
+        const unsigned char *entry = footer + 1 + i * SNAP_INDEX_ENTRY;
+        off[i] = get_le(entry, 8);
+        len[i] = get_le(entry + 8, 8);
+        keys[i] = get_le(entry + 16, 8);
+        if (off[i] != pos || len[i] < 4) return -1;
+        pos += len[i];
+        total += keys[i];
+    }
+    if (pos != (uint64_t)(footer - base) || total != nkeys) return -1;
+
+    *res = htable_init(PRESIZE(nkeys));
+    int nthreads = thread_count(nsections);
+    LoadJob job = {*res, base, nsections, 0, nthreads > 1, false, off, len,
+                   keys};
+    run_threads(nthreads, load_worker, &job);
+    (*res)->used = nkeys;
+    return job.failed ? -1 : 0;
+}
+
+// the format before versioned snapshots: raw size_t lengths, strings only
+static int read_legacy(Reader *r, HashTable *ht) {
+    while (r->pos < r->end) {
+        size_t lens[2];
+        const char *parts[2];
+        for (int i = 0; i < 2; i++) {
+            const unsigned char *p = r_bytes(r, sizeof(size_t));
+            if (p == NULL) return -1;
+            memcpy(&lens[i], p, sizeof(size_t));
+            if (lens[i] >= INT_MAX) return -1;
+            parts[i] = (const char *)r_bytes(r, lens[i]);
+            if (parts[i] == NULL) return -1;
+        }
+        char *key = dmalloc(lens[0] + 1);
+        memcpy(key, parts[0], lens[0]);
+        key[lens[0]] = '\0';
+        htable_set_str(ht, key, str_new(parts[1], lens[1]));
+        free(key);
+    }
+    return 0;
+}
+
+// checks the magic and the version, then decodes the rest
+static int read_snapshot(Reader *r, HashTable **res) {
+    size_t size = r->end - r->pos;
+    size_t magic_len = strlen(SNAP_MAGIC);
+    if (size < magic_len || memcmp(r->pos, SNAP_MAGIC, magic_len) != 0) {
+        *res = htable_init(HT_BASE_SIZE);
+        return read_legacy(r, *res);
+    }
+    if (size < magic_len + 1 + 4) return -1;
+    r->pos += magic_len;
+    unsigned char version = *r->pos++;
+    if (version != SNAP_VERSION) {
+        fprintf(stderr, "Unsupported snapshot version %d\n", version);
+        return -1;
+    }
+    return read_sections(r, res);
+}
+
+// replaces the content of ht with the snapshot in the size bytes at map,
+// -1 if it is corrupt
+static int load_mapped(HashTable *ht, const unsigned char *map, size_t size) {
+    Reader r = {map, map + size, NULL, 0};
+    HashTable *tmp = NULL;
+    int res = read_snapshot(&r, &tmp);
+    free(r.str);
+    if (res != 0) {
+        htable_free(tmp);
+        return -1;
+    }
+
+    // ht keeps its identity and dirty counter, only the items are swapped
+    HashTable old = *ht;
+    ht->size = tmp->size;
+    ht->used = tmp->used;
+    ht->items = tmp->items;
+    tmp->size = old.size;
+    tmp->used = old.used;
+    tmp->items = old.items;
+    htable_free(tmp);
+    stats.saved_dirty = ht->dirty;
+    return 0;
+}
+
+// replaces the content of ht with the snapshot in filename. Returns -1 if
+// there is no snapshot and -2 if it is corrupt, ht is left alone then.
+// The file is mapped rather than read, entries are built straight from the
+// mapped bytes
+int load_snapshot(HashTable *ht, const char *filename) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Snapshot file not found or cannot be opened");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -2;
+    }
+    void *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Failed to map snapshot");
+            close(fd);
+            return -2;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    int res = load_mapped(ht, map, st.st_size);
+    if (map != NULL) munmap(map, st.st_size);
+    if (res != 0) {
+        fprintf(stderr, "Snapshot %s is corrupt\n", filename);
+        return -2;
+    }
+
+    gettimeofday(&end, NULL);
+    long microseconds = calculate_elapsed_time(start, end);
+    printf("Snapshot loaded in %ld microseconds.\n", microseconds);
+    return 0;
+}
+
+// replaces the content of ht with the snapshot in the size bytes at p,
+// which is part of a larger file. -2 if it is corrupt, ht is left alone
+// then. An embedded snapshot always has the magic
+int load_snapshot_at(HashTable *ht, const unsigned char *p, size_t size) {
+    size_t magic_len = strlen(SNAP_MAGIC);
+    if (size < magic_len || memcmp(p, SNAP_MAGIC, magic_len) != 0) return -2;
+    return load_mapped(ht, p, size) == 0 ? 0 : -2;
+}
+
+// starts saving ht to filename in a child process, false if a save or an
+// AOF rewrite is already running or the fork failed
+bool snapshot_bgsave(HashTable *ht, const char *filename) {
+    if (child > 0 || aof_stats().rewrite_in_progress) return false;
+    if (progress == NULL) {
+        progress = mmap(NULL, sizeof(Progress), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (progress == MAP_FAILED) {
+            progress = NULL;
+            return false;
+        }
+    }
+    memset(progress, 0, sizeof(Progress));
+    progress->keys_total = ht->used;
+
+    // the child only writes the file, the parent puts it in place when it
+    // reaps the child, together with the AOF manifest
+    tmp_name(child_tmp, sizeof(child_tmp), filename);
+    aof_snapshot_start();
+    long long start = ustime();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        aof_snapshot_done(child_tmp, false);
+        stats.last_ok = false;
+        return false;
+    }
+    if (pid == 0) {
+        // _exit: the parent's unflushed stdio buffers are not ours to write
+        _exit(write_snapshot(ht, child_tmp, progress) == 0 ? 0 : 1);
+    }
+    stats.fork_usec = ustime() - start;
+    child = pid;
+    child_start = mstime();
+    child_dirty = ht->dirty;
+    snprintf(child_file, sizeof(child_file), "%s", filename);
+    return true;
+}
+
+static void child_done(int status) {
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    ok = install_snapshot(child_tmp, child_file, ok) == 0;
+    if (ok) {
+        stats.last_save = time(NULL);
+        stats.saved_dirty = child_dirty;
+        printf("Background snapshot saved in %lld ms, "
+               "%lld kB copy on write.\n",
+               progress->end - child_start, progress->cow_bytes / 1024);
+    } else {
+        fputs("Background snapshot failed\n", stderr);
+    }
+    stats.last_ok = ok;
+    stats.last_cow_bytes = progress->cow_bytes;
+    child = -1;
+}
+
+// waits for a running background save to finish
+void snapshot_wait() {
+    int status;
+    if (child > 0 && waitpid(child, &status, 0) == child) child_done(status);
+}
+
+// called from the event loop: reaps a finished child and starts a new save
+// every SNAPSHOT_INTERVAL seconds if the data set changed since the last one
+void snapshot_cron(HashTable *ht) {
+    int status;
+    if (child > 0) {
+        if (waitpid(child, &status, WNOHANG) == child) child_done(status);
+        return;
+    }
+    if (!ENABLE_SNAPSHOTS || ht->dirty == stats.saved_dirty) return;
+    if (mstime() - last_try < SNAPSHOT_INTERVAL * 1000) return;
+    last_try = mstime();
+    snapshot_bgsave(ht, SNAPSHOT_FILE);
+}
+
+SnapshotStats snapshot_stats() {
+    SnapshotStats res = stats;
+    res.in_progress = child > 0;
+    if (res.in_progress) {
+        res.keys_done = progress->keys_done;
+        res.keys_total = progress->keys_total;
+        res.cow_bytes = progress->cow_bytes;
+    }
+    return res;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "common.h"
+
+// binary safe strings: the length lives in a header right before the bytes,
+// so a str can still be passed around as a null terminated char *. Growth
+// leaves spare capacity behind so repeated appends are amortized O(1)
+
+// strs can also be carved out of an arena for request scoped data such as
+// replies. Those are marked with a negative cap and keep their arena right
+// before the header, str_free leaves them alone and they go away with the
+// next arena_reset
+
+// past this size capacity grows linearly instead of doubling
+#define STR_MAX_PREALLOC (1024 * 1024)
+
+static StrHeader *str_header(const char *s) {
+    return (StrHeader *)(s - sizeof(StrHeader));
+}
+
+static bool in_arena(StrHeader *hdr) {
+    return hdr->cap < 0;
+}
+
+static Arena **arena_of(StrHeader *hdr) {
+    return (Arena **)hdr - 1;
+}
+
+static char *str_init(StrHeader *hdr, const char *init, int len) {
+    hdr->len = len;
+    if (init != NULL) {
+        memcpy(hdr->buf, init, len);
+    } else {
+        memset(hdr->buf, 0, len);
+    }
+    hdr->buf[len] = '\0';
+    return hdr->buf;
+}
+
+char *str_new(const char *init, int len) {
+    StrHeader *hdr = dmalloc(sizeof(StrHeader) + len + 1);
+    hdr->cap = len;
+    return str_init(hdr, init, len);
+}
+
+// str living in a, or on the heap when a is NULL
+char *str_new_in(Arena *a, const char *init, int len) {
+    if (a == NULL) return str_new(init, len);
+    Arena **owner = arena_alloc(a, sizeof(Arena *) + sizeof(StrHeader) + len + 1);
+    *owner = a;
+    StrHeader *hdr = (StrHeader *)(owner + 1);
+    hdr->cap = -len;
+    return str_init(hdr, init, len);
+}
+
+char *str_dup(const char *cstr) {
+    return str_new(cstr, strlen(cstr));
+}
+
+static char *str_vfmt(Arena *a, const char *fmt, va_list ap) {
+    char tmp[64];
+    va_list cp;
+    va_copy(cp, ap);
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, cp);
+    va_end(cp);
+    if (len < (int)sizeof(tmp)) return str_new_in(a, tmp, len);
+
+    char *s = str_new_in(a, NULL, len);
+    vsnprintf(s, len + 1, fmt, ap);
+    return s;
+}
+
+char *str_fmt(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *s = str_vfmt(NULL, fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+char *str_fmt_in(Arena *a, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *s = str_vfmt(a, fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+int str_len(const char *s) {
+    return str_header(s)->len;
+}
+
+int str_cap(const char *s) {
+    int cap = str_header(s)->cap;
+    return cap < 0 ? -cap : cap;
+}
+
+void str_free(char *s) {
+    if (s != NULL && !in_arena(str_header(s))) free(str_header(s));
+}
+
+// makes sure s can hold len bytes without reallocating
+static char *str_reserve(char *s, int len) {
+    StrHeader *hdr = str_header(s);
+    if (len <= str_cap(s)) return s;
+    int cap = len < STR_MAX_PREALLOC ? len * 2 : len + STR_MAX_PREALLOC;
+    if (in_arena(hdr)) {
+        Arena **owner = arena_of(hdr);
+        size_t head = sizeof(Arena *) + sizeof(StrHeader);
+        owner = arena_realloc(*owner, owner, head + hdr->len + 1,
+                              head + cap + 1);
+        hdr = (StrHeader *)(owner + 1);
+        hdr->cap = -cap;
+        return hdr->buf;
+    }
+    hdr = drealloc(hdr, sizeof(StrHeader) + cap + 1);
+    hdr->cap = cap;
+    return hdr->buf;
+}
+
+// zero fills s up to len bytes, never shrinks it
+char *str_grow(char *s, int len) {
+    int old = str_len(s);
+    if (len <= old) return s;
+    s = str_reserve(s, len);
+    memset(s + old, 0, len - old + 1);
+    str_header(s)->len = len;
+    return s;
+}
+
+char *str_cat(char *s, const char *t, int len) {
+    int old = str_len(s);
+    s = str_reserve(s, old + len);
+    memcpy(s + old, t, len);
+    s[old + len] = '\0';
+    str_header(s)->len = old + len;
+    return s;
+}
+
+// overwrites len bytes at off, zero padding any gap past the end of s
+char *str_setrange(char *s, int off, const char *t, int len) {
+    s = str_grow(s, off + len);
+    memcpy(s + off, t, len);
+    return s;
+}
+
+// replaces the content of s with len bytes of t, reusing its buffer
+char *str_assign(char *s, const char *t, int len) {
+    s = str_reserve(s, len);
+    memmove(s, t, len);
+    s[len] = '\0';
+    str_header(s)->len = len;
+    return s;
+}
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+// optimistic locking for transactions: every watched key has a version in
+// the registry below that is bumped whenever a command changes the key.
+// A client remembers the versions it saw at WATCH time and EXEC compares
+// them, so the check costs O(watched keys). Keys nobody watches are not in
+// the registry and writes only pay for a lookup while it is non empty
+
+typedef struct WatchEntry {
+    long long version;
+    int refs;           // clients watching the key
+} WatchEntry;
+
+// key -> WatchEntry, stored as a str of sizeof(WatchEntry) bytes
+static HashTable *registry = NULL;
+
+static WatchEntry *watch_entry(char *key) {
+    return (WatchEntry *)htable_get(registry, key);
+}
+
+void watch_key(Client *c, char *key) {
+    for (int i = 0; i < c->nwatched; i++) {
+        if (strcmp(c->watched[i].key, key) == 0) return;
+    }
+    if (registry == NULL) registry = htable_init(HT_BASE_SIZE);
+
+    WatchEntry *e = watch_entry(key);
+    if (e == NULL) {
+        WatchEntry init = {.version = 0, .refs = 0};
+        htable_set_str(registry, key, str_new((char *)&init, sizeof(init)));
+        e = watch_entry(key);
+    }
+    e->refs++;
+
+    c->watched = drealloc(c->watched, (c->nwatched + 1) * sizeof(WatchedKey));
+    c->watched[c->nwatched].key = strdup(key);
+    c->watched[c->nwatched++].version = e->version;
+}
+
+void unwatch_all(Client *c) {
+    for (int i = 0; i < c->nwatched; i++) {
+        WatchEntry *e = watch_entry(c->watched[i].key);
+        if (--e->refs == 0) htable_del(registry, c->watched[i].key);
+        free(c->watched[i].key);
+    }
+    free(c->watched);
+    c->watched = NULL;
+    c->nwatched = 0;
+}
+
+// true if any key watched by c changed since it was watched
+bool watch_changed(Client *c) {
+    for (int i = 0; i < c->nwatched; i++) {
+        if (watch_entry(c->watched[i].key)->version != c->watched[i].version) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void watch_touch(char *key) {
+    if (registry == NULL || registry->used == 0) return;
+    WatchEntry *e = watch_entry(key);
+    if (e != NULL) e->version++;
+}
+
+static void watch_touch_all() {
+    for (int i = 0; i < registry->size; i++) {
+        HashTableItem *item = registry->items[i];
+        if (item == NULL || item == &HT_DELETED) continue;
+        ((WatchEntry *)item->value)->version++;
+    }
+}
+
+// called after cmd changed the data set, bumps the versions of its keys.
+// Write commands without keys, like FLUSHALL, touch every watched key
+void watch_touch_command(Command *cmd) {
+    if (registry == NULL || registry->used == 0) return;
+    int first, last, step;
+    if (!command_keys(cmd, &first, &last, &step)) {
+        if (command_def(cmd->type)->flags & CMD_WRITE) watch_touch_all();
+        return;
+    }
+    for (int i = first; i <= last; i += step) watch_touch(cmd->argv[i]);
+}
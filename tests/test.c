@@ -12,6 +12,12 @@ int main() {
     test_htable();
     test_parser();
     test_interpret();
+    test_block();
+    test_arena();
+    test_multi();
+    test_snapshot();
+    test_aof();
+    test_batch();
     clock_gettime(CLOCK_REALTIME, &end);
     dur = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / B;
     printf("test duration = %lf\n", dur);
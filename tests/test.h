@@ -5,12 +5,20 @@
 
 void test_htable(void);
 void test_parser(void);
+void test_block(void);
+void test_arena(void);
+void test_multi(void);
+void test_snapshot(void);
+void test_aof(void);
+void test_batch(void);
 // interpreter test
 void test_interpret(void);
 void cleanup(HashTable *ht);
 bool compare(HashTable *ht, char *cmd, char *expected);
 void test_interpret_key(HashTable *ht);
 void test_interpret_str(HashTable *ht);
+void test_interpret_bitmap(HashTable *ht);
+void test_interpret_hyperloglog(HashTable *ht);
 void test_interpret_hash(HashTable *ht);
 void test_interpret_list(HashTable *ht);
 void test_interpret_set(HashTable *ht);
@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+#define TEST_AOF "/tmp/verokv-test.aof"
+#define TEST_SNAP "/tmp/verokv-test-aof.snap"
+#define SEGMENT_1 TEST_AOF ".000001"
+#define SEGMENT_2 TEST_AOF ".000002"
+#define SEGMENT_3 TEST_AOF ".000003"
+
+static void remove_aof() {
+    char name[64];
+    unlink(TEST_AOF);
+    unlink(TEST_AOF ".manifest");
+    for (int i = 1; i < 20; i++) {
+        sprintf(name, "%s.%06d", TEST_AOF, i);
+        unlink(name);
+        strcat(name, ".snap");
+        unlink(name);
+    }
+}
+
+// whether filename holds exactly expected
+static bool file_is(const char *filename, const char *expected) {
+    char buf[256];
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) return false;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    return strcmp(buf, expected) == 0;
+}
+
+// logs line the way the server logs a command that ran
+static void append(char *line) {
+    Command *cmd = parse(line);
+    aof_append(cmd);
+    command_free(cmd);
+}
+
+static long long file_length(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) return -1;
+    fseek(f, 0, SEEK_END);
+    long long n = ftell(f);
+    fclose(f);
+    return n;
+}
+
+static void test_group_commit(int policy, const char *name) {
+    remove_aof();
+    bool opened = aof_open(TEST_AOF, policy, AOF_TEXT, NULL);
+    append("set a 1");
+    append("rpush l x y");
+    bool buffered = file_is(SEGMENT_1, "");
+    AofStats before = aof_stats();
+    aof_flush();
+    AofStats after = aof_stats();
+    bool written = file_is(SEGMENT_1, "set a 1\nrpush l x y\n");
+    append("del a");
+    aof_close();
+    AofStats closed = aof_stats();
+    test_case(name, {
+        expect("opened", opened && before.enabled);
+        expect("buffered until flushed", buffered && before.pending == 20);
+        expect("written by the flush", written && after.pending == 0 &&
+                                       after.size == 20 && after.last_ok);
+        expect("policy", strcmp(after.fsync, name + strlen("test aof ")) == 0);
+        expect("flushed on close", file_is(SEGMENT_1,
+                                   "set a 1\nrpush l x y\ndel a\n"));
+        expect("closed", !closed.enabled);
+    });
+    remove_aof();
+}
+
+static void test_aof_load() {
+    remove_aof();
+    FILE *f = fopen(TEST_AOF, "w");
+    fputs("set a 1\n\nrpush l x y\nincr a\nset b cut", f);
+    fclose(f);
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    long long count = aof_load(ht, TEST_AOF);
+    long long length = file_length(TEST_AOF);
+    unlink(TEST_AOF);
+    long long missing = aof_load(ht, TEST_AOF);
+    test_case("test aof load", {
+        expect("replayed", count == 3);
+        expect("string", compare(ht, "get a", "$1\r\n2\r\n"));
+        expect("list", compare(ht, "llen l", ":2\r\n"));
+        expect("torn line dropped", compare(ht, "exists b", ":0\r\n") &&
+                                    length == 28);
+        expect("missing", missing == -1);
+    });
+    htable_free(ht);
+}
+
+// a transaction cut short before its EXEC never applies, and is cut off
+// the log so that later writes don't become part of it
+static void test_aof_transaction(int format, char *name) {
+    remove_aof();
+    aof_open(TEST_AOF, FSYNC_ALWAYS, format, NULL);
+    append("set a 1");
+    append("multi");
+    append("incr a");
+    append("rpush l x");
+    append("exec");
+    append("set b 2");
+    aof_flush();
+    long long complete = aof_stats().size;
+    append("multi");
+    append("incr a");
+    append("del b");
+    aof_close();
+
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    long long count = aof_load(ht, TEST_AOF);
+    long long cut = file_length(SEGMENT_1);
+    aof_open(TEST_AOF, FSYNC_ALWAYS, format, NULL);
+    append("set c 3");
+    aof_close();
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    long long again = aof_load(res, TEST_AOF);
+    test_case(name, {
+        expect("replayed", count == 4);
+        expect("transaction applied", compare(ht, "get a", "$1\r\n2\r\n") &&
+                                      compare(ht, "llen l", ":1\r\n"));
+        expect("open transaction dropped",
+               compare(ht, "get b", "$1\r\n2\r\n"));
+        expect("cut off the log", cut == complete);
+        expect("later writes apply", again == 5 &&
+                                     compare(res, "get c", "$1\r\n3\r\n") &&
+                                     compare(res, "get a", "$1\r\n2\r\n"));
+    });
+    remove_aof();
+    htable_free(ht);
+    htable_free(res);
+}
+
+// whether key holds the same string in both tables, byte for byte
+static bool same_str(HashTable *a, HashTable *b, char *key) {
+    HashTableItem *x = htable_search(a, key), *y = htable_search(b, key);
+    return x != NULL && y != NULL && x->type == STR_T && y->type == STR_T &&
+           str_len(x->value) == str_len(y->value) &&
+           memcmp(x->value, y->value, str_len(x->value)) == 0;
+}
+
+// a command whose arguments the text format can't hold
+static void append_binary(char *key, char *value) {
+    Command *cmd = parse("set k v");
+    cmd->argv[0] = key;
+    cmd->argv[1] = value;
+    aof_append(cmd);
+    command_free(cmd);
+}
+
+static void test_aof_binary() {
+    char *odd = "a\nb 'c\" d", *big = dmalloc(5000);
+    memset(big, 'x', 4999);
+    big[4999] = '\0';
+    remove_aof();
+    aof_open(TEST_AOF, FSYNC_NO, AOF_BINARY, NULL);
+    long long preallocated = file_length(SEGMENT_1);
+    append("set a 1");
+    append("rpush l x y");
+    append_binary("odd", odd);
+    aof_flush();
+    append_binary("big", big);
+    append("incr a");
+    AofStats st = aof_stats();
+    aof_close();
+    long long length = file_length(SEGMENT_1);
+
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    long long count = aof_load(ht, TEST_AOF);
+    char *got = htable_get(ht, "odd"), *got_big = htable_get(ht, "big");
+    bool same = got != NULL && strcmp(got, odd) == 0 && got_big != NULL &&
+                strcmp(got_big, big) == 0;
+
+    // a crash in the middle of a write leaves part of a block behind
+    FILE *f = fopen(SEGMENT_1, "a");
+    fwrite("\x20\0\0\0\x01\x02\x03\x04\x05", 1, 9, f);
+    fclose(f);
+    HashTable *torn = htable_init(HT_BASE_SIZE);
+    long long torn_count = aof_load(torn, TEST_AOF);
+    long long torn_length = file_length(SEGMENT_1);
+    aof_open(TEST_AOF, FSYNC_NO, AOF_TEXT, NULL);
+    AofStats reopened = aof_stats();
+    append("set after 1");
+    aof_close();
+    HashTable *more = htable_init(HT_BASE_SIZE);
+    long long more_count = aof_load(more, TEST_AOF);
+
+    // a damaged block that isn't the last one can't be a torn write
+    f = fopen(SEGMENT_1, "r+");
+    fseek(f, length - 20, SEEK_SET);
+    fputc('?', f);
+    fclose(f);
+    HashTable *bad = htable_init(HT_BASE_SIZE);
+    long long bad_count = aof_load(bad, TEST_AOF);
+    remove_aof();
+    test_case("test aof binary", {
+        expect("format", strcmp(st.format, "binary") == 0);
+        expect("preallocated", preallocated == AOF_SEGMENT_SIZE &&
+                               length < preallocated);
+        expect("replayed", count == 5);
+        expect("values", compare(ht, "get a", "$1\r\n2\r\n") &&
+                         compare(ht, "llen l", ":2\r\n"));
+        expect("any argument", same);
+        expect("torn block dropped", torn_count == 5 &&
+                                     torn_length == length &&
+                                     compare(torn, "get a", "$1\r\n2\r\n"));
+        expect("new segment", reopened.segments == 2 &&
+                              strcmp(reopened.format, "text") == 0);
+        expect("appended after the cut", more_count == 6 &&
+               compare(more, "get after", "$1\r\n1\r\n"));
+        expect("corrupt", bad_count == -2);
+    });
+    free(big);
+    htable_free(ht);
+    htable_free(torn);
+    htable_free(more);
+    htable_free(bad);
+}
+
+static void test_aof_segments() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    char line[64];
+    remove_aof();
+    long long segment_size = AOF_SEGMENT_SIZE;
+    AOF_SEGMENT_SIZE = 4096;
+    aof_open(TEST_AOF, FSYNC_NO, AOF_BINARY, NULL);
+    for (int i = 0; i < 300; i++) {
+        sprintf(line, "set key%d value%d", i, i);
+        compare(ht, line, NULL);
+        append(line);
+        if (i % 10 == 9) aof_flush();
+    }
+    AofStats grown = aof_stats();
+    long long first = file_length(SEGMENT_1);
+    save_snapshot(ht, TEST_SNAP);
+    AofStats saved = aof_stats();
+    long long dropped = file_length(SEGMENT_1);
+    append("set z 1");
+    aof_close();
+    AOF_SEGMENT_SIZE = segment_size;
+
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    long long count = aof_load(res, TEST_AOF);
+    test_case("test aof segments", {
+        expect("rotated", grown.segments > 1 && first <= 4096 &&
+                          first > 4096 - 300);
+        expect("dropped after a snapshot", saved.segments == 1 &&
+                                           dropped == -1);
+        expect("replayed after the snapshot", count == 1);
+        expect("keys", res->used == 301 &&
+                       compare(res, "get key299", "$8\r\nvalue299\r\n"));
+    });
+    remove_aof();
+    unlink(TEST_SNAP);
+    htable_free(ht);
+    htable_free(res);
+}
+
+// a server started from a snapshot alone and killed before saving again
+static void test_aof_from_snapshot() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    compare(ht, "set a 1", NULL);
+    compare(ht, "rpush l x y", NULL);
+    remove_aof();
+    save_snapshot(ht, TEST_SNAP);
+    htable_free(ht);
+
+    ht = htable_init(HT_BASE_SIZE);
+    int loaded = load_snapshot(ht, TEST_SNAP);
+    aof_open(TEST_AOF, FSYNC_ALWAYS, AOF_BINARY, TEST_SNAP);
+    append("set b 2");
+    aof_flush();
+    bool listed = file_is(TEST_AOF ".manifest", "# verokv append only file\n"
+                          "snapshot " TEST_SNAP "\nsegment " SEGMENT_1 "\n");
+    aof_close();
+
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    long long count = aof_load(res, TEST_AOF);
+    test_case("test aof from a snapshot", {
+        expect("loaded", loaded == 0);
+        expect("snapshot listed", listed);
+        expect("replayed after the snapshot", count == 1);
+        expect("snapshot kept", compare(res, "get a", "$1\r\n1\r\n") &&
+                                compare(res, "llen l", ":2\r\n"));
+        expect("appended", compare(res, "get b", "$1\r\n2\r\n"));
+    });
+    remove_aof();
+    unlink(TEST_SNAP);
+    htable_free(ht);
+    htable_free(res);
+}
+
+// a log from before manifests follows the snapshot, the way the server
+// starts from both
+static void test_aof_legacy() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    compare(ht, "mset a 1 c 3", NULL);
+    compare(ht, "hset h f v", NULL);
+    remove_aof();
+    save_snapshot(ht, TEST_SNAP);
+    htable_free(ht);
+    FILE *f = fopen(TEST_AOF, "w");
+    fputs("set b 2\ndel c\n", f);
+    fclose(f);
+
+    ht = htable_init(HT_BASE_SIZE);
+    bool manifest = aof_has_manifest(TEST_AOF);
+    int loaded = manifest ? -1 : load_snapshot(ht, TEST_SNAP);
+    long long replayed = aof_load(ht, TEST_AOF);
+    aof_open(TEST_AOF, FSYNC_ALWAYS, AOF_BINARY, TEST_SNAP);
+    bool listed = aof_has_manifest(TEST_AOF) &&
+                  file_is(TEST_AOF ".manifest", "# verokv append only file\n"
+                          "snapshot " TEST_SNAP "\nsegment " TEST_AOF
+                          "\nsegment " SEGMENT_1 "\n");
+    aof_close();
+
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    long long count = aof_load(res, TEST_AOF);
+    test_case("test aof legacy log over a snapshot", {
+        expect("no manifest", !manifest);
+        expect("loaded", loaded == 0 && replayed == 2);
+        expect("snapshot kept", compare(ht, "get a", "$1\r\n1\r\n") &&
+                                compare(ht, "hget h f", "$1\r\nv\r\n"));
+        expect("replayed over it", compare(ht, "get b", "$1\r\n2\r\n") &&
+                                   compare(ht, "exists c", ":0\r\n"));
+        expect("both listed", listed);
+        expect("reloaded", count == 2 && res->used == 3 &&
+                           compare(res, "get b", "$1\r\n2\r\n"));
+    });
+    remove_aof();
+    unlink(TEST_SNAP);
+    htable_free(ht);
+    htable_free(res);
+}
+
+// a server killed once its background save is written but before it
+// reaped the child must not replay what the new snapshot already holds
+static void test_aof_bgsave_crash() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    remove_aof();
+    aof_open(TEST_AOF, FSYNC_ALWAYS, AOF_BINARY, NULL);
+    compare(ht, "rpush l x", NULL);
+    append("rpush l x");
+    aof_flush();
+    save_snapshot(ht, TEST_SNAP);
+    compare(ht, "rpush l y", NULL);
+    append("rpush l y");
+    compare(ht, "incr n", NULL);
+    append("incr n");
+    aof_flush();
+    bool started = snapshot_bgsave(ht, TEST_SNAP);
+    siginfo_t info;
+    waitid(P_ALL, 0, &info, WEXITED | WNOWAIT);     // done, not reaped
+    HashTable *killed = htable_init(HT_BASE_SIZE);
+    long long killed_count = aof_load(killed, TEST_AOF);
+    snapshot_wait();
+    bool linked = file_is(TEST_AOF ".manifest", "# verokv append only file\n"
+                          "snapshot " SEGMENT_3 ".snap\n"
+                          "segment " SEGMENT_3 "\n");
+    bool unlinked = access(SEGMENT_2 ".snap", F_OK) != 0;
+    aof_close();
+
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    long long count = aof_load(res, TEST_AOF);
+    test_case("test aof killed during a background save", {
+        expect("started", started);
+        expect("replayed once", killed_count == 2 &&
+                                compare(killed, "llen l", ":2\r\n") &&
+                                compare(killed, "get n", "$1\r\n1\r\n"));
+        expect("manifest names its own link", linked);
+        expect("old link removed", unlinked);
+        expect("snapshot kept", access(TEST_SNAP, F_OK) == 0);
+        expect("loaded from the last save", count == 0 &&
+                                            compare(res, "llen l", ":2\r\n") &&
+                                            compare(res, "get n", "$1\r\n1\r\n"));
+    });
+    remove_aof();
+    unlink(TEST_SNAP);
+    htable_free(ht);
+    htable_free(killed);
+    htable_free(res);
+}
+
+static void test_aof_rewrite(int format, int preamble, char *name) {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    char line[64];
+    compare(ht, "set s 'hello world'", "+OK\r\n");
+    compare(ht, "set q a'b\"c", "+OK\r\n");
+    compare(ht, "set e ''", "+OK\r\n");
+    // a newline byte, null bytes around it and a trailing one
+    compare(ht, "setbit bin 12 1", ":0\r\n");
+    compare(ht, "setbit bin 14 1", ":0\r\n");
+    compare(ht, "setbit bin 100 0", ":0\r\n");
+    compare(ht, "setrange bin 3 \"it's\"", ":13\r\n");
+    compare(ht, "pfadd hll a b c", ":1\r\n");
+    for (int i = 0; i < 150; i++) {
+        sprintf(line, "rpush l e%d", i);
+        compare(ht, line, NULL);
+        sprintf(line, "hset h f%d v%d", i % 100, i);
+        compare(ht, line, NULL);
+        sprintf(line, "sadd st m%d", i % 70);
+        compare(ht, line, NULL);
+    }
+
+    remove_aof();
+    AOF_USE_PREAMBLE = preamble;
+    aof_open(TEST_AOF, FSYNC_NO, format, NULL);
+    long long rewrites = aof_stats().rewrites;
+    append("set s old");
+    append("set s 'hello world'");
+    bool started = aof_rewrite_start(ht);
+    bool again = aof_rewrite_start(ht);
+    append("set during 'the rewrite'");
+    aof_flush();
+    aof_rewrite_wait();
+    AofStats st = aof_stats();
+    append("set after 1");
+    aof_close();
+
+    long long dropped = file_length(SEGMENT_1);
+    char version = 0;
+    FILE *base = fopen(TEST_AOF ".000003", "r");
+    if (base != NULL) {
+        fseek(base, 7, SEEK_SET);
+        version = fgetc(base);
+        fclose(base);
+    }
+
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    long long replayed = aof_load(res, TEST_AOF);
+    AOF_USE_PREAMBLE = 1;
+    test_case(name, {
+        expect("started once", started && !again);
+        expect("swapped", !st.rewrite_in_progress && st.last_rewrite_ok &&
+                          st.rewrites == rewrites + 1 && st.base_size == st.size);
+        expect("segments replaced", st.segments == 2 && dropped == -1);
+        expect("strings", same_str(ht, res, "s") && same_str(ht, res, "q") &&
+                          same_str(ht, res, "e"));
+        expect("binary string", same_str(ht, res, "bin"));
+        expect("hyperloglog", same_str(ht, res, "hll"));
+        expect("list", compare(res, "llen l", ":150\r\n") &&
+                       compare(res, "lindex l 149", "$4\r\ne149\r\n"));
+        expect("hash", compare(res, "hlen h", ":100\r\n") &&
+                       compare(res, "hget h f49", "$4\r\nv149\r\n"));
+        expect("set", compare(res, "smismember st m0 m69 m70",
+                              "*3\r\n:1\r\n:1\r\n:0\r\n"));
+        expect("written during the rewrite", compare(res, "get during",
+               "$11\r\nthe rewrite\r\n"));
+        expect("written after the switch", compare(res, "get after",
+                                                   "$1\r\n1\r\n"));
+        expect("keys", res->used == ht->used + 2);
+        expect("preamble", preamble && format == AOF_BINARY ?
+               version == 2 && replayed == 2 : replayed > 2);
+    });
+    remove_aof();
+    htable_free(ht);
+    htable_free(res);
+}
+
+void test_aof() {
+    long long segment_size = AOF_SEGMENT_SIZE;
+    AOF_SEGMENT_SIZE = 64 * 1024;
+    test_group_commit(FSYNC_ALWAYS, "test aof always");
+    test_group_commit(FSYNC_EVERYSEC, "test aof everysec");
+    test_group_commit(FSYNC_NO, "test aof no");
+    test_aof_load();
+    test_aof_transaction(AOF_TEXT, "test aof transaction text");
+    test_aof_transaction(AOF_BINARY, "test aof transaction binary");
+    test_aof_binary();
+    test_aof_segments();
+    test_aof_from_snapshot();
+    test_aof_legacy();
+    test_aof_bgsave_crash();
+    test_aof_rewrite(AOF_TEXT, 1, "test aof rewrite text");
+    test_aof_rewrite(AOF_BINARY, 0, "test aof rewrite binary");
+    test_aof_rewrite(AOF_BINARY, 1, "test aof rewrite preamble");
+    AOF_SEGMENT_SIZE = segment_size;
+}
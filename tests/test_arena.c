@@ -0,0 +1,67 @@
+#include <string.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+// heap allocations made by parsing and running line the way the server
+// does, in the arena a
+static long long request_allocs(HashTable *ht, Arena *a, char *line) {
+    char buf[128];
+    strcpy(buf, line);
+    long long before = alloc_stats.heap;
+    Command *cmd = parse_line(a, buf, strlen(buf));
+    char *resp = interpret(ht, cmd);
+    str_free(resp);
+    command_free(cmd);
+    arena_reset(a);
+    return alloc_stats.heap - before;
+}
+
+void test_arena() {
+    Arena *a = arena_init(256);
+    char *p, *q, *s;
+    long long spills;
+    test_case("test arena", {
+        p = arena_alloc(a, 10);
+        q = arena_alloc(a, 10);
+        expect("bump", q == p + 16 && a->used == 32);
+        expect("grow last in place", arena_realloc(a, q, 10, 100) == q);
+        expect("grow other moves", arena_realloc(a, p, 10, 20) != p);
+        spills = alloc_stats.arena_spills;
+        p = arena_alloc(a, 1000);
+        expect("spill", alloc_stats.arena_spills == spills + 1 &&
+                        a->spill != NULL);
+        arena_reset(a);
+        expect("reset", a->used == 0 && a->spill == NULL);
+    });
+    test_case("test arena str", {
+        s = str_new_in(a, "ab", 2);
+        expect("arena str", str_len(s) == 2 && str_cap(s) == 2);
+        s = str_cat(s, "cdef", 4);
+        expect("grows in arena", strcmp(s, "abcdef") == 0 &&
+                                 (char *)s < a->buf + a->size);
+        str_free(s);
+        s = str_fmt_in(a, "%d-%s", 12, "x");
+        expect("fmt", strcmp(s, "12-x") == 0 && str_len(s) == 4);
+        arena_reset(a);
+        s = str_new_in(NULL, "heap", 4);
+        expect("heap str", strcmp(s, "heap") == 0 && str_cap(s) == 4);
+        str_free(s);
+    });
+    arena_free(a);
+
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    a = arena_init(ARENA_SIZE);
+    test_case("test zero allocation requests", {
+        expect("set new key allocates", request_allocs(ht, a, "set k abc") > 0);
+        expect("get", request_allocs(ht, a, "get k") == 0);
+        expect("get missing", request_allocs(ht, a, "get nope") == 0);
+        expect("exists", request_allocs(ht, a, "exists k nope") == 0);
+        expect("set overwrite", request_allocs(ht, a, "set k xyz") == 0);
+        expect("set value", strcmp(htable_get(ht, "k"), "xyz") == 0);
+        expect("type", request_allocs(ht, a, "type k") == 0);
+        expect("wrong arity", request_allocs(ht, a, "get") == 0);
+    });
+    arena_free(a);
+    htable_free(ht);
+}
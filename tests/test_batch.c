@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+#define TEST_BATCH "/tmp/verokv-test.batch"
+#define PRODUCERS 4
+#define PER_PRODUCER 5000
+
+static void append(char *line) {
+    Command *cmd = parse(line);
+    batch_append(cmd);
+    command_free(cmd);
+}
+
+static char *read_file(const char *filename, long *len) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    rewind(f);
+    char *buf = malloc(*len + 1);
+    buf[fread(buf, 1, *len, f)] = '\0';
+    fclose(f);
+    return buf;
+}
+
+static void *producer(void *arg) {
+    long id = (long)arg;
+    char line[64];
+    for (int i = 0; i < PER_PRODUCER; i++) {
+        sprintf(line, "set p%ld %d", id, i);
+        append(line);
+    }
+    return NULL;
+}
+
+// whether the lines of each producer are all there and in order
+static bool producers_in_order(const char *buf) {
+    int next[PRODUCERS] = {0};
+    const char *p = buf;
+    long id;
+    int i, n;
+    while (sscanf(p, "set p%ld %d\n%n", &id, &i, &n) == 2) {
+        if (id < 0 || id >= PRODUCERS || next[id] != i) return false;
+        next[id]++;
+        p += n;
+    }
+    for (int k = 0; k < PRODUCERS; k++) {
+        if (next[k] != PER_PRODUCER) return false;
+    }
+    return *p == '\0';
+}
+
+void test_batch() {
+    long len = 0;
+    char *buf;
+    bool opened;
+    BatchStats st;
+
+    test_case("test batch lines", {
+        unlink(TEST_BATCH);
+        opened = batch_open(TEST_BATCH, 4096);
+        append("set a 1");
+        append("rpush l x \"y z\"");
+        append("del a");
+        batch_close();
+        buf = read_file(TEST_BATCH, &len);
+        expect("opened", opened);
+        expect("lines in order", buf != NULL && strcmp(buf,
+               "set a 1\nrpush l x \"y z\"\ndel a\n") == 0);
+        expect("closed", !batch_stats().enabled);
+        free(buf);
+    });
+
+    test_case("test batch many producers", {
+        unlink(TEST_BATCH);
+        pthread_t threads[PRODUCERS];
+        batch_open(TEST_BATCH, 4096);
+        for (long k = 0; k < PRODUCERS; k++) {
+            pthread_create(&threads[k], NULL, producer, (void *)k);
+        }
+        for (int k = 0; k < PRODUCERS; k++) pthread_join(threads[k], NULL);
+        st = batch_stats();
+        batch_close();
+        buf = read_file(TEST_BATCH, &len);
+        expect("every line in order", buf != NULL && producers_in_order(buf));
+        expect("stalled on a full ring", st.stalls > 0);
+        free(buf);
+    });
+
+    test_case("test batch long line", {
+        unlink(TEST_BATCH);
+        char *line = malloc(8192);
+        strcpy(line, "set big ");
+        memset(line + 8, 'v', 6000);
+        line[6008] = '\0';
+        batch_open(TEST_BATCH, 4096);
+        append("set a 1");
+        append(line);
+        append("set b 2");
+        batch_close();
+        buf = read_file(TEST_BATCH, &len);
+        expect("length", len == 8 + 6009 + 8);
+        expect("long line", buf != NULL && strncmp(buf + 8, line, 6008) == 0);
+        expect("order kept", buf != NULL &&
+               strcmp(buf + 8 + 6009, "set b 2\n") == 0);
+        free(buf);
+        free(line);
+        unlink(TEST_BATCH);
+    });
+}
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+static long naive_count(unsigned char *p, long n) {
+    long res = 0;
+    for (long i = 0; i < n * 8; i++) res += (p[i / 8] >> (7 - i % 8)) & 1;
+    return res;
+}
+
+static long naive_pos(unsigned char *p, long n, int bit) {
+    for (long i = 0; i < n * 8; i++) {
+        if (((p[i / 8] >> (7 - i % 8)) & 1) == bit) return i;
+    }
+    return -1;
+}
+
+// runs with the simd kernels where the cpu has them, or without with simd 0
+static void test_kernels(int simd, char *name) {
+    unsigned char buf[1000];
+    unsigned char zeros[300] = {0};
+    unsigned char ones[300];
+    unsigned char a[20];
+    unsigned char b[9];
+    unsigned char dst[20];
+    srand(42);
+    for (int i = 0; i < 1000; i++) buf[i] = rand();
+    memset(ones, 0xff, sizeof(ones));
+    zeros[257] = 0x10;
+    ones[123] = 0xfd;
+    memset(a, 0xf0, sizeof(a));
+    memset(b, 0x3c, sizeof(b));
+    unsigned char *srcs[] = {a, b};
+    long lens[] = {20, 9};
+    BIT_SIMD = simd;
+    test_case(name, {
+        bool ok = true;
+        for (int n = 0; n < 1000; n += 37) {
+            ok = ok && bit_count(buf, n) == naive_count(buf, n);
+        }
+        expect("bit_count matches naive count", ok);
+
+        expect("bit_pos 1", bit_pos(zeros, 300, 1) == naive_pos(zeros, 300, 1));
+        expect("bit_pos 0", bit_pos(ones, 300, 0) == naive_pos(ones, 300, 0));
+        expect("bit_pos none", bit_pos(zeros, 257, 1) == -1);
+
+        bit_op(BIT_AND, dst, 20, srcs, lens, 2);
+        expect("and", dst[0] == 0x30 && dst[8] == 0x30 && dst[9] == 0);
+        bit_op(BIT_OR, dst, 20, srcs, lens, 2);
+        expect("or", dst[0] == 0xfc && dst[19] == 0xf0);
+        bit_op(BIT_XOR, dst, 20, srcs, lens, 2);
+        expect("xor", dst[0] == 0xcc && dst[19] == 0xf0);
+        bit_op(BIT_NOT, dst, 20, srcs, lens, 1);
+        expect("not", dst[0] == 0x0f && dst[19] == 0x0f);
+    });
+    BIT_SIMD = 1;
+}
+
+static void test_setbit(HashTable *ht) {
+    test_case("test setbit/getbit", {
+        // test gen
+        expect("setbit a 7 1", compare(ht, "setbit a 7 1", ":0\r\n"));
+        expect("setbit a 7 1 again", compare(ht, "setbit a 7 1", ":1\r\n"));
+        expect("a = 0x01", compare(ht, "get a", "$1\r\n\x01\r\n"));
+        expect("setbit grows", compare(ht, "setbit a 23 1", ":0\r\n"));
+        expect("strlen a = 3", compare(ht, "strlen a", ":3\r\n"));
+        expect("getbit a 7", compare(ht, "getbit a 7", ":1\r\n"));
+        expect("getbit a 8", compare(ht, "getbit a 8", ":0\r\n"));
+        expect("getbit past end", compare(ht, "getbit a 1000", ":0\r\n"));
+        expect("getbit missing key", compare(ht, "getbit b 1", ":0\r\n"));
+        expect("setbit a 7 0", compare(ht, "setbit a 7 0", ":1\r\n"));
+        expect("bad bit", compare(ht, "setbit a 1 2",
+               "-ERR bit is not an integer or out of range\r\n"));
+        expect("bad offset", compare(ht, "setbit a -1 1",
+               "-ERR bit offset is not an integer or out of range\r\n"));
+        // test argc
+        expect("setbit err argc", compare(ht, "setbit a 1",
+               "-ERR wrong number of arguments (given 2, expected 3)\r\n"));
+        // test type
+        expect("lpush c", compare(ht, "lpush c 1", ":1\r\n"));
+        expect("setbit list", compare(ht, "setbit c 1 1",
+               "-ERR wrongtype operation\r\n"));
+    });
+    cleanup(ht);
+}
+
+static void test_bitcount(HashTable *ht) {
+    test_case("test bitcount/bitpos", {
+        // test gen
+        expect("set a", compare(ht, "set a foobar", "$2\r\nOK\r\n"));
+        expect("bitcount a", compare(ht, "bitcount a", ":26\r\n"));
+        expect("bitcount a 0 0", compare(ht, "bitcount a 0 0", ":4\r\n"));
+        expect("bitcount a 1 1", compare(ht, "bitcount a 1 1", ":6\r\n"));
+        expect("bitcount a -2 -1", compare(ht, "bitcount a -2 -1", ":7\r\n"));
+        expect("bitcount missing", compare(ht, "bitcount b", ":0\r\n"));
+        expect("set b", compare(ht, "setbit b 12 1", ":0\r\n"));
+        expect("bitpos b 1", compare(ht, "bitpos b 1", ":12\r\n"));
+        expect("bitpos b 1 2", compare(ht, "bitpos b 1 2", ":-1\r\n"));
+        expect("bitpos b 0", compare(ht, "bitpos b 0", ":0\r\n"));
+        expect("bitpos missing 0", compare(ht, "bitpos c 0", ":0\r\n"));
+        expect("bitpos missing 1", compare(ht, "bitpos c 1", ":-1\r\n"));
+        // positions past 2^31 on a 275MB string
+        compare(ht, "setbit big 2200000000 1", NULL);
+        expect("bitpos big 1", compare(ht, "bitpos big 1",
+                                       ":2200000000\r\n"));
+        expect("bitpos big from", compare(ht, "bitpos big 1 270000000",
+                                          ":2200000000\r\n"));
+        expect("bitpos big 0", compare(ht, "bitpos big 0 275000000",
+                                       ":2200000001\r\n"));
+        compare(ht, "del big", NULL);
+        // test argc
+        expect("bitcount err argc", compare(ht, "bitcount a 1",
+               "-ERR wrong number of arguments (given 2, expected 1 or 3)\r\n"));
+        expect("bitcount too many", compare(ht, "bitcount a 1 2 3",
+               "-ERR wrong number of arguments (given 4, expected 1..3)\r\n"));
+        expect("bitpos err argc", compare(ht, "bitpos a",
+               "-ERR wrong number of arguments (given 1, expected 2..4)\r\n"));
+        // test type
+        expect("sadd d", compare(ht, "sadd d 1", ":1\r\n"));
+        expect("bitcount set", compare(ht, "bitcount d",
+               "-ERR wrongtype operation\r\n"));
+    });
+    cleanup(ht);
+}
+
+static void test_bitop(HashTable *ht) {
+    test_case("test bitop", {
+        // test gen
+        expect("set a", compare(ht, "set a abc", "$2\r\nOK\r\n"));
+        expect("set b", compare(ht, "set b a", "$2\r\nOK\r\n"));
+        expect("bitop and", compare(ht, "bitop and c a b", ":3\r\n"));
+        expect("c = a\\0\\0", compare(ht, "bitcount c", ":3\r\n"));
+        expect("bitop or", compare(ht, "bitop or c a b", ":3\r\n"));
+        expect("c = abc", compare(ht, "get c", "$3\r\nabc\r\n"));
+        expect("bitop xor", compare(ht, "bitop xor c a a", ":3\r\n"));
+        expect("c zeroed", compare(ht, "bitcount c", ":0\r\n"));
+        expect("bitop not", compare(ht, "bitop not c b", ":1\r\n"));
+        expect("c = ~a", compare(ht, "get c", "$1\r\n\x9e\r\n"));
+        expect("bitop empty dels", compare(ht, "bitop or c x y", ":0\r\n"));
+        expect("c deleted", compare(ht, "exists c", ":0\r\n"));
+        expect("bitop bad op", compare(ht, "bitop nand c a",
+               "-ERR syntax error\r\n"));
+        expect("bitop not 2 keys", compare(ht, "bitop not c a b",
+               "-ERR BITOP NOT must be called with a single source key\r\n"));
+        // test argc
+        expect("bitop err argc", compare(ht, "bitop and c",
+               "-ERR wrong number of arguments (given 2, expected 3+)\r\n"));
+        // test type
+        expect("hset d", compare(ht, "hset d 1 2", ":1\r\n"));
+        expect("bitop hash", compare(ht, "bitop and c a d",
+               "-ERR wrongtype operation\r\n"));
+    });
+    cleanup(ht);
+}
+
+void test_interpret_bitmap(HashTable *ht) {
+    test_kernels(1, "test bit kernels");
+    test_kernels(0, "test bit kernels scalar");
+    test_setbit(ht);
+    test_bitcount(ht);
+    test_bitop(ht);
+}
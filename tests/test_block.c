@@ -0,0 +1,46 @@
+#include <string.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+static Client client(int fd) {
+    return (Client){.fd = fd, .blocked = NULL, .deadline = 0};
+}
+
+void test_block() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    Client a = client(5), b = client(6);
+    Command *blpop = parse("blpop x y 0");
+    Command *brpop = parse("brpop y 10");
+    Command *lpop = parse("lpop y");
+    test_case("test blocking registry", {
+        expect("block a on x y", block_client(&a, blpop));
+        expect("block b on y", block_client(&b, brpop));
+        expect("non blocking cmd", !block_client(&b, lpop));
+        expect("a blocks forever", a.deadline == 0 && a.btype == BLPOP);
+        expect("b has deadline", b.deadline > 0 && b.btype == BRPOP);
+        expect("owns its command", a.blocked != blpop &&
+                                   strcmp(a.blocked->argv[1], "y") == 0);
+        expect("nothing ready", block_ready() == NULL);
+        expect("a first on y", block_first("y") == 5);
+
+        htable_push(ht, "z", "1", LEFT);
+        expect("unwatched push", block_ready() == NULL);
+        htable_push(ht, "y", "1", LEFT);
+        char **keys = block_ready();
+        expect("y ready", keys != NULL && strcmp(keys[0], "y") == 0 &&
+                          keys[1] == NULL);
+        expect("ready consumed", block_ready() == NULL);
+
+        unblock_client(&a);
+        expect("a unblocked", a.blocked == NULL);
+        expect("b first on y", block_first("y") == 6);
+        expect("x has no waiters", block_first("x") == -1);
+        unblock_client(&b);
+        expect("y has no waiters", block_first("y") == -1);
+    });
+    command_free(blpop);
+    command_free(brpop);
+    command_free(lpop);
+    htable_free(ht);
+}
@@ -92,10 +92,12 @@ void test_hgetall(HashTable *ht) {
         expect("hset new hash", compare(ht, "hset a 1 2 3 4 5 6", ":3\r\n"));
         // hgetall not ordered by insertion
         expect("hgetall a", compare(ht, "hgetall a",
-               "*6\r\n:5\r\n:6\r\n:1\r\n:2\r\n:3\r\n:4\r\n"));
+               "*6\r\n$1\r\n5\r\n$1\r\n6\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n"
+               "$1\r\n4\r\n"));
         expect("change value in hash", compare(ht, "hset a 1 hello", ":0\r\n"));
         expect("hgetall a", compare(ht, "hgetall a",
-               "*6\r\n:5\r\n:6\r\n:1\r\n$5\r\nhello\r\n:3\r\n:4\r\n"));
+               "*6\r\n$1\r\n5\r\n$1\r\n6\r\n$1\r\n1\r\n$5\r\nhello\r\n"
+               "$1\r\n3\r\n$1\r\n4\r\n"));
         expect("hgetall b", compare(ht, "hgetall b", "*0\r\n"));
         // test argc
         expect("empty hgetall", compare(ht, "hgetall",
@@ -179,10 +181,12 @@ void test_hkeys(HashTable *ht) {
         // test gen
         expect("hset new hash", compare(ht, "hset a 1 2 3 4 5 6", ":3\r\n"));
         // keys not ordered by insertion
-        expect("hkeys a", compare(ht, "hkeys a", "*3\r\n:5\r\n:1\r\n:3\r\n"));
+        expect("hkeys a", compare(ht, "hkeys a",
+               "*3\r\n$1\r\n5\r\n$1\r\n1\r\n$1\r\n3\r\n"));
         expect("hset new values", compare(ht, "hset a 7 8 9 0", ":2\r\n"));
         expect("hkeys a", compare(ht, "hkeys a",
-               "*5\r\n:7\r\n:9\r\n:1\r\n:3\r\n:5\r\n"));
+               "*5\r\n$1\r\n7\r\n$1\r\n9\r\n$1\r\n1\r\n$1\r\n3\r\n"
+               "$1\r\n5\r\n"));
         expect("hkeys non existing hash", compare(ht, "hkeys b", "*0\r\n"));
         // test argc
         expect("empty hkeys", compare(ht, "hkeys",
@@ -208,10 +212,12 @@ void test_hvals(HashTable *ht) {
         // test gen
         expect("hset new hash", compare(ht, "hset a 1 2 3 4 5 6", ":3\r\n"));
         // keys not ordered by insertion
-        expect("hvals a", compare(ht, "hvals a", "*3\r\n:6\r\n:2\r\n:4\r\n"));
+        expect("hvals a", compare(ht, "hvals a",
+               "*3\r\n$1\r\n6\r\n$1\r\n2\r\n$1\r\n4\r\n"));
         expect("hset new values", compare(ht, "hset a 7 8 9 0", ":2\r\n"));
         expect("hvals a", compare(ht, "hvals a",
-                "*5\r\n:8\r\n:0\r\n:2\r\n:4\r\n:6\r\n"));
+                "*5\r\n$1\r\n8\r\n$1\r\n0\r\n$1\r\n2\r\n$1\r\n4\r\n"
+                "$1\r\n6\r\n"));
         expect("hvals non existing hash", compare(ht, "hvals b", "*0\r\n"));
         // test argc
         expect("empty hvals", compare(ht, "hvals",
@@ -236,13 +242,15 @@ void test_hmget(HashTable *ht) {
     test_case("test hmget", {
         // test gen
         expect("hset new hash", compare(ht, "hset a 1 2 3 4 5 6", ":3\r\n"));
-        expect("hmget 1 val", compare(ht, "hmget a 1", "*1\r\n:2\r\n"));
+        expect("hmget 1 val", compare(ht, "hmget a 1", "*1\r\n$1\r\n2\r\n"));
         expect("hmget multiple vals",
-               compare(ht, "hmget a 1 3 5", "*3\r\n:2\r\n:4\r\n:6\r\n"));
+               compare(ht, "hmget a 1 3 5",
+                       "*3\r\n$1\r\n2\r\n$1\r\n4\r\n$1\r\n6\r\n"));
         expect("hmget non existing val",
                compare(ht, "hmget a 0", "*1\r\n$-1\r\n"));
         expect("hmget ex & nex",
-               compare(ht, "hmget a 1 2 3", "*3\r\n:2\r\n$-1\r\n:4\r\n"));
+               compare(ht, "hmget a 1 2 3",
+                       "*3\r\n$1\r\n2\r\n$-1\r\n$1\r\n4\r\n"));
         expect("hmget non existing hash", compare(ht, "hmget b 1", "*0\r\n"));
         // test argc
         expect("empty hmget", compare(ht, "hmget",
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <string.h>
 #include "../src/common.h"
 #include "miniunit.h"
@@ -11,6 +12,33 @@ static void test_creation() {
     htable_free(ht);
 }
 
+// the probe sequence of every key must reach every slot, a key whose
+// sequence keeps hitting the same slots can't be inserted once they fill
+static void test_probing() {
+    int sizes[] = {5, 7, 13, 53};
+    char key[16];
+    bool all = true;
+    for (int s = 0; s < 4; s++) {
+        int size = sizes[s];
+        for (int k = 0; k < 200; k++) {
+            bool seen[53] = {false};
+            int n = 0;
+            sprintf(key, "k%d", k);
+            for (int i = 0; i < size; i++) {
+                int slot = hash_func(key, size, i);
+                if (slot >= 0 && slot < size && !seen[slot]) {
+                    seen[slot] = true;
+                    n++;
+                }
+            }
+            all = all && n == size;
+        }
+    }
+    test_case("test htable probing", {
+        expect("every slot probed", all);
+    });
+}
+
 static void test_insert() {
     HashTable *ht = htable_init(HT_BASE_SIZE);
     test_case("test htable insertion", {
@@ -236,13 +264,67 @@ static void test_set_funcs() {
     htable_free(ht);
 }
 
+static void test_dirty() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    test_case("test htable dirty counter", {
+        expect("starts clean", ht->dirty == 0);
+        htable_set(ht, "a", "1");
+        htable_set(ht, "a", "2");
+        expect("set counts", ht->dirty == 2);
+        htable_sadd(ht, "s", "1");
+        htable_sadd(ht, "s", "1");
+        expect("duplicate sadd", ht->dirty == 3);
+        htable_srem(ht, "s", "2");
+        htable_lrem(ht, "l", 0, "x");
+        htable_del(ht, "none");
+        expect("missed removals", ht->dirty == 3);
+        htable_push(ht, "l", "x", LEFT);
+        htable_push(ht, "l", "y", LEFT);
+        htable_lrem(ht, "l", 0, "x");
+        expect("push and lrem", ht->dirty == 6);
+        htable_flush(ht, false);
+        expect("flush counts keys", ht->dirty == 9);
+    });
+    htable_free(ht);
+}
+
+static void test_search_n() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    char *keys[80], *pairs[160], buf[80][8];
+    HashTableItem *items[80];
+    for (int i = 0; i < 80; i++) {
+        sprintf(buf[i], "k%d", i);
+        keys[i] = pairs[2*i] = pairs[2*i+1] = buf[i];
+        if (i % 3 != 0) htable_set(ht, buf[i], buf[i]);
+    }
+    for (int i = 0; i < 80; i += 4) htable_del(ht, buf[i]);
+    bool same = true, pairs_same = true;
+    htable_search_n(ht, keys, 80, 1, items);
+    for (int i = 0; i < 80; i++) same &= items[i] == htable_search(ht, keys[i]);
+    htable_search_n(ht, pairs, 80, 2, items);
+    for (int i = 0; i < 80; i++) {
+        pairs_same &= items[i] == htable_search(ht, keys[i]);
+    }
+    test_case("test htable batched search", {
+        expect("matches single lookups", same);
+        expect("keys taken every step", pairs_same);
+        expect("missing key", items[3] == NULL && items[4] == NULL);
+        expect("found key", items[5] != NULL &&
+                            strcmp(items[5]->key, "k5") == 0);
+    });
+    htable_free(ht);
+}
+
 void test_htable() {
     test_creation();
+    test_probing();
     test_insert();
     test_delete();
     test_str_funcs();
     test_hash_funcs();
     test_list_funcs();
     test_set_funcs();
+    test_dirty();
+    test_search_n();
 }
 
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+static bool near(long est, long exact) {
+    return labs(est - exact) <= exact / 50 + 1;
+}
+
+static void test_pfadd(HashTable *ht) {
+    test_case("test pfadd/pfcount", {
+        // test gen
+        expect("pfadd creates", compare(ht, "pfadd a", ":1\r\n"));
+        expect("pfcount empty", compare(ht, "pfcount a", ":0\r\n"));
+        expect("pfadd 3", compare(ht, "pfadd a x y z", ":1\r\n"));
+        expect("pfadd dups", compare(ht, "pfadd a x y", ":0\r\n"));
+        expect("pfcount a", compare(ht, "pfcount a", ":3\r\n"));
+        expect("pfcount missing", compare(ht, "pfcount b", ":0\r\n"));
+        expect("pfadd b", compare(ht, "pfadd b z w", ":1\r\n"));
+        expect("pfcount union", compare(ht, "pfcount a b", ":4\r\n"));
+        expect("a is a string", compare(ht, "type a", "$6\r\nstring\r\n"));
+        // test argc
+        expect("empty pfadd", compare(ht, "pfadd",
+               "-ERR wrong number of arguments (given 0, expected 1+)\r\n"));
+        // test type
+        expect("set c", compare(ht, "set c 1", "$2\r\nOK\r\n"));
+        expect("pfadd not hll", compare(ht, "pfadd c x",
+               "-ERR key is not a valid HyperLogLog string value\r\n"));
+        expect("lpush d", compare(ht, "lpush d 1", ":1\r\n"));
+        expect("pfcount list", compare(ht, "pfcount a d",
+               "-ERR key is not a valid HyperLogLog string value\r\n"));
+    });
+    cleanup(ht);
+}
+
+static void test_pfaccuracy(HashTable *ht) {
+    char elem[32];
+    test_case("test hyperloglog accuracy", {
+        compare(ht, "pfadd a", ":1\r\n");
+        for (int i = 0; i < 500; i++) {
+            sprintf(elem, "elem:%d", i);
+            htable_pfadd(ht, "a", elem);
+        }
+        expect("sparse stays small", str_len(htable_get(ht, "a")) < 3000);
+        expect("sparse estimate", near(hll_count(htable_get(ht, "a")), 500));
+
+        for (int i = 500; i < 50000; i++) {
+            sprintf(elem, "elem:%d", i);
+            htable_pfadd(ht, "a", elem);
+        }
+        expect("promoted to 12KB dense", str_len(htable_get(ht, "a")) == 12304);
+        expect("dense estimate", near(hll_count(htable_get(ht, "a")), 50000));
+        expect("cached estimate", near(hll_count(htable_get(ht, "a")), 50000));
+
+        compare(ht, "pfadd b", ":1\r\n");
+        for (int i = 25000; i < 75000; i++) {
+            sprintf(elem, "elem:%d", i);
+            htable_pfadd(ht, "b", elem);
+        }
+        expect("pfmerge", compare(ht, "pfmerge c a b", "$2\r\nOK\r\n"));
+        expect("merged estimate", near(hll_count(htable_get(ht, "c")), 75000));
+        expect("merge sparse into dense", compare(ht, "pfadd d x", ":1\r\n") &&
+               compare(ht, "pfmerge d c", "$2\r\nOK\r\n"));
+        expect("merged estimate", near(hll_count(htable_get(ht, "d")), 75001));
+    });
+    cleanup(ht);
+}
+
+// a sparse hll string holding the given 3 byte entries
+static char *forge_sparse(const uint8_t *entries, int n) {
+    char *hll = str_new(NULL, 16 + n * 3);
+    memcpy(hll, "HYLL\x01", 5);
+    hll[15] = 0x80; // no cached cardinality
+    memcpy(hll + 16, entries, n * 3);
+    return hll;
+}
+
+static void test_pfcorrupt(HashTable *ht) {
+    char *err = "-ERR key is not a valid HyperLogLog string value\r\n";
+    // index 5 with a value of 3, then index 2^18-1 with 63
+    const uint8_t good[] = {0x00, 0x01, 0x43};
+    const uint8_t past[] = {0x00, 0x01, 0x43, 0xff, 0xff, 0xff};
+    const uint8_t unsorted[] = {0x00, 0x01, 0x43, 0x00, 0x01, 0x43};
+    const uint8_t big[] = {0x00, 0x01, 0x7f};
+    test_case("test hyperloglog corrupt sparse", {
+        htable_set_str(ht, "good", forge_sparse(good, 1));
+        expect("valid entries", compare(ht, "pfcount good", ":1\r\n"));
+        htable_set_str(ht, "a", forge_sparse(past, 2));
+        expect("pfadd index past registers", compare(ht, "pfadd a x", err));
+        expect("pfcount index past registers",
+               compare(ht, "pfcount a good", err));
+        expect("pfmerge index past registers",
+               compare(ht, "pfmerge c good a", err));
+        htable_set_str(ht, "b", forge_sparse(unsorted, 2));
+        expect("pfcount repeated index", compare(ht, "pfcount b", err));
+        htable_set_str(ht, "d", forge_sparse(big, 1));
+        expect("pfadd value too large", compare(ht, "pfadd d x", err));
+        expect("pfmerge value too large", compare(ht, "pfmerge d", err));
+        expect("nothing created", compare(ht, "exists c", ":0\r\n"));
+    });
+    cleanup(ht);
+}
+
+void test_interpret_hyperloglog(HashTable *ht) {
+    test_pfadd(ht);
+    test_pfaccuracy(ht);
+    test_pfcorrupt(ht);
+}
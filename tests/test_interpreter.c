@@ -4,16 +4,31 @@
 #include "miniunit.h"
 
 void cleanup(HashTable *ht) {
-    interpret(ht, parse("del a b c d"));
+    Command *cmd = parse("del a b c d");
+    str_free(interpret(ht, cmd));
+    command_free(cmd);
 }
 
-bool compare(HashTable *ht, char *cmd, char *expected) {
-    char *res = interpret(ht, parse(cmd));
+bool compare(HashTable *ht, char *line, char *expected) {
+    Command *cmd = parse(line);
+    char *res = interpret(ht, cmd);
+    command_free(cmd);
     // if (res != NULL) puts(res);
     if (expected == NULL) return res == NULL;
     return strcmp(res, expected) == 0;
 }
 
+// like compare, with the reply encoded in protocol version resp
+static bool compare_resp(HashTable *ht, int resp, char *line, char *expected) {
+    Command *cmd = parse(line);
+    cmd->resp = resp;
+    char *res = interpret(ht, cmd);
+    command_free(cmd);
+    bool ok = strcmp(res, expected) == 0;
+    str_free(res);
+    return ok;
+}
+
 // template
 // void test_(HashTable *ht) {
     // test_case("test ", {
@@ -35,13 +50,54 @@ void test_etc(HashTable *ht) {
     });
 }
 
+void test_resp3(HashTable *ht) {
+    Command *hello = parse("hello 3");
+    str_free(interpret(ht, hello));
+    test_case("test hello", {
+        expect("hello", compare(ht, "hello", "*4\r\n$6\r\nserver\r\n"
+               "$6\r\nverokv\r\n$5\r\nproto\r\n:2\r\n"));
+        expect("hello 3", compare(ht, "hello 3", "%2\r\n$6\r\nserver\r\n"
+               "$6\r\nverokv\r\n$5\r\nproto\r\n:3\r\n"));
+        expect("switches protocol", hello->resp == 3);
+        expect("hello 4", compare(ht, "hello 4",
+               "-NOPROTO unsupported protocol version\r\n"));
+        expect("hello argc", compare(ht, "hello 2 3",
+               "-ERR wrong number of arguments (given 2, expected 0..1)\r\n"));
+    });
+    command_free(hello);
+    test_case("test resp3 replies", {
+        expect("hset", compare(ht, "hset a f 007", ":1\r\n"));
+        expect("sadd", compare(ht, "sadd b x", ":1\r\n"));
+        expect("null", compare_resp(ht, 3, "get c", "_\r\n"));
+        expect("null resp2", compare_resp(ht, 2, "get c", "$-1\r\n"));
+        expect("empty is not null", compare(ht, "set c \"\"", "$2\r\nOK\r\n") &&
+               compare_resp(ht, 3, "get c", "$0\r\n\r\n"));
+        expect("map", compare_resp(ht, 3, "hgetall a",
+               "%1\r\n$1\r\nf\r\n$3\r\n007\r\n"));
+        expect("flat map resp2", compare_resp(ht, 2, "hgetall a",
+               "*2\r\n$1\r\nf\r\n$3\r\n007\r\n"));
+        expect("number-like value", compare_resp(ht, 3, "hmget a f g",
+               "*2\r\n$3\r\n007\r\n_\r\n"));
+        expect("true", compare_resp(ht, 3, "hexists a f", "#t\r\n"));
+        expect("false", compare_resp(ht, 3, "sismember b y", "#f\r\n"));
+        expect("bools", compare_resp(ht, 3, "smismember b x y",
+               "*2\r\n#t\r\n#f\r\n"));
+        expect("ints resp2", compare_resp(ht, 2, "smismember b x y",
+               "*2\r\n:1\r\n:0\r\n"));
+    });
+    cleanup(ht);
+}
+
 void test_interpret() {
     HashTable *ht = htable_init(512);
     test_interpret_key(ht);
     test_interpret_str(ht);
+    test_interpret_bitmap(ht);
+    test_interpret_hyperloglog(ht);
     test_interpret_hash(ht);
     test_interpret_list(ht);
     test_interpret_set(ht);
     test_etc(ht);
+    test_resp3(ht);
     htable_free(ht);
 }
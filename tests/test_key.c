@@ -54,8 +54,50 @@ static void test_type(HashTable *ht) {
     cleanup(ht);
 }
 
+static void test_unlink(HashTable *ht) {
+    test_case("test unlink", {
+        // test gen
+        expect("unlink non existing item", compare(ht, "unlink a", ":0\r\n"));
+        expect("set a 1", compare(ht, "set a 1", "$2\r\nOK\r\n"));
+        for (int i = 0; i < 1000; i++) htable_push(ht, "b", "x", RIGHT);
+        expect("unlink a, b, c", compare(ht, "unlink a b c", ":2\r\n"));
+        expect("b gone at once", compare(ht, "exists b", ":0\r\n"));
+        lazyfree_wait();
+        expect("b freed in background", lazyfree_pending() == 0);
+        // test argc
+        expect("empty unlink", compare(ht, "unlink",
+               "-ERR wrong number of arguments (given 0, expected 1+)\r\n"));
+    });
+    cleanup(ht);
+}
+
+static void test_flushall(HashTable *ht) {
+    test_case("test flushall", {
+        // test gen
+        expect("set a 1", compare(ht, "set a 1", "$2\r\nOK\r\n"));
+        expect("sadd b 1", compare(ht, "sadd b 1", ":1\r\n"));
+        expect("flushall", compare(ht, "flushall", "$2\r\nOK\r\n"));
+        expect("emptied", ht->used == 0 && compare(ht, "exists a b", ":0\r\n"));
+        for (int i = 0; i < 1000; i++) htable_push(ht, "c", "x", RIGHT);
+        expect("flushall async", compare(ht, "flushall ASYNC", "$2\r\nOK\r\n"));
+        expect("emptied", ht->used == 0 && compare(ht, "exists c", ":0\r\n"));
+        expect("set after flush", compare(ht, "set d 1", "$2\r\nOK\r\n"));
+        expect("flushdb sync", compare(ht, "flushdb sync", "$2\r\nOK\r\n"));
+        expect("emptied", ht->used == 0);
+        lazyfree_wait();
+        expect("old table freed", lazyfree_pending() == 0);
+        expect("bad flag", compare(ht, "flushall now", "-ERR syntax error\r\n"));
+        // test argc
+        expect("flushall err argc", compare(ht, "flushall async sync",
+               "-ERR wrong number of arguments (given 2, expected 0..1)\r\n"));
+    });
+    cleanup(ht);
+}
+
 void test_interpret_key(HashTable *ht) {
     test_del(ht);
     test_exists(ht);
     test_type(ht);
+    test_unlink(ht);
+    test_flushall(ht);
 }
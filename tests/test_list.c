@@ -127,13 +127,15 @@ void test_lrange(HashTable *ht) {
         // test gen
         expect("rpush new list", compare(ht, "rpush a 1 2 3 4 5", ":5\r\n"));
         expect("lrange 1 element",
-               compare(ht, "lrange a 0 0", "*1\r\n:1\r\n"));
+               compare(ht, "lrange a 0 0", "*1\r\n$1\r\n1\r\n"));
         expect("lrange all element", compare(ht, "lrange a 0 4",
-               "*5\r\n:1\r\n:2\r\n:3\r\n:4\r\n:5\r\n"));
+               "*5\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n$1\r\n4\r\n"
+               "$1\r\n5\r\n"));
         expect("lrange all element with neg id", compare(ht, "lrange a 0 -1",
-               "*5\r\n:1\r\n:2\r\n:3\r\n:4\r\n:5\r\n"));
+               "*5\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n$1\r\n4\r\n"
+               "$1\r\n5\r\n"));
         expect("last 3 elements", compare(ht, "lrange a -3 -1",
-               "*3\r\n:3\r\n:4\r\n:5\r\n"));
+               "*3\r\n$1\r\n3\r\n$1\r\n4\r\n$1\r\n5\r\n"));
         expect("index error", compare(ht, "lrange a 0 9",
                "-ERR value is not an integer or out of range\r\n"));
         expect("index error", compare(ht, "lrange a 9 0",
@@ -209,13 +211,14 @@ void test_lrem(HashTable *ht) {
                compare(ht, "rpush a 1 1 2 2 2 2 2 1 1", ":9\r\n"));
         expect("lrem first 3 1s", compare(ht, "lrem a 3 1", ":3\r\n"));
         expect("lrange 0:-1 a", compare(ht, "lrange a 0 -1",
-               "*6\r\n:2\r\n:2\r\n:2\r\n:2\r\n:2\r\n:1\r\n"));
+               "*6\r\n$1\r\n2\r\n$1\r\n2\r\n$1\r\n2\r\n$1\r\n2\r\n$1\r\n2\r\n"
+               "$1\r\n1\r\n"));
         expect("lrem last 2 2s", compare(ht, "lrem a -2 2", ":2\r\n"));
         expect("lrange 0:-1 a", compare(ht, "lrange a 0 -1",
-               "*4\r\n:2\r\n:2\r\n:2\r\n:1\r\n"));
+               "*4\r\n$1\r\n2\r\n$1\r\n2\r\n$1\r\n2\r\n$1\r\n1\r\n"));
         expect("lrem last 2 1s", compare(ht, "lrem a 2 1", ":1\r\n"));
         expect("lrange 0:-1 a", compare(ht, "lrange a 0 -1",
-               "*3\r\n:2\r\n:2\r\n:2\r\n"));
+               "*3\r\n$1\r\n2\r\n$1\r\n2\r\n$1\r\n2\r\n"));
         expect("lrem all 2s", compare(ht, "lrem a 0 2", ":3\r\n"));
         expect("list deleted", compare(ht, "lrem a 0 1", ":0\r\n"));
         // test argc
@@ -270,6 +273,57 @@ void test_lpos(HashTable *ht) {
     cleanup(ht);
 }
 
+void test_bpop(HashTable *ht) {
+    test_case("test blpop/brpop", {
+        // test gen
+        expect("rpush new list", compare(ht, "rpush a x y z", ":3\r\n"));
+        expect("blpop a = x", compare(ht, "blpop a 0",
+               "*2\r\n$1\r\na\r\n$1\r\nx\r\n"));
+        expect("brpop b a = z", compare(ht, "brpop b a 1",
+               "*2\r\n$1\r\na\r\n$1\r\nz\r\n"));
+        expect("blpop empty blocks", compare(ht, "blpop b c 0", "b"));
+        expect("negative timeout", compare(ht, "blpop a -1",
+               "-ERR timeout is not an integer or out of range\r\n"));
+        // test argc
+        expect("blpop err argc", compare(ht, "blpop a",
+                "-ERR wrong number of arguments (given 1, expected 2+)\r\n"));
+        // test type
+        expect("set b", compare(ht, "set b 1", "$2\r\nOK\r\n"));
+        expect("blpop str", compare(ht, "blpop a b 0",
+               "-ERR wrongtype operation\r\n"));
+    });
+    cleanup(ht);
+}
+
+void test_lmove(HashTable *ht) {
+    test_case("test lmove/blmove", {
+        // test gen
+        expect("rpush new list", compare(ht, "rpush a x y", ":2\r\n"));
+        expect("lmove a b = x", compare(ht, "lmove a b left right",
+               "$1\r\nx\r\n"));
+        expect("blmove a b = y", compare(ht, "blmove a b RIGHT LEFT 0",
+               "$1\r\ny\r\n"));
+        expect("a deleted", compare(ht, "exists a", ":0\r\n"));
+        expect("b = y x", compare(ht, "lrange b 0 -1",
+               "*2\r\n$1\r\ny\r\n$1\r\nx\r\n"));
+        expect("lmove empty", compare(ht, "lmove a b left left", "$-1\r\n"));
+        expect("blmove empty blocks", compare(ht, "blmove a b left left 0",
+               "b"));
+        expect("lmove bad dir", compare(ht, "lmove b a up left",
+               "-ERR syntax error\r\n"));
+        // test argc
+        expect("lmove err argc", compare(ht, "lmove a b left",
+                "-ERR wrong number of arguments (given 3, expected 4)\r\n"));
+        expect("blmove err argc", compare(ht, "blmove a b left left",
+                "-ERR wrong number of arguments (given 4, expected 5)\r\n"));
+        // test type
+        expect("set c", compare(ht, "set c 1", "$2\r\nOK\r\n"));
+        expect("lmove to str", compare(ht, "lmove b c left left",
+               "-ERR wrongtype operation\r\n"));
+    });
+    cleanup(ht);
+}
+
 void test_interpret_list(HashTable *ht) {
     test_push(ht);
     test_pop(ht);
@@ -279,5 +333,7 @@ void test_interpret_list(HashTable *ht) {
     test_lset(ht);
     test_lpos(ht);
     test_lrem(ht);
+    test_bpop(ht);
+    test_lmove(ht);
 }
 
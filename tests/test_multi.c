@@ -0,0 +1,121 @@
+#include <string.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+static int logged = 0;
+static char trace[16];  // what reached the log: m and e for markers, w writes
+
+static void count_writes(HashTable *ht, Command *cmd, long long dirty) {
+    int n = strlen(trace);
+    if (dirty < 0) {
+        if (n < 15) trace[n] = cmd->type == MULTI ? 'm' : 'e';
+        return;
+    }
+    if (ht->dirty == dirty) return;
+    watch_touch_command(cmd);
+    logged++;
+    if (n < 15) trace[n] = 'w';
+}
+
+// runs line for client c the way the server does
+static bool send(Client *c, HashTable *ht, char *line, char *expected) {
+    Command *cmd = parse(line);
+    long long dirty = ht->dirty;
+    char *res = multi_process(c, ht, cmd, count_writes);
+    if (res == NULL) {
+        res = interpret(ht, cmd);
+        count_writes(ht, cmd, dirty);
+    }
+    bool ok = strcmp(res, expected) == 0;
+    str_free(res);
+    command_free(cmd);
+    return ok;
+}
+
+void test_multi() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    Client c = {.fd = 5, .multi = NULL, .blocked = NULL};
+    test_case("test multi exec", {
+        expect("exec without multi", send(&c, ht, "exec",
+               "-ERR EXEC without MULTI\r\n"));
+        expect("discard without multi", send(&c, ht, "discard",
+               "-ERR DISCARD without MULTI\r\n"));
+        expect("multi", send(&c, ht, "multi", "$2\r\nOK\r\n"));
+        expect("nested multi", send(&c, ht, "multi",
+               "-ERR MULTI calls can not be nested\r\n"));
+        expect("queue hset", send(&c, ht, "hset h f v", "$6\r\nQUEUED\r\n"));
+        expect("queue incr", send(&c, ht, "incr n", "$6\r\nQUEUED\r\n"));
+        expect("queue blpop", send(&c, ht, "blpop q 0", "$6\r\nQUEUED\r\n"));
+        expect("queue get", send(&c, ht, "get n", "$6\r\nQUEUED\r\n"));
+        expect("nothing ran yet", !htable_exists(ht, "h"));
+        expect("exec", send(&c, ht, "exec",
+               "*4\r\n:1\r\n:1\r\n*-1\r\n$1\r\n1\r\n"));
+        expect("writes logged", logged == 2);
+        expect("between markers", strcmp(trace, "mwwe") == 0);
+        logged = 0;
+        trace[0] = '\0';
+        expect("closed", c.multi == NULL);
+        expect("empty exec", send(&c, ht, "multi", "$2\r\nOK\r\n") &&
+                             send(&c, ht, "exec", "*0\r\n"));
+        expect("read only exec", send(&c, ht, "multi", "$2\r\nOK\r\n") &&
+                                 send(&c, ht, "get n", "$6\r\nQUEUED\r\n") &&
+                                 send(&c, ht, "exec", "*1\r\n$1\r\n1\r\n"));
+        expect("no markers", trace[0] == '\0');
+    });
+    test_case("test multi discard and abort", {
+        expect("multi", send(&c, ht, "multi", "$2\r\nOK\r\n"));
+        expect("queue set", send(&c, ht, "set d 1", "$6\r\nQUEUED\r\n"));
+        expect("discard", send(&c, ht, "discard", "$2\r\nOK\r\n"));
+        expect("discarded", !htable_exists(ht, "d") && c.multi == NULL);
+        expect("multi", send(&c, ht, "multi", "$2\r\nOK\r\n"));
+        expect("queue set", send(&c, ht, "set d 1", "$6\r\nQUEUED\r\n"));
+        expect("bad arity", send(&c, ht, "get",
+               "-ERR wrong number of arguments (given 0, expected 1)\r\n"));
+        expect("unknown", send(&c, ht, "nope",
+               "-ERR unrecognized command\r\n"));
+        expect("exec aborts", send(&c, ht, "exec",
+               "-EXECABORT Transaction discarded because of previous errors.\r\n"));
+        expect("nothing ran", !htable_exists(ht, "d"));
+        expect("runtime error kept", send(&c, ht, "multi", "$2\r\nOK\r\n") &&
+               send(&c, ht, "get h", "$6\r\nQUEUED\r\n") &&
+               send(&c, ht, "set d 1", "$6\r\nQUEUED\r\n") &&
+               send(&c, ht, "exec",
+                    "*2\r\n-ERR wrongtype operation\r\n$2\r\nOK\r\n"));
+    });
+    Client d = {.fd = 6, .multi = NULL, .blocked = NULL};
+    test_case("test watch", {
+        expect("watch", send(&c, ht, "watch w x", "$2\r\nOK\r\n"));
+        expect("watch again", send(&c, ht, "watch w", "$2\r\nOK\r\n") &&
+                              c.nwatched == 2);
+        expect("read by other", send(&d, ht, "get w", "$-1\r\n"));
+        expect("other key", send(&d, ht, "set y 1", "$2\r\nOK\r\n"));
+        expect("noop write", send(&d, ht, "del x", ":0\r\n"));
+        expect("multi", send(&c, ht, "multi", "$2\r\nOK\r\n"));
+        expect("watch in multi", send(&c, ht, "watch z",
+               "-ERR WATCH inside MULTI is not allowed\r\n"));
+        expect("queue", send(&c, ht, "set w 1", "$6\r\nQUEUED\r\n"));
+        expect("exec runs", send(&c, ht, "exec", "*1\r\n$2\r\nOK\r\n"));
+        expect("unwatched by exec", c.nwatched == 0);
+
+        expect("watch", send(&c, ht, "watch w", "$2\r\nOK\r\n"));
+        expect("touched by other", send(&d, ht, "append w 2", ":2\r\n"));
+        expect("multi", send(&c, ht, "multi", "$2\r\nOK\r\n"));
+        expect("queue", send(&c, ht, "set w 3", "$6\r\nQUEUED\r\n"));
+        expect("exec aborted", send(&c, ht, "exec", "*-1\r\n"));
+        expect("w kept", strcmp(htable_get(ht, "w"), "12") == 0);
+
+        expect("watch", send(&c, ht, "watch w", "$2\r\nOK\r\n"));
+        expect("flushed", send(&d, ht, "flushall", "$2\r\nOK\r\n"));
+        expect("multi", send(&c, ht, "multi", "$2\r\nOK\r\n"));
+        expect("exec aborted", send(&c, ht, "exec", "*-1\r\n"));
+
+        expect("watch", send(&c, ht, "watch w", "$2\r\nOK\r\n"));
+        expect("unwatch", send(&c, ht, "unwatch", "$2\r\nOK\r\n") &&
+                          c.nwatched == 0);
+        expect("write after unwatch", send(&d, ht, "set w 4", "$2\r\nOK\r\n"));
+        expect("multi", send(&c, ht, "multi", "$2\r\nOK\r\n"));
+        expect("exec runs", send(&c, ht, "exec", "*0\r\n"));
+    });
+    htable_free(ht);
+}
@@ -3,23 +3,87 @@
 #include "test.h"
 #include "miniunit.h"
 
-static bool check_cmd(Command *cmd, int type, char *argv[]) {
-    for (int i = 0; i < cmd->argc; i++) {
+static bool check_cmd(Command *cmd, int type, int argc, char *argv[]) {
+    bool ok = cmd->type == type && cmd->argc == argc;
+    for (int i = 0; ok && i < cmd->argc; i++) {
         // if (cmd->argv[i] != NULL) puts(cmd->argv[i]);
-        if (strcmp(cmd->argv[i], argv[i]) != 0) return false;
+        ok = strcmp(cmd->argv[i], argv[i]) == 0 &&
+             cmd->argl[i] == (int)strlen(argv[i]);
+    }
+    command_free(cmd);
+    return ok;
+}
+
+static bool check_join(char *line, char *expected) {
+    Command *cmd = parse(line);
+    char *joined = command_join(cmd);
+    Command *again = parse(joined);
+    bool ok = strcmp(joined, expected) == 0 && again->argc == cmd->argc;
+    for (int i = 0; ok && i < cmd->argc; i++) {
+        ok = strcmp(again->argv[i], cmd->argv[i]) == 0;
+    }
+    free(joined);
+    command_free(again);
+    command_free(cmd);
+    return ok;
+}
+
+static bool check_registry() {
+    for (int i = 0; i <= NOOP; i++) {
+        char *name = command_def(i)->name;
+        if (name != NULL && command_lookup(name, strlen(name)) != i) return false;
     }
     return true;
 }
 
 void test_parser() {
+    char line[] = "get  key\nset a b";
+    Command *cmd = parse_line(NULL, line, 8);
+    Command *dup = command_dup(cmd);
     test_case("test parser", {
-        expect("parse: del", check_cmd(parse("del"), DEL, NULL));
-        expect("parse: set 1", check_cmd(parse("set 1"), SET, (char *[]){"1"}));
+        expect("parse: del", check_cmd(parse("del"), DEL, 0, NULL));
+        expect("parse: set 1", check_cmd(parse("set 1"), SET, 1, (char *[]){"1"}));
         expect("parse: lpush 1 2 3", check_cmd(parse("lpush 1 2 3"), LPUSH,
-                                               (char *[]){"1", "2", "3"}));
+                                               3, (char *[]){"1", "2", "3"}));
         expect("parse: sadd 1 2 3 4", check_cmd(parse("sadd 1 2 3 4"), SADD,
-                                                (char *[]){"1", "2", "3", "4"}));
-        expect("parse: ''", check_cmd(parse(""), NOOP, NULL));
+                                                4, (char *[]){"1", "2", "3", "4"}));
+        expect("parse: ''", check_cmd(parse(""), NOOP, 0, NULL));
+        expect("parse: '  '", check_cmd(parse(" \t "), NOOP, 0, NULL));
+        expect("parse: quoted", check_cmd(parse("set 'a b' \"it's\" ''"), SET,
+                                          3, (char *[]){"a b", "it's", ""}));
+        expect("parse: spaces", check_cmd(parse("  get   x  "), GET,
+                                          1, (char *[]){"x"}));
+        expect("parse: unknown", check_cmd(parse("nope 1"), UNKNOWN,
+                                           1, (char *[]){"1"}));
+    });
+    test_case("test command lookup", {
+        expect("every name resolves", check_registry());
+        expect("parse: SET", check_cmd(parse("SET a 1"), SET, 2, (char *[]){"a", "1"}));
+        expect("parse: sMisMember", check_cmd(parse("sMisMember s"), SMISMEMBER,
+                                              1, (char *[]){"s"}));
+        expect("prefix", command_lookup("getrange", 3) == GET);
+        expect("longer name", command_lookup("gets", 4) == UNKNOWN);
+        expect("too long", command_lookup("smismembersmismember", 20) == UNKNOWN);
+        expect("not a letter", command_lookup("#et", 3) == UNKNOWN);
+    });
+    test_case("test parse in place", {
+        expect("tokens point into line", cmd->type == GET &&
+                                         cmd->argv[0] == line + 5);
+        expect("stops at len", cmd->argc == 1 && line[8] == '\0');
+        expect("dup owns tokens", dup->argv[0] != cmd->argv[0] &&
+                                  strcmp(dup->argv[0], "key") == 0);
+    });
+    test_case("test command join", {
+        expect("join: plain", check_join("set a 1", "set a 1"));
+        expect("join: quoted", check_join("set 'a b' \"it's\"",
+                                          "set \"a b\" \"it's\""));
+        expect("join: double quote", check_join("set a 'say \"hi\"'",
+                                                "set a 'say \"hi\"'"));
+        expect("join: empty", check_join("set a ''", "set a \"\""));
+        expect("join: both quotes", check_join("set a b'c\"d",
+                                               "set a b'c\"d"));
     });
+    command_free(dup);
+    command_free(cmd);
     return;
 }
@@ -93,10 +93,12 @@ void test_smembers(HashTable *ht) {
         // test gen
         expect("sadd new set", compare(ht, "sadd a 1 2 3 4 5", ":5\r\n"));
         expect("smembers a", compare(ht, "smembers a",
-               "*5\r\n:1\r\n:2\r\n:3\r\n:4\r\n:5\r\n"));
+               "*5\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n$1\r\n4\r\n"
+               "$1\r\n5\r\n"));
         expect("sadd new members", compare(ht, "sadd a 1 6 7 8", ":3\r\n"));
         expect("smembers a", compare(ht, "smembers a",
-               "*8\r\n:8\r\n:1\r\n:2\r\n:3\r\n:4\r\n:5\r\n:6\r\n:7\r\n"));
+               "*8\r\n$1\r\n8\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n$1\r\n4\r\n"
+               "$1\r\n5\r\n$1\r\n6\r\n$1\r\n7\r\n"));
         expect("smembers non existing set", compare(ht, "smembers b", "*0\r\n"));
         // test argc
         expect("empty smembers", compare(ht, "smembers",
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/common.h"
+#include "miniunit.h"
+#include "test.h"
+
+#define TEST_SNAPSHOT "/tmp/verokv-test-snapshot.dat"
+
+static long long file_size(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? st.st_size : -1;
+}
+
+// whether the reply to line holds field
+static bool info_has(HashTable *ht, char *line, char *field) {
+    Command *cmd = parse(line);
+    char *res = interpret(ht, cmd);
+    bool found = strstr(res, field) != NULL;
+    str_free(res);
+    command_free(cmd);
+    return found;
+}
+
+static void test_bgsave() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "k%d", i);
+        htable_set(ht, key, key);
+    }
+    unlink(TEST_SNAPSHOT);
+    bool started = snapshot_bgsave(ht, TEST_SNAPSHOT);
+    bool again = snapshot_bgsave(ht, TEST_SNAPSHOT);
+    SnapshotStats running = snapshot_stats();
+    long long dirty = ht->dirty;
+    htable_set(ht, "after", "fork");
+    snapshot_wait();
+    SnapshotStats done = snapshot_stats();
+    test_case("test bgsave", {
+        expect("started", started);
+        expect("one at a time", !again);
+        expect("in progress", running.in_progress &&
+                              running.keys_total == 1000);
+        expect("finished", !done.in_progress && done.last_ok);
+        expect("saved the fork's data set", done.saved_dirty == dirty);
+        expect("file written", file_size(TEST_SNAPSHOT) > 0);
+        expect("info", info_has(ht, "info persistence",
+                                "rdb_bgsave_in_progress:0\r\n"));
+        expect("changes since save", info_has(ht, "info",
+                                     "rdb_changes_since_last_save:1\r\n"));
+        expect("unknown section", compare(ht, "info nope", "$0\r\n\r\n"));
+        expect("info argc", compare(ht, "info a b",
+               "-ERR wrong number of arguments (given 2, expected 0..1)\r\n"));
+    });
+    unlink(TEST_SNAPSHOT);
+    htable_free(ht);
+}
+
+static void test_crc32c() {
+    const char *check = "123456789";
+    uint32_t head = crc32c(0, check, 4);
+    test_case("test crc32c", {
+        expect("check value", crc32c(0, check, 9) == 0xe3069283);
+        expect("empty", crc32c(0, "", 0) == 0);
+        expect("chained", crc32c(head, check + 4, 5) == 0xe3069283);
+    });
+}
+
+static void flip_byte(const char *filename, long offset) {
+    FILE *f = fopen(filename, "r+b");
+    fseek(f, offset, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, offset, SEEK_SET);
+    fputc(c ^ 0x20, f);
+    fclose(f);
+}
+
+static void test_round_trip() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    compare(ht, "set s hello", "+OK\r\n");
+    compare(ht, "setbit bin 7 1", ":0\r\n");
+    compare(ht, "setbit bin 100 1", ":0\r\n");
+    compare(ht, "hset h f1 v1 f2 v2", ":2\r\n");
+    compare(ht, "hdel h f1", ":1\r\n");
+    compare(ht, "rpush l a b c", ":3\r\n");
+    compare(ht, "sadd st x y z", ":3\r\n");
+    compare(ht, "srem st y", ":1\r\n");
+    compare(ht, "pfadd hll a b c d", ":1\r\n");
+    unlink(TEST_SNAPSHOT);
+    int saved = save_snapshot(ht, TEST_SNAPSHOT);
+
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    htable_set(res, "stale", "gone");
+    int loaded = load_snapshot(res, TEST_SNAPSHOT);
+    test_case("test snapshot round trip", {
+        expect("saved", saved == 0);
+        expect("loaded", loaded == 0 && res->used == ht->used);
+        expect("old keys replaced", compare(res, "exists stale", ":0\r\n"));
+        expect("string", compare(res, "get s", "$5\r\nhello\r\n"));
+        expect("binary string", compare(res, "bitcount bin", ":2\r\n") &&
+                                compare(res, "strlen bin", ":13\r\n"));
+        expect("hash", compare(res, "hgetall h",
+                               "*2\r\n$2\r\nf2\r\n$2\r\nv2\r\n"));
+        expect("list order", compare(res, "lrange l 0 -1",
+               "*3\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\nc\r\n"));
+        expect("set", compare(res, "smismember st x y z",
+                              "*3\r\n:1\r\n:0\r\n:1\r\n") &&
+                      compare(res, "sismember st x", ":1\r\n"));
+        expect("hyperloglog", compare(res, "pfcount hll", ":4\r\n"));
+    });
+
+    long size = file_size(TEST_SNAPSHOT);
+    flip_byte(TEST_SNAPSHOT, size / 2);
+    int corrupt = load_snapshot(res, TEST_SNAPSHOT);
+    bool untouched = compare(res, "get s", "$5\r\nhello\r\n");
+    flip_byte(TEST_SNAPSHOT, size / 2);
+    truncate(TEST_SNAPSHOT, size - 5);
+    int truncated = load_snapshot(res, TEST_SNAPSHOT);
+    unlink(TEST_SNAPSHOT);
+    int missing = load_snapshot(res, TEST_SNAPSHOT);
+    test_case("test snapshot damage", {
+        expect("corrupt byte", corrupt == -2);
+        expect("left alone", untouched && res->used == ht->used);
+        expect("truncated", truncated == -2);
+        expect("missing", missing == -1);
+        expect("still left alone", compare(res, "llen l", ":3\r\n"));
+    });
+    htable_free(ht);
+    htable_free(res);
+}
+
+// the loader sizes the table from the key count in the header up front
+static void test_presize() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "k%d", i);
+        htable_set(ht, key, key);
+    }
+    save_snapshot(ht, TEST_SNAPSHOT);
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    int loaded = load_snapshot(res, TEST_SNAPSHOT);
+    test_case("test snapshot presize", {
+        expect("loaded", loaded == 0 && res->used == 1000);
+        expect("sized once", res->size == next_prime(1000 * 10 / 7 + 1));
+        expect("found", compare(res, "get k999", "$4\r\nk999\r\n"));
+    });
+    unlink(TEST_SNAPSHOT);
+    htable_free(ht);
+    htable_free(res);
+}
+
+// enough keys for several sections, saved and loaded by several threads
+static void test_sections() {
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    char key[16];
+    for (int i = 0; i < 50000; i++) {
+        sprintf(key, "k%d", i);
+        htable_set(ht, key, key);
+    }
+    compare(ht, "hset h f v", ":1\r\n");
+    compare(ht, "rpush l a b", ":2\r\n");
+    save_snapshot(ht, TEST_SNAPSHOT);
+    HashTable *res = htable_init(HT_BASE_SIZE);
+    int loaded = load_snapshot(res, TEST_SNAPSHOT);
+    bool all = loaded == 0;
+    for (int i = 0; all && i < 50000; i++) {
+        sprintf(key, "k%d", i);
+        HashTableItem *item = htable_search(res, key);
+        all = item != NULL && strcmp(item->value, key) == 0;
+    }
+    test_case("test snapshot sections", {
+        expect("loaded", loaded == 0 && res->used == 50002);
+        expect("every key", all);
+        expect("hash", compare(res, "hget h f", "$1\r\nv\r\n"));
+        expect("list", compare(res, "lindex l 1", "$1\r\nb\r\n"));
+    });
+
+    long size = file_size(TEST_SNAPSHOT);
+    flip_byte(TEST_SNAPSHOT, size / 3);
+    int corrupt = load_snapshot(res, TEST_SNAPSHOT);
+    flip_byte(TEST_SNAPSHOT, size / 3);
+    flip_byte(TEST_SNAPSHOT, size - 10);
+    int bad_index = load_snapshot(res, TEST_SNAPSHOT);
+    test_case("test snapshot damaged section", {
+        expect("corrupt section", corrupt == -2);
+        expect("corrupt index", bad_index == -2);
+        expect("left alone", res->used == 50002);
+    });
+    unlink(TEST_SNAPSHOT);
+    htable_free(ht);
+    htable_free(res);
+}
+
+// files from before the versioned format hold raw size_t lengths
+static void test_legacy() {
+    FILE *f = fopen(TEST_SNAPSHOT, "wb");
+    size_t key_len = 3, value_len = 5;
+    fwrite(&key_len, sizeof(size_t), 1, f);
+    fwrite("old", 1, key_len, f);
+    fwrite(&value_len, sizeof(size_t), 1, f);
+    fwrite("value", 1, value_len, f);
+    fclose(f);
+    HashTable *ht = htable_init(HT_BASE_SIZE);
+    int loaded = load_snapshot(ht, TEST_SNAPSHOT);
+    test_case("test legacy snapshot", {
+        expect("loaded", loaded == 0);
+        expect("value", compare(ht, "get old", "$5\r\nvalue\r\n"));
+    });
+
+    unlink(TEST_SNAPSHOT);
+    htable_free(ht);
+}
+
+void test_snapshot() {
+    test_bgsave();
+    test_crc32c();
+    test_round_trip();
+    test_presize();
+    test_sections();
+    test_legacy();
+}
@@ -85,9 +85,11 @@ void test_mget(HashTable *ht) {
     test_case("test mget", {
         // test gen
         expect("mset keyvals", compare(ht, "mset a 1 b 2 c 3", "$2\r\nOK\r\n"));
-        expect("mget 1 keyval", compare(ht, "mget a", "*1\r\n:1\r\n"));
-        expect("mget keyvals", compare(ht, "mget b c", "*2\r\n:2\r\n:3\r\n"));
-        expect("mget ex & nex", compare(ht, "mget a d", "*2\r\n:1\r\n$-1\r\n"));
+        expect("mget 1 keyval", compare(ht, "mget a", "*1\r\n$1\r\n1\r\n"));
+        expect("mget keyvals", compare(ht, "mget b c",
+               "*2\r\n$1\r\n2\r\n$1\r\n3\r\n"));
+        expect("mget ex & nex", compare(ht, "mget a d",
+               "*2\r\n$1\r\n1\r\n$-1\r\n"));
         cleanup(ht);
         // test argc
         expect("empty mget", compare(ht, "mget",
@@ -261,6 +263,107 @@ void test_decrby(HashTable *ht) {
     cleanup(ht);
 }
 
+void test_append(HashTable *ht) {
+    test_case("test append", {
+        // test gen
+        expect("append new key", compare(ht, "append a hello", ":5\r\n"));
+        expect("append a", compare(ht, "append a ' world'", ":11\r\n"));
+        expect("get a", compare(ht, "get a", "$11\r\nhello world\r\n"));
+        int moves = 0;
+        char *prev = htable_get(ht, "a");
+        for (int i = 0; i < 10000; i++) {
+            htable_append(ht, "a", "0123456789");
+            if (htable_get(ht, "a") != prev) moves++;
+            prev = htable_get(ht, "a");
+        }
+        expect("appends grow geometrically", moves < 20);
+        expect("strlen after appends", compare(ht, "strlen a", ":100011\r\n"));
+        expect("spare capacity", str_cap(htable_get(ht, "a")) >= 100011);
+        // test argc
+        expect("append err argc", compare(ht, "append a",
+               "-ERR wrong number of arguments (given 1, expected 2)\r\n"));
+        // test type
+        expect("hset b", compare(ht, "hset b 1 2", ":1\r\n"));
+        expect("append hash", compare(ht, "append b x",
+               "-ERR wrongtype operation\r\n"));
+    });
+    cleanup(ht);
+}
+
+void test_getrange(HashTable *ht) {
+    test_case("test getrange/setrange", {
+        // test gen
+        expect("set a", compare(ht, "set a 'This is a string'", "$2\r\nOK\r\n"));
+        expect("getrange 0 3", compare(ht, "getrange a 0 3", "$4\r\nThis\r\n"));
+        expect("getrange -3 -1", compare(ht, "getrange a -3 -1",
+               "$3\r\ning\r\n"));
+        expect("getrange 10 100", compare(ht, "getrange a 10 100",
+               "$6\r\nstring\r\n"));
+        expect("getrange empty", compare(ht, "getrange a 5 2", "$0\r\n\r\n"));
+        expect("getrange missing", compare(ht, "getrange b 0 -1",
+               "$0\r\n\r\n"));
+        expect("setrange a 10", compare(ht, "setrange a 10 STRING", ":16\r\n"));
+        expect("get a", compare(ht, "get a",
+               "$16\r\nThis is a STRING\r\n"));
+        expect("setrange pads", compare(ht, "setrange b 2 x", ":3\r\n"));
+        expect("b = \\0\\0x", memcmp(htable_get(ht, "b"), "\0\0x", 3) == 0);
+        expect("setrange empty", compare(ht, "setrange c 5 ''", ":0\r\n"));
+        expect("c not created", compare(ht, "exists c", ":0\r\n"));
+        expect("bad offset", compare(ht, "setrange a -1 x",
+               "-ERR offset is out of range\r\n"));
+        // test argc
+        expect("getrange err argc", compare(ht, "getrange a 1",
+               "-ERR wrong number of arguments (given 2, expected 3)\r\n"));
+        expect("setrange err argc", compare(ht, "setrange a 1",
+               "-ERR wrong number of arguments (given 2, expected 3)\r\n"));
+        // test type
+        expect("lpush d", compare(ht, "lpush d 1", ":1\r\n"));
+        expect("getrange list", compare(ht, "getrange d 0 1",
+               "-ERR wrongtype operation\r\n"));
+        expect("setrange list", compare(ht, "setrange d 0 1",
+               "-ERR wrongtype operation\r\n"));
+    });
+    cleanup(ht);
+}
+
+static void test_throttle(HashTable *ht) {
+    Command *cmd = parse("throttle a 2 1 3600");
+    str_free(interpret(ht, cmd));
+    test_case("test throttle", {
+        // test gen, 1 per hour with bursts of 2 more
+        expect("logged as set", cmd->type == SET && cmd->argc == 2 &&
+               strcmp(cmd->argv[0], "a") == 0 &&
+               strcmp(cmd->argv[1], htable_get(ht, "a")) == 0);
+        expect("second", compare(ht, "throttle a 2 1 3600",
+               "*5\r\n:0\r\n:3\r\n:1\r\n:-1\r\n:7200\r\n"));
+        expect("third", compare(ht, "throttle a 2 1 3600",
+               "*5\r\n:0\r\n:3\r\n:0\r\n:-1\r\n:10800\r\n"));
+        expect("limited", compare(ht, "throttle a 2 1 3600",
+               "*5\r\n:1\r\n:3\r\n:0\r\n:3600\r\n:10800\r\n"));
+        expect("too large", compare(ht, "throttle b 2 1 3600 4",
+               "*5\r\n:1\r\n:3\r\n:3\r\n:-1\r\n:0\r\n"));
+        expect("b not created", compare(ht, "exists b", ":0\r\n"));
+        expect("quantity", compare(ht, "throttle b 2 1 3600 3",
+               "*5\r\n:0\r\n:3\r\n:0\r\n:-1\r\n:10800\r\n"));
+        expect("bad count", compare(ht, "throttle c 2 0 60",
+               "-ERR count and period must be positive\r\n"));
+        expect("bad burst", compare(ht, "throttle c -1 1 60",
+               "-ERR value is not an integer or out of range\r\n"));
+        // test argc
+        expect("throttle err argc", compare(ht, "throttle a 1 1",
+               "-ERR wrong number of arguments (given 3, expected 4..5)\r\n"));
+        // test type
+        expect("set c", compare(ht, "set c hello", "$2\r\nOK\r\n"));
+        expect("throttle string", compare(ht, "throttle c 2 1 60",
+               "-ERR wrongtype operation\r\n"));
+        expect("lpush d", compare(ht, "lpush d 1", ":1\r\n"));
+        expect("throttle list", compare(ht, "throttle d 2 1 60",
+               "-ERR wrongtype operation\r\n"));
+    });
+    command_free(cmd);
+    cleanup(ht);
+}
+
 void test_interpret_str(HashTable *ht) {
     test_set(ht);
     test_get(ht);
@@ -271,5 +374,8 @@ void test_interpret_str(HashTable *ht) {
     test_decr(ht);
     test_incrby(ht);
     test_decrby(ht);
+    test_append(ht);
+    test_getrange(ht);
+    test_throttle(ht);
 }
 